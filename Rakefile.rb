@@ -10,7 +10,9 @@ QBC.compile_files("lib/qbc.cpp", \
 		  "lib/core.cpp", \
 		  "lib/function.cpp", \
 		  "lib/instruction.cpp", \
+		  "lib/liveness.cpp", \
 		  "lib/module.cpp", \
+		  "lib/optimize.cpp", \
 		  "lib/qbparse.c", \
 		  "lib/qblex.c", \
 		  "lib/stmt.cpp", \
@@ -41,9 +43,14 @@ QBRT.include 'lib'
 QBRT.compile_files("lib/qbrt.cpp", \
 		  "lib/core.cpp", \
 		  "lib/function.cpp", \
+		  "lib/instruction.cpp", \
 		  "lib/io.cpp", \
+		  "lib/iouring.cpp", \
 		  "lib/module.cpp", \
 		  "lib/schedule.cpp", \
+		  "lib/snapshot.cpp", \
+		  "lib/socket.cpp", \
+		  "lib/spawn.cpp", \
 		  "lib/type.cpp", \
 		  )
 QBRT.obj_dir = 'o/qbrt'
@@ -159,26 +166,54 @@ TestFiles = ['hello.uqb',
 	'arithmetic.uqb',
 	'badmath.uqb',
 	'bool.uqb',
+	'copy_pipes.uqb',
+	'dispatch.uqb',
 	'echo.uqb',
 	'fact.uqb',
+	'file_lines.uqb',
+	'fold.uqb',
+	'fork_failure.uqb',
 	'fork_hello.uqb',
+	'fork_snapshot.uqb',
+	'getlines.uqb',
+	'lazy_call.uqb',
+	'lazy_type.uqb',
 	'listprint.uqb',
+	'liveness.uqb',
 	'matchargs.uqb',
 	'maybe.uqb',
+	'migrate.uqb',
 	'missingmodule.uqb',
+	'mmap_lines.uqb',
 	'multimethod.uqb',
 	'newproc.uqb',
 	'param_types.uqb',
 	'polymorph.uqb',
+	'preload.uqb',
+	'priority.uqb',
+	'read_bytes.uqb',
+	'reductions.uqb',
+	'socket_echo.uqb',
+	'spawn.uqb',
 	'struct.uqb',
+	'timers.uqb',
+	'warm.uqb',
+	'write_loop.uqb',
 ]
 
-def test_uqb(file)
+# mode is :module, :image, :snapshot or :optimize
+def test_uqb(file, mode=:module)
 	passed = false
 	Dir.chdir "T/"
 	mod = file.chomp(File.extname(file))
-	ENV['QBPATH'] = "../libqb:T"
-	sh "../qbc #{mod}"
+	ENV['QBPATH'] = "../libqb:."
+	if mode == :image
+		sh "../qbc --image #{mod}"
+	elsif mode == :optimize
+		sh "../qbc -O #{mod}"
+	else
+		sh "../qbc #{mod}"
+	end
 	Dir.chdir "../"
 	input_file = "T/DATA/#{mod}.input"
 	args_file = "T/DATA/#{mod}.args"
@@ -187,7 +222,24 @@ def test_uqb(file)
 	else
 		args = ""
 	end
-	cmd = "QBPATH=libqb:T ./qbrt #{mod} #{args} 2>&1"
+	# environment for tests that need the scheduler set up a certain way
+	env_file = "T/DATA/#{mod}.env"
+	if File.exist? env_file
+		env = File.read(env_file).strip
+	else
+		env = ""
+	end
+	if mode == :image
+		# the image has everything it needs, so no QBPATH
+		cmd = "env -u QBPATH #{env} ./qbrt T/#{mod}.qbx #{args} 2>&1"
+	elsif mode == :snapshot
+		# anything from __warm or a failed snapshot is output too
+		cmd = "(env QBPATH=libqb:T #{env} ./qbrt --snapshot" \
+			" T/#{mod}.qbs #{mod}" \
+			" && env -u QBPATH #{env} ./qbrt T/#{mod}.qbs #{args}) 2>&1"
+	else
+		cmd = "env QBPATH=libqb:T #{env} ./qbrt #{mod} #{args} 2>&1"
+	end
 	if File.exist? input_file
 		output = `cat #{input_file} | #{cmd}`
 	else
@@ -202,13 +254,37 @@ def test_uqb(file)
 		puts "Correct output:\n#{output}..."
 		passed = true
 	end
-	return passed
+	return check_code(mod, mode) && passed
 end
 
-task :T => ['qbc', 'qbrt'] do
+# compare the functions qbi shows for the compiled module, if the test
+# has a T/DATA/<mod>.qbi file, or <mod>.O.qbi for the optimized code
+def check_code(mod, mode)
+	if mode == :optimize
+		qbi_file = "T/DATA/#{mod}.O.qbi"
+	else
+		qbi_file = "T/DATA/#{mod}.qbi"
+	end
+	if not File.exist? qbi_file
+		return true
+	end
+	listing = `env QBPATH=libqb:T ./qbi #{mod}`
+	# skip the header and resources, their offsets change too easily
+	start = listing.index(/^\w+ function: /)
+	code = start ? listing[start..-1] : listing
+	expected = File.read(qbi_file)
+	if (code != expected)
+		puts "Expected code:\n#{expected}..."
+		puts "Actual code:\n#{code}..."
+		return false
+	end
+	return true
+end
+
+def test_all(mode=:module)
 	failures = []
 	TestFiles.each do |t|
-		if not test_uqb t
+		if not test_uqb(t, mode)
 			failures << t
 		end
 	end
@@ -220,3 +296,22 @@ task :T => ['qbc', 'qbrt'] do
 		puts failures
 	end
 end
+
+task :T => ['qbc', 'qbi', 'qbrt'] do
+	test_all
+end
+
+# run the tests from prelinked application images
+task :Timage => ['qbc', 'qbi', 'qbrt'] do
+	test_all(:image)
+end
+
+# run the tests from snapshots taken after __warm
+task :Tsnapshot => ['qbc', 'qbi', 'qbrt'] do
+	test_all(:snapshot)
+end
+
+# run the tests compiled w/ qbc -O
+task :Toptimize => ['qbc', 'qbi', 'qbrt'] do
+	test_all(:optimize)
+end
@@ -230,6 +230,9 @@ stmt(A) ::= CALL reg(B) reg(C) reg(D). {
 stmt(A) ::= CALL reg(B) reg(C). {
 	A = new call_stmt(B, C);
 }
+stmt(A) ::= CALLLAZY reg(B) reg(C). {
+	A = new calllazy_stmt(B, C);
+}
 stmt(A) ::= CFAILURE reg(C) HASHTAG(B). {
 	A = new cfailure_stmt(C, B->strip_first());
 }
@@ -326,7 +329,10 @@ stmt(A) ::= PATTERNVAR reg(B). {
 	A = new patternvar_stmt(B);
 }
 stmt(A) ::= RECV reg(B). {
-	A = new recv_stmt(B);
+	A = new recv_stmt(B, AsmReg::create_void());
+}
+stmt(A) ::= RECV reg(B) reg(C). {
+	A = new recv_stmt(B, C);
 }
 stmt(A) ::= STRACC reg(B) reg(C). {
 	A = new stracc_stmt(B, C);
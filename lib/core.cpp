@@ -34,6 +34,7 @@ static void init_primitive_modules()
 	PRIMITIVE_MODULE[VT_VECTOR] = "Vector";
 	PRIMITIVE_MODULE[VT_STREAM] = "io";
 	PRIMITIVE_MODULE[VT_PROMISE] = "core";
+	PRIMITIVE_MODULE[VT_THUNK] = "core";
 	PRIMITIVE_MODULE[VT_KIND] = "core";
 	PRIMITIVE_MODULE[VT_FAILURE] = "core";
 }
@@ -55,6 +56,7 @@ static void init_primitive_names()
 	PRIMITIVE_NAME[VT_VECTOR] = "Vector";
 	PRIMITIVE_NAME[VT_STREAM] = "Stream";
 	PRIMITIVE_NAME[VT_PROMISE] = "Promise";
+	PRIMITIVE_NAME[VT_THUNK] = "Thunk";
 	PRIMITIVE_NAME[VT_KIND] = "Kind";
 	PRIMITIVE_NAME[VT_FAILURE] = "Failure";
 }
@@ -128,6 +130,7 @@ Type TYPE_VECTOR(VT_VECTOR);
 Type TYPE_STREAM(VT_STREAM);
 Type TYPE_PATTERNVAR(VT_PATTERNVAR);
 Type TYPE_PROMISE(VT_PROMISE);
+Type TYPE_THUNK(VT_THUNK);
 Type TYPE_FAILURE(VT_FAILURE);
 
 
@@ -186,6 +189,10 @@ void qbrt_value::copy(qbrt_value &dst, const qbrt_value &src)
 		case VT_CONSTRUCT:
 			qbrt_value::construct(dst, src.type, src.data.cons);
 			break;
+		case VT_STREAM:
+			// streams are shared, so a process can be given one
+			qbrt_value::stream(dst, src.data.stream);
+			break;
 		default:
 			cerr << "wtf you can't copy that!\n";
 			break;
@@ -232,6 +239,10 @@ void qbrt_value::append_type(ostringstream &out, const qbrt_value &val)
 		case VT_FUNCTION:
 			load_function_value_types(out, *val.data.f);
 			break;
+		case VT_REF:
+			// like a context value. dispatch on what it refers to
+			append_type(out, *val.data.ref);
+			break;
 		default:
 			out << val.type->module << '/' << val.type->name;
 			break;
@@ -1,6 +1,7 @@
 #include "qbrt/function.h"
 #include "qbrt/resourcetype.h"
 #include "qbrt/module.h"
+#include "qbrt/type.h"
 #include <cstdlib>
 
 using namespace std;
@@ -117,6 +118,33 @@ void reassign_func(function_value &funcval, const Function *newfunc)
 	funcval.func = newfunc;
 }
 
+function_value * dup_function_value(const function_value &src)
+{
+	function_value *dst = new function_value(src.func);
+	if (dst->regc < src.regc) {
+		dst->realloc(src.regc);
+	}
+	for (uint8_t i(0); i<src.regc; ++i) {
+		const qbrt_value &val(src.value(i));
+		switch (val.type->id) {
+			case VT_STRING:
+				qbrt_value::str(dst->value(i), *val.data.str);
+				break;
+			case VT_THUNK:
+				qbrt_value::thunk(dst->value(i)
+						, dup_function_value(*val.data.f));
+				break;
+			case VT_PROMISE:
+				val.data.promise->retain();
+				// fall through
+			default:
+				dst->value(i) = val;
+				break;
+		}
+	}
+	return dst;
+}
+
 
 Failure::Failure(const std::string type_label, const string &module
 		, const char *fname, int pc
@@ -31,6 +31,7 @@ uint8_t iwriter(ostream &out, const I &i)
 void init_instruction_sizes()
 {
 	INSTRUCTION_SIZE[OP_CALL] = call_instruction::SIZE;
+	INSTRUCTION_SIZE[OP_CALL_LAZY] = call_lazy_instruction::SIZE;
 	INSTRUCTION_SIZE[OP_CALL1] = call1_instruction::SIZE;
 	INSTRUCTION_SIZE[OP_CALL2] = call2_instruction::SIZE;
 	INSTRUCTION_SIZE[OP_RETURN] = return_instruction::SIZE;
@@ -92,6 +93,7 @@ DEFINE_IWRITER(consti);
 DEFINE_IWRITER(consts);
 DEFINE_IWRITER(consthash);
 DEFINE_IWRITER(call);
+DEFINE_IWRITER(call_lazy);
 DEFINE_IWRITER(call1);
 DEFINE_IWRITER(call2);
 DEFINE_IWRITER(fork);
@@ -124,6 +126,8 @@ void init_writers()
 {
 	WRITER[OP_IADD] = (instruction_writer) iwriter<binaryop_instruction>;
 	WRITER[OP_CALL] = (instruction_writer) iwriter<call_instruction>;
+	WRITER[OP_CALL_LAZY] =
+		(instruction_writer) iwriter<call_lazy_instruction>;
 	WRITER[OP_CALL1] = (instruction_writer) iwriter<call1_instruction>;
 	WRITER[OP_CALL2] = (instruction_writer) iwriter<call2_instruction>;
 	WRITER[OP_RETURN] = (instruction_writer) iwriter<return_instruction>;
@@ -21,6 +21,21 @@ struct call_instruction
 	static const uint8_t SIZE = 5;
 };
 
+struct call_lazy_instruction
+: public instruction
+{
+	uint16_t result_reg;
+	uint16_t func_reg;
+
+	call_lazy_instruction(reg_t result, reg_t func)
+		: instruction(OP_CALL_LAZY)
+		, result_reg(result)
+		, func_reg(func)
+	{}
+
+	static const uint8_t SIZE = 5;
+};
+
 struct call1_instruction
 : public instruction
 {
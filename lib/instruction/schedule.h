@@ -20,17 +20,23 @@ struct newproc_instruction
 	static const uint8_t SIZE = 5;
 };
 
+/**
+ * Receive a message. The timeout register is void to wait for as
+ * long as it takes, otherwise it's the milliseconds to wait.
+ */
 struct recv_instruction
 : public instruction
 {
 	uint16_t dst;
+	uint16_t timeout;
 
-	recv_instruction(reg_t dst)
+	recv_instruction(reg_t dst, reg_t timeout)
 	: instruction(OP_RECV)
 	, dst(dst)
+	, timeout(timeout)
 	{}
 
-	static const uint8_t SIZE = 3;
+	static const uint8_t SIZE = 5;
 };
 
 #pragma pack(pop)
@@ -1,54 +1,1209 @@
 #include "io.h"
+#include "qbrt/schedule.h"
 #include <iostream>
 #include <stdio.h>
 #include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 using namespace std;
 
+#define MAX_EPOLL_EVENTS 16
+#define COPY_CHUNK_SIZE	(1024 * 1024)
 
-void StreamGetline::handle()
+
+bool StreamIO::blocking() const
+{
+	return !stream->pollable();
+}
+
+bool ReadBuffer::getline(string &line)
+{
+	const char *start(data + begin);
+	const char *nl((const char *) memchr(start, '\n', end - begin));
+	if (!nl) {
+		return false;
+	}
+	line.assign(start, nl - start);
+	begin += nl - start + 1;
+	if (begin == end) {
+		reset();
+	}
+	return true;
+}
+
+void ReadBuffer::take(string &bytes, uint32_t len)
+{
+	bytes.assign(data + begin, len);
+	begin += len;
+	if (begin == end) {
+		reset();
+	}
+}
+
+void ReadBuffer::take_all(string &bytes)
+{
+	bytes.assign(data + begin, end - begin);
+	reset();
+}
+
+void ReadBuffer::reset()
+{
+	begin = end = 0;
+	// don't hang on to a big buffer from one big read
+	if (capacity > READ_BUFFER_SIZE) {
+		delete[] data;
+		data = NULL;
+		capacity = 0;
+	}
+}
+
+void ReadBuffer::append(const char *bytes, uint32_t len)
 {
-	char *line = NULL;
-	size_t n(0);
-	size_t len(getline(&line, &n, stream->file));
-	// get rid of that lame newline
-	// I will probably need to undue this later
-	if (line[len-1] == '\n') {
-		line[len-1] = '\0';
+	reserve(len);
+	memcpy(data + end, bytes, len);
+	end += len;
+}
+
+void ReadBuffer::reserve(uint32_t len)
+{
+	if (capacity - end >= len) {
+		return;
+	}
+	uint32_t used(end - begin);
+	if (used + len <= capacity && used < capacity / 2) {
+		memmove(data, data + begin, used);
+	} else {
+		// still no room, this line is longer than the buffer
+		uint32_t newcap(capacity ? capacity * 2 : READ_BUFFER_SIZE);
+		while (newcap < used + len) {
+			newcap *= 2;
+		}
+		char *newdata = new char[newcap];
+		memcpy(newdata, data + begin, used);
+		delete[] data;
+		data = newdata;
+		capacity = newcap;
 	}
-	qbrt_value::str(dst, line);
-	free(line);
+	begin = 0;
+	end = used;
 }
 
-void StreamWrite::handle()
+
+/**
+ * Set dst if there's a whole line, or the last one at the end
+ */
+static bool take_line(Stream &s, qbrt_value &dst)
+{
+	string line;
+	pthread_spin_lock(&s.rlock);
+	bool found(s.rbuf.getline(line));
+	if (!found && s.eof) {
+		// whatever's left is the last line
+		s.rbuf.take_all(line);
+		found = true;
+	}
+	pthread_spin_unlock(&s.rlock);
+	if (found) {
+		qbrt_value::str(dst, line);
+	}
+	return found;
+}
+
+
+/**
+ * Set dst to the next len bytes, or whatever's left at the end
+ */
+static bool take_bytes(Stream &s, qbrt_value &dst, size_t len)
+{
+	string bytes;
+	pthread_spin_lock(&s.rlock);
+	bool found(s.rbuf.size() >= len);
+	if (found) {
+		s.rbuf.take(bytes, len);
+	} else if (s.eof) {
+		s.rbuf.take_all(bytes);
+		found = true;
+	}
+	pthread_spin_unlock(&s.rlock);
+	if (found) {
+		qbrt_value::str(dst, bytes);
+	}
+	return found;
+}
+
+/**
+ * How much to ask for at a time to read len bytes. A regular file
+ * is read to the end in one go if it's not too big.
+ */
+static uint32_t read_size(Stream &s, size_t len)
+{
+	size_t size(len);
+	if (len == READ_ALL) {
+		size = READ_CHUNK_SIZE;
+		struct stat st;
+		if (fstat(s.fd, &st) == 0 && S_ISREG(st.st_mode)) {
+			off_t at(lseek(s.fd, 0, SEEK_CUR));
+			if (at >= 0 && st.st_size > at) {
+				size = st.st_size - at;
+			}
+		}
+	} else {
+		pthread_spin_lock(&s.rlock);
+		size -= s.rbuf.size();
+		pthread_spin_unlock(&s.rlock);
+	}
+	if (size < READ_CHUNK_SIZE) {
+		return READ_CHUNK_SIZE;
+	}
+	if (size > READ_MAX_CHUNK) {
+		return READ_MAX_CHUNK;
+	}
+	return size;
+}
+
+
+/**
+ * Block until the frame has what it wants, for streams that can't
+ * be waited on. Usually runs on a FileIoPool thread.
+ */
+void StreamFill::handle()
+{
+	pthread_mutex_lock(&stream->read_mutex);
+	// another reader might have buffered enough while this one waited
+	bool done(take());
+	while (!done) {
+		ssize_t result(::read(stream->fd, chunk, chunk_size));
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		if (result < 0 && errno == EAGAIN) {
+			// the fd was made nonblocking after all
+			pollfd p = { stream->fd, POLLIN, 0 };
+			poll(&p, 1, -1);
+			continue;
+		}
+		done = complete(result < 0 ? -errno : result);
+	}
+	pthread_mutex_unlock(&stream->read_mutex);
+}
+
+bool StreamFill::request(IoRequest &req)
+{
+	req.op = IOREQ_READ;
+	req.fd = stream->fd;
+	req.buf = chunk;
+	req.len = chunk_size;
+	return true;
+}
+
+bool StreamFill::complete(int32_t result)
 {
-	size_t result(write(stream->fd, src.c_str(), src.size()));
 	if (result < 0) {
-		cerr << "failure of some kind\n";
+		// nothing more is coming, but the frame hears about it
+		// rather than getting a short read
+		pthread_spin_lock(&stream->rlock);
+		stream->eof = true;
+		pthread_spin_unlock(&stream->rlock);
+		bool socket(dynamic_cast< SocketStream * >(stream));
+		Failure *f = NEW_FAILURE(socket ? "socketfailure" : "readfailure"
+				, "io", "read", 0);
+		f->debug << "read failed: " << strerror(-result);
+		qbrt_value::fail(dst, f);
+		return true;
+	}
+	pthread_spin_lock(&stream->rlock);
+	if (result == 0) {
+		stream->eof = true;
+	} else {
+		stream->rbuf.append(chunk, result);
+	}
+	pthread_spin_unlock(&stream->rlock);
+	return take();
+}
+
+bool StreamReadLine::take()
+{
+	return take_line(*stream, dst);
+}
+
+bool StreamRead::take()
+{
+	return take_bytes(*stream, dst, want);
+}
+
+/**
+ * Only returns io to wait on if there's no whole line buffered
+ */
+StreamIO * Stream::getline(qbrt_value &dst)
+{
+	if (take_line(*this, dst)) {
+		return NULL;
+	}
+	return new StreamReadLine(*this, dst);
+}
+
+/**
+ * Only returns io to wait on if there isn't enough buffered
+ */
+StreamIO * Stream::read(qbrt_value &dst, size_t len)
+{
+	if (take_bytes(*this, dst, len)) {
+		return NULL;
+	}
+	return new StreamRead(*this, dst, len, read_size(*this, len));
+}
+
+/** Is fd ready for events right now? */
+static bool poll_ready(int fd, short events)
+{
+	pollfd p;
+	p.fd = fd;
+	p.events = events;
+	p.revents = 0;
+	return poll(&p, 1, 0) > 0;
+}
+
+/** Block until fd is ready for events */
+static void wait_ready(int fd, short events)
+{
+	pollfd p = { fd, events, 0 };
+	poll(&p, 1, -1);
+}
+
+/**
+ * Write out everything buffered for a stream, waiting as needed
+ */
+static void flush_all(Stream &s)
+{
+	for (;;) {
+		pthread_spin_lock(&s.wlock);
+		s.wbuf.flush(s.fd);
+		bool flushed(s.wbuf.empty());
+		pthread_spin_unlock(&s.wlock);
+		if (flushed) {
+			return;
+		}
+		wait_ready(s.fd, POLLOUT);
+	}
+}
+
+/**
+ * Write all of buf. Returns false on a write failure.
+ */
+static bool write_all(int fd, const char *buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t result(::write(fd, buf, len));
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				wait_ready(fd, POLLOUT);
+				continue;
+			}
+			return false;
+		}
+		buf += result;
+		len -= result;
+	}
+	return true;
+}
+
+/**
+ * Move whatever src read ahead into dst's output buffer, it has to
+ * go before the rest of the copy
+ */
+static int64_t take_read_ahead(Stream &src, Stream &dst)
+{
+	string buffered;
+	pthread_spin_lock(&src.rlock);
+	src.rbuf.take_all(buffered);
+	pthread_spin_unlock(&src.rlock);
+	if (!buffered.empty()) {
+		pthread_spin_lock(&dst.wlock);
+		dst.wbuf.append(buffered);
+		pthread_spin_unlock(&dst.wlock);
+	}
+	return buffered.size();
+}
+
+// stdin, stdout and stderr share their file flags w/ the shell and
+// anything else on the same pipe or tty, so the flags they had are
+// put back before qbrt exits or closes them. -1 if there's nothing
+// to put back.
+static int std_flags[3] = { -1, -1, -1 };
+static pthread_once_t std_flags_once = PTHREAD_ONCE_INIT;
+
+static void restore_flags(int fd)
+{
+	int flags(__atomic_exchange_n(&std_flags[fd], -1, __ATOMIC_ACQ_REL));
+	if (flags >= 0) {
+		fcntl(fd, F_SETFL, flags);
+	}
+}
+
+static void restore_std_flags()
+{
+	for (int fd(0); fd<=STDERR_FILENO; ++fd) {
+		restore_flags(fd);
+	}
+}
+
+static void restore_std_flags_at_exit()
+{
+	atexit(restore_std_flags);
+}
+
+static void set_nonblocking(int fd)
+{
+	int flags(fcntl(fd, F_GETFL));
+	if (flags < 0 || (flags & O_NONBLOCK)) {
+		return;
+	}
+	if (fd <= STDERR_FILENO) {
+		int unsaved(-1);
+		__atomic_compare_exchange_n(&std_flags[fd], &unsaved, flags
+				, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		pthread_once(&std_flags_once, restore_std_flags_at_exit);
+	}
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+bool StreamCopy::blocking() const
+{
+	return !src.pollable();
+}
+
+void StreamCopy::handle()
+{
+	more = false;
+	if (blocking()) {
+		copy_blocking();
+	} else {
+		copy_ready();
+	}
+}
+
+/**
+ * Try sendfile first, which takes a regular file on the source side,
+ * then splice, which takes a pipe on either side, and then plain reads
+ * and writes for two sockets or the like.
+ */
+void StreamCopy::copy_blocking()
+{
+	pthread_mutex_lock(&src.read_mutex);
+	total = take_read_ahead(src, dst);
+	flush_all(dst);
+
+	// a mapped stream keeps its own position rather than the fd's
+	MappedStream *mapped(dynamic_cast< MappedStream * >(&src));
+	off_t offset(0);
+	off_t *offp(NULL);
+	if (mapped) {
+		pthread_spin_lock(&src.rlock);
+		offset = mapped->pos;
+		pthread_spin_unlock(&src.rlock);
+		offp = &offset;
+	}
+
+	mode = COPY_SENDFILE;
+	for (;;) {
+		ssize_t moved;
+		if (mode == COPY_SENDFILE) {
+			moved = sendfile(dst.fd, src.fd, offp, COPY_CHUNK_SIZE);
+		} else if (mode == COPY_SPLICE) {
+			moved = splice(src.fd, NULL, dst.fd, NULL
+					, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+		} else {
+			if (!buf) {
+				buf = new char[COPY_CHUNK_SIZE];
+			}
+			moved = offp
+				? pread(src.fd, buf, COPY_CHUNK_SIZE, *offp)
+				: ::read(src.fd, buf, COPY_CHUNK_SIZE);
+			if (moved > 0) {
+				if (!write_all(dst.fd, buf, moved)) {
+					cerr << "copy failure: " << strerror(errno)
+						<< endl;
+					break;
+				}
+				if (offp) {
+					*offp += moved;
+				}
+			}
+		}
+		if (moved > 0) {
+			total += moved;
+			continue;
+		}
+		if (moved == 0) {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if ((errno == EINVAL || errno == ENOSYS)
+				&& mode != COPY_READWRITE) {
+			// this pair of fds can't do it, try the next way
+			++mode;
+			continue;
+		}
+		if (errno == EAGAIN) {
+			// only dst can be waited on, src is a file
+			wait_ready(dst.fd, POLLOUT);
+			continue;
+		}
+		cerr << "copy failure: " << strerror(errno) << endl;
+		break;
+	}
+
+	if (mapped) {
+		pthread_spin_lock(&src.rlock);
+		mapped->pos = offset;
+		pthread_spin_unlock(&src.rlock);
+	}
+	finish();
+	pthread_mutex_unlock(&src.read_mutex);
+}
+
+/**
+ * Copy from a pollable stream until src or dst would block, then
+ * wait for that one. Splice if there's a pipe on either side,
+ * otherwise read and write.
+ */
+void StreamCopy::copy_ready()
+{
+	if (!started) {
+		started = true;
+		total = take_read_ahead(src, dst);
+		set_nonblocking(src.fd);
+		if (dst.pollable()) {
+			set_nonblocking(dst.fd);
+		}
+	}
+	// output from before the copy goes first,
+	// even if it was written while the copy waited
+	if (!dst.flush()) {
+		wait_for(dst, EPOLLOUT);
+		return;
+	}
+	for (;;) {
+		if (mode == COPY_READWRITE) {
+			if (!read_write()) {
+				return;
+			}
+			break;
+		}
+		ssize_t moved(splice(src.fd, NULL, dst.fd, NULL
+				, COPY_CHUNK_SIZE
+				, SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+		if (moved > 0) {
+			total += moved;
+			continue;
+		}
+		if (moved == 0) {
+			break;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno == EINVAL || errno == ENOSYS) {
+			// no pipe on either side
+			mode = COPY_READWRITE;
+			continue;
+		}
+		if (errno == EAGAIN) {
+			// splice doesn't say which side it's waiting on
+			if (dst.pollable() && !poll_ready(dst.fd, POLLOUT)) {
+				wait_for(dst, EPOLLOUT);
+			} else {
+				wait_for(src, EPOLLIN);
+			}
+			return;
+		}
+		cerr << "copy failure: " << strerror(errno) << endl;
+		break;
+	}
+	finish();
+}
+
+bool StreamCopy::read_write()
+{
+	if (!buf) {
+		buf = new char[COPY_CHUNK_SIZE];
+	}
+	for (;;) {
+		ssize_t result;
+		if (buf_begin < buf_end) {
+			result = ::write(dst.fd, buf + buf_begin
+					, buf_end - buf_begin);
+			if (result > 0) {
+				buf_begin += result;
+				continue;
+			}
+			if (result < 0 && errno == EAGAIN) {
+				wait_for(dst, EPOLLOUT);
+				return false;
+			}
+		} else {
+			result = ::read(src.fd, buf, COPY_CHUNK_SIZE);
+			if (result > 0) {
+				buf_begin = 0;
+				buf_end = result;
+				total += result;
+				continue;
+			}
+			if (result == 0) {
+				return true;
+			}
+			if (errno == EAGAIN) {
+				wait_for(src, EPOLLIN);
+				return false;
+			}
+		}
+		if (result < 0 && errno == EINTR) {
+			continue;
+		}
+		cerr << "copy failure: " << strerror(errno) << endl;
+		return true;
+	}
+}
+
+void StreamCopy::wait_for(Stream &s, uint32_t e)
+{
+	stream = &s;
+	events = e;
+	more = true;
+}
+
+void StreamCopy::finish()
+{
+	pthread_spin_lock(&src.rlock);
+	src.eof = true;
+	pthread_spin_unlock(&src.rlock);
+	qbrt_value::i(result, total);
+}
+
+void Stream::close()
+{
+	pthread_spin_lock(&wlock);
+	int closing(fd);
+	fd = -1;
+	pthread_spin_unlock(&wlock);
+	if (closing < 0) {
+		return;
 	}
+	if (closing <= STDERR_FILENO) {
+		restore_flags(closing);
+	}
+	::close(closing);
 }
 
-StreamIO * ByteStream::getline(qbrt_value &dst)
+MappedStream::~MappedStream()
 {
-	return new StreamGetline(this, dst);
+	close();
+}
+
+void MappedStream::close()
+{
+	const char *mapping(NULL);
+	size_t mapping_size(0);
+	pthread_spin_lock(&rlock);
+	// later reads get nothing, the last reader unmaps if any are left
+	closing = true;
+	pos = size;
+	if (readers == 0) {
+		unmap_locked(mapping, mapping_size);
+	}
+	pthread_spin_unlock(&rlock);
+	if (mapping) {
+		munmap((void *) mapping, mapping_size);
+	}
+	Stream::close();
+}
+
+/** Take the mapping to munmap once rlock is released */
+void MappedStream::unmap_locked(const char *&mapping, size_t &mapping_size)
+{
+	mapping = data;
+	mapping_size = size;
+	data = NULL;
+	size = 0;
+	pos = 0;
+}
+
+void MappedStream::done_reading()
+{
+	const char *mapping(NULL);
+	size_t mapping_size(0);
+	pthread_spin_lock(&rlock);
+	if (--readers == 0 && closing) {
+		unmap_locked(mapping, mapping_size);
+	}
+	pthread_spin_unlock(&rlock);
+	if (mapping) {
+		munmap((void *) mapping, mapping_size);
+	}
 }
 
-StreamIO * ByteStream::write(const string &src)
+/**
+ * rlock is only held to claim the bytes and move pos past them.
+ * Other readers can claim the next ones while this one copies.
+ */
+StreamIO * MappedStream::read(qbrt_value &dst, size_t len)
 {
-	return new StreamWrite(this, src);
+	pthread_spin_lock(&rlock);
+	size_t start(pos);
+	if (len > size - start) {
+		len = size - start;
+	}
+	pos += len;
+	const char *src(data + start);
+	++readers;
+	pthread_spin_unlock(&rlock);
+	qbrt_value::str(dst, src, len);
+	done_reading();
+	return NULL;
 }
 
-StreamIO * FileStream::getline(qbrt_value &dst)
+StreamIO * MappedStream::getline(qbrt_value &dst)
 {
-	StreamGetline io(this, dst);
-	io.handle();
+	pthread_spin_lock(&rlock);
+	size_t start(pos);
+	size_t len(size - start);
+	if (len > 0) {
+		const char *nl((const char *) memchr(data + start, '\n', len));
+		if (nl) {
+			len = nl - (data + start);
+			pos = start + len + 1;
+		} else {
+			pos = size;
+		}
+	}
+	const char *src(data + start);
+	++readers;
+	pthread_spin_unlock(&rlock);
+	// at the end this is an empty string, same as other streams
+	qbrt_value::str(dst, src, len);
+	done_reading();
 	return NULL;
 }
 
-StreamIO * FileStream::write(const string &src)
+MappedStream * map_file(const string &path)
+{
+	int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		::close(fd);
+		return NULL;
+	}
+	size_t size(st.st_size);
+	void *data = NULL;
+	// mmap won't map an empty file
+	if (size > 0) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			::close(fd);
+			return NULL;
+		}
+		madvise(data, size, MADV_SEQUENTIAL);
+	}
+	return new MappedStream(fd, (const char *) data, size);
+}
+
+void WriteBuffer::append(const string &src)
+{
+	if (!chunks.empty() && src.size() < WRITE_CHUNK_SIZE
+			&& chunks.back().size() < WRITE_CHUNK_SIZE) {
+		chunks.back().append(src);
+	} else {
+		chunks.push_back(src);
+	}
+	bytes += src.size();
+}
+
+void WriteBuffer::flush(int fd)
+{
+	iovec iov[WRITE_IOV_MAX];
+	while (bytes > 0) {
+		int iovcnt(0);
+		list< string >::iterator it(chunks.begin());
+		for (; it!=chunks.end() && iovcnt<WRITE_IOV_MAX; ++it) {
+			size_t skip(iovcnt ? 0 : offset);
+			iov[iovcnt].iov_base = const_cast< char * >(it->data() + skip);
+			iov[iovcnt].iov_len = it->size() - skip;
+			++iovcnt;
+		}
+		ssize_t result(writev(fd, iov, iovcnt));
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			cerr << "write failure: " << strerror(errno) << endl;
+			// nowhere for it to go
+			chunks.clear();
+			bytes = 0;
+			offset = 0;
+			return;
+		}
+		bytes -= result;
+		// drop whatever was written, it may end partway into a chunk
+		size_t n(result + offset);
+		while (!chunks.empty() && n >= chunks.front().size()) {
+			n -= chunks.front().size();
+			chunks.pop_front();
+		}
+		offset = n;
+	}
+}
+
+/**
+ * Buffer the output. Only returns io to wait on if the buffer is full.
+ */
+StreamIO * Stream::write(const string &src)
+{
+	pthread_spin_lock(&wlock);
+	bool full(wbuf.full());
+	if (!full) {
+		wbuf.append(src);
+	}
+	pthread_spin_unlock(&wlock);
+	if (full) {
+		return new StreamBufferedWrite(*this, src);
+	}
+	return NULL;
+}
+
+bool Stream::flush()
+{
+	pthread_spin_lock(&wlock);
+	flush_locked();
+	bool flushed(wbuf.empty());
+	pthread_spin_unlock(&wlock);
+	return flushed;
+}
+
+void ByteStream::flush_locked()
+{
+	if (wbuf.empty()) {
+		return;
+	}
+	if (!nonblocking) {
+		set_nonblocking(fd);
+		nonblocking = true;
+	}
+	wbuf.flush(fd);
+}
+
+/**
+ * The stream can take more, so flush what's there and add this
+ * frame's output
+ */
+void StreamBufferedWrite::handle()
+{
+	pthread_spin_lock(&stream->wlock);
+	stream->flush_locked();
+	stream->wbuf.append(src);
+	pthread_spin_unlock(&stream->wlock);
+}
+
+void StreamClose::handle()
+{
+	pthread_spin_lock(&stream->wlock);
+	stream->flush_locked();
+	bool flushed(stream->wbuf.empty());
+	pthread_spin_unlock(&stream->wlock);
+	// on a FileIoPool thread the write already blocked as long as
+	// it was going to, so whatever's left isn't going anywhere
+	more = !flushed && !blocking();
+	if (more) {
+		return;
+	}
+	std::vector< IoEngine * >::iterator it(engines.begin());
+	for (; it!=engines.end(); ++it) {
+		(*it)->forget(stream);
+	}
+	stream->close();
+}
+
+
+/**
+ * Do the io of a direct request w/o blocking
+ * Returns false if the stream isn't ready for it.
+ */
+static bool attempt_io(StreamIO &io)
+{
+	IoRequest req;
+	for (;;) {
+		io.request(req);
+		ssize_t result;
+		if (req.op == IOREQ_WRITE) {
+			result = ::write(req.fd, req.buf, req.len);
+		} else if (req.op == IOREQ_ACCEPT) {
+			result = accept4(req.fd, NULL, NULL
+					, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		} else {
+			result = ::read(req.fd, req.buf, req.len);
+		}
+		if (result < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return false;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			result = -errno;
+		}
+		if (io.complete(result)) {
+			return true;
+		}
+	}
+}
+
+void wake_eventfd(int fd)
+{
+	uint64_t one(1);
+	if (::write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		perror("eventfd write");
+	}
+}
+
+void drain_eventfd(int fd)
+{
+	uint64_t count;
+	if (::read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		perror("eventfd read");
+	}
+}
+
+/**
+ * Readiness based engine
+ *
+ * Each stream is registered once, edge-triggered, the first time a
+ * frame waits on it. Frames waiting to read or write a stream queue
+ * up on it in order. Direct requests are tried right away and only
+ * wait if the stream would block. Other io waits for the stream to
+ * be ready and then calls handle().
+ */
+struct EpollEngine
+: public IoEngine
+{
+	EpollEngine()
+	: epfd(epoll_create(1))
+	, wakefd(eventfd(0, EFD_NONBLOCK))
+	{
+		pthread_spin_init(&forgotten_lock, PTHREAD_PROCESS_PRIVATE);
+		if (epfd < 0) {
+			perror("epoll_create failure");
+		}
+		// a NULL ptr marks the wake event
+		epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev) < 0) {
+			perror("epoll_ctl");
+		}
+	}
+	~EpollEngine()
+	{
+		close(wakefd);
+		close(epfd);
+		pthread_spin_destroy(&forgotten_lock);
+	}
+
+	const char * name() const { return "epoll"; }
+
+	bool watch(CodeFrame *);
+	void unwatch(CodeFrame *);
+	bool migratable() const { return true; }
+	void wait(list< CodeFrame * > &done, int timeout);
+	void wake() { wake_eventfd(wakefd); }
+	void forget(Stream *);
+
+private:
+	struct Waiters
+	{
+		CodeFrame::List frames;
+		// no point trying until the next edge
+		bool blocked;
+
+		Waiters()
+		: frames()
+		, blocked(false)
+		{}
+	};
+	struct Registration
+	{
+		Stream *stream;
+		Waiters in;
+		Waiters out;
+		bool nonblocking;
+		// regular files can't be polled, they're always ready
+		bool pollable;
+
+		Registration(Stream *s)
+		: stream(s)
+		, in()
+		, out()
+		, nonblocking(false)
+		, pollable(true)
+		{}
+	};
+	typedef std::map< Stream *, Registration > RegistrationMap;
+
+	Registration & registration(Stream *);
+	Waiters & waiters(Registration &r, const StreamIO &io)
+	{
+		return (io.events & EPOLLOUT) ? r.out : r.in;
+	}
+	bool attempt(Registration &, StreamIO &);
+	void run(Registration &, Waiters &, list< CodeFrame * > &done);
+	void drop_forgotten();
+
+	RegistrationMap reg;
+	// forgotten from any thread, dropped from reg by this one
+	std::vector< Stream * > forgotten;
+	pthread_spinlock_t forgotten_lock;
+	int epfd;
+	int wakefd;
+};
+
+EpollEngine::Registration & EpollEngine::registration(Stream *s)
+{
+	RegistrationMap::iterator it(reg.find(s));
+	if (it != reg.end()) {
+		return it->second;
+	}
+	Registration &r(reg.insert(make_pair(s, Registration(s))).first->second);
+	epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = &r;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev) < 0) {
+		if (errno == EPERM) {
+			r.pollable = false;
+		} else {
+			perror("epoll_ctl");
+		}
+	}
+	return r;
+}
+
+/**
+ * Try a direct request w/o waiting. The fd is only made nonblocking
+ * once it's actually used this way.
+ */
+bool EpollEngine::attempt(Registration &r, StreamIO &io)
 {
-	StreamWrite io(this, src);
-	io.handle();
+	if (!r.nonblocking) {
+		set_nonblocking(r.stream->fd);
+		r.nonblocking = true;
+	}
+	return attempt_io(io);
+}
+
+bool EpollEngine::watch(CodeFrame *cf)
+{
+	StreamIO &io(*cf->io);
+	Registration &r(registration(io.stream));
+	Waiters &w(waiters(r, io));
+	IoRequest req;
+	if (!r.pollable) {
+		if (io.request(req)) {
+			attempt_io(io);
+			return true;
+		}
+		io.handle();
+		return !io.waiting() || watch(cf);
+	}
+	// only go ahead if nobody else is waiting
+	// so the stream keeps its order
+	if (w.frames.empty()) {
+		if (io.request(req)) {
+			if (attempt(r, io)) {
+				return true;
+			}
+			w.blocked = true;
+		} else if (poll_ready(r.stream->fd, io.events)) {
+			// an edge may have come and gone already
+			io.handle();
+			return !io.waiting() || watch(cf);
+		}
+	}
+	w.frames.push_back(cf);
+	return false;
+}
+
+void EpollEngine::unwatch(CodeFrame *cf)
+{
+	RegistrationMap::iterator it(reg.find(cf->io->stream));
+	if (it != reg.end()) {
+		waiters(it->second, *cf->io).frames.remove(cf);
+	}
+}
+
+/**
+ * Do the io for waiting frames until the stream would block
+ */
+void EpollEngine::run(Registration &r, Waiters &w, list< CodeFrame * > &done)
+{
+	IoRequest req;
+	while (!w.blocked && !w.frames.empty()) {
+		CodeFrame *cf(w.frames.front());
+		StreamIO &io(*cf->io);
+		if (io.request(req)) {
+			if (!attempt(r, io)) {
+				w.blocked = true;
+				break;
+			}
+		} else {
+			uint32_t events(io.events);
+			io.handle();
+			// w/o a direct request there's no way to know if
+			// there's more so ask before trying the next one
+			w.blocked = !poll_ready(r.stream->fd, events);
+		}
+		w.frames.pop_front();
+		// a copy may wait on this stream again or the other one
+		if (!io.waiting() || watch(cf)) {
+			done.push_back(cf);
+		}
+	}
+}
+
+/**
+ * Stop the epoll set reporting a stream that's being closed. Its
+ * registration is only dropped by this engine's own thread, once
+ * no event from an earlier epoll_wait can still point at it.
+ */
+void EpollEngine::forget(Stream *s)
+{
+	// ENOENT just means this engine never saw the stream
+	epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	pthread_spin_lock(&forgotten_lock);
+	forgotten.push_back(s);
+	pthread_spin_unlock(&forgotten_lock);
+}
+
+void EpollEngine::drop_forgotten()
+{
+	std::vector< Stream * > dropping;
+	pthread_spin_lock(&forgotten_lock);
+	dropping.swap(forgotten);
+	pthread_spin_unlock(&forgotten_lock);
+	std::vector< Stream * >::iterator it(dropping.begin());
+	for (; it!=dropping.end(); ++it) {
+		reg.erase(*it);
+	}
+}
+
+void EpollEngine::wait(list< CodeFrame * > &done, int timeout)
+{
+	drop_forgotten();
+	epoll_event events[MAX_EPOLL_EVENTS];
+	int fdcnt(epoll_wait(epfd, events, MAX_EPOLL_EVENTS, timeout));
+	if (fdcnt == -1) {
+		if (errno != EINTR) {
+			perror("epoll_wait");
+		}
+		return;
+	}
+	for (int i(0); i<fdcnt; ++i) {
+		if (!events[i].data.ptr) {
+			drain_eventfd(wakefd);
+			continue;
+		}
+		Registration &r(*static_cast< Registration * >(events[i].data.ptr));
+		uint32_t ev(events[i].events);
+		if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+			r.in.blocked = false;
+			run(r, r.in, done);
+		}
+		if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+			r.out.blocked = false;
+			run(r, r.out, done);
+		}
+	}
+}
+
+IoEngine * new_epoll_engine()
+{
+	return new EpollEngine();
+}
+
+IoEngine * new_io_engine(const std::string &name)
+{
+	if (name == "epoll") {
+		return new_epoll_engine();
+	}
+	IoEngine *engine = new_uring_engine();
+	if (engine) {
+		return engine;
+	}
+	if (name == "uring") {
+		cerr << "io_uring is not available, using epoll\n";
+	}
+	return new_epoll_engine();
+}
+
+
+FileIoPool::FileIoPool(int threads)
+: jobs()
+{
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&ready, NULL);
+	for (int i(0); i<threads; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run, this) != 0) {
+			perror("file io thread");
+			continue;
+		}
+		pthread_detach(thread);
+	}
+}
+
+void FileIoPool::submit(Worker &w, CodeFrame *cf)
+{
+	pthread_mutex_lock(&lock);
+	jobs.push_back(Job(&w, cf));
+	pthread_cond_signal(&ready);
+	pthread_mutex_unlock(&lock);
+}
+
+void * FileIoPool::run(void *void_pool)
+{
+	FileIoPool &pool(*static_cast< FileIoPool * >(void_pool));
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (pool.jobs.empty()) {
+			pthread_cond_wait(&pool.ready, &pool.lock);
+		}
+		Job job(pool.jobs.front());
+		pool.jobs.pop_front();
+		pthread_mutex_unlock(&pool.lock);
+
+		Worker &w(*job.first);
+		job.second->io->handle();
+		pthread_spin_lock(&w.inbox_lock);
+		w.iodone.push_back(job.second);
+		pthread_spin_unlock(&w.inbox_lock);
+		w.ioengine->wake();
+	}
 	return NULL;
 }
@@ -3,7 +3,29 @@
 
 #include "qbrt/core.h"
 #include <sys/epoll.h>
+#include <pthread.h>
+#include <list>
+#include <vector>
 
+struct CodeFrame;
+struct Worker;
+struct IoEngine;
+
+
+#define IOREQ_READ	1
+#define IOREQ_WRITE	2
+#define IOREQ_ACCEPT	3
+
+/**
+ * A read, write or accept that an IoEngine can do on its own
+ */
+struct IoRequest
+{
+	void *buf;
+	uint32_t len;
+	int fd;
+	uint8_t op;
+};
 
 struct StreamIO
 {
@@ -15,61 +37,363 @@ struct StreamIO
 	, events(e)
 	{}
 	virtual ~StreamIO() {}
+	/** Do the io once the stream is ready for it */
 	virtual void handle() = 0;
+	/**
+	 * Describe the io as a plain syscall so an engine can
+	 * submit it directly instead of waiting for the stream to be
+	 * ready and then calling handle().
+	 * Returns false if it has to go through handle().
+	 */
+	virtual bool request(IoRequest &) { return false; }
+	/**
+	 * Take the result of a direct request. Returns true when the
+	 * io is done or false if there's more to request.
+	 */
+	virtual bool complete(int32_t result) { return true; }
+	/**
+	 * Does the io have to wait again after handle()? The stream
+	 * and events say what to wait for next.
+	 */
+	virtual bool waiting() const { return false; }
+	/**
+	 * Is this io that might block even when the stream is ready,
+	 * like on a regular file? If so it's done by the FileIoPool
+	 * rather than the worker's IoEngine.
+	 */
+	virtual bool blocking() const;
 };
 
-struct StreamGetline
+#define READ_CHUNK_SIZE	65536
+// the most a single read asks for, even if the frame wants more
+#define READ_MAX_CHUNK	(16 * 1024 * 1024)
+// read to the end of the stream
+#define READ_ALL	((size_t) -1)
+
+/**
+ * Read into a stream's buffer until it has what the frame wants
+ *
+ * Each read goes into the io's own chunk and is then added to the
+ * stream's buffer so a read in progress never points into a buffer
+ * that another frame is using.
+ */
+struct StreamFill
 : public StreamIO
 {
 	qbrt_value &dst;
+	char *chunk;
+	uint32_t chunk_size;
 
-	StreamGetline(Stream *s, qbrt_value &dest)
-	: StreamIO(s, EPOLLIN)
+	StreamFill(Stream &s, qbrt_value &dest, uint32_t chunk_size)
+	: StreamIO(&s, EPOLLIN)
 	, dst(dest)
+	, chunk(new char[chunk_size])
+	, chunk_size(chunk_size)
+	{}
+	~StreamFill()
+	{
+		delete[] chunk;
+	}
+
+	virtual void handle();
+	virtual bool request(IoRequest &);
+	virtual bool complete(int32_t result);
+	/** Take what the frame wants from the buffer if it's there */
+	virtual bool take() = 0;
+};
+
+/**
+ * Read until there's a whole line
+ */
+struct StreamReadLine
+: public StreamFill
+{
+	StreamReadLine(Stream &s, qbrt_value &dest)
+	: StreamFill(s, dest, READ_CHUNK_SIZE)
+	{}
+
+	virtual bool take();
+};
+
+/**
+ * Read until there are want bytes or the stream ends
+ */
+struct StreamRead
+: public StreamFill
+{
+	size_t want;
+
+	StreamRead(Stream &s, qbrt_value &dest, size_t want, uint32_t size)
+	: StreamFill(s, dest, size)
+	, want(want)
 	{}
 
+	virtual bool take();
+};
+
+#define COPY_SENDFILE	0
+#define COPY_SPLICE	1
+#define COPY_READWRITE	2
+
+/**
+ * Copy everything left in one stream to another
+ *
+ * The bytes go from fd to fd w/ sendfile or splice where the kernel
+ * can do it, so they're never copied into the process. Falls back to
+ * plain reads and writes for anything else.
+ *
+ * A regular file or mapped source is copied on a FileIoPool thread.
+ * A pipe or socket could keep a pool thread for as long as it stays
+ * open, so it's copied w/ the worker's IoEngine instead, moving what
+ * it can each time and then waiting on whichever stream would block.
+ */
+struct StreamCopy
+: public StreamIO
+{
+	Stream &src;
+	Stream &dst;
+	qbrt_value &result;
+	int64_t total;
+	// read but not yet written when copying w/ reads and writes
+	char *buf;
+	uint32_t buf_begin;
+	uint32_t buf_end;
+	int mode;
+	bool started;
+	bool more;
+
+	// start on dst so what's already buffered goes right away
+	StreamCopy(Stream &src, Stream &dst, qbrt_value &result)
+	: StreamIO(&dst, EPOLLOUT)
+	, src(src)
+	, dst(dst)
+	, result(result)
+	, total(0)
+	, buf(NULL)
+	, buf_begin(0)
+	, buf_end(0)
+	, mode(COPY_SPLICE)
+	, started(false)
+	, more(false)
+	{}
+	~StreamCopy()
+	{
+		delete[] buf;
+	}
+
 	virtual void handle();
+	virtual bool waiting() const { return more; }
+	virtual bool blocking() const;
+
+private:
+	void copy_blocking();
+	void copy_ready();
+	/** Move bytes w/ read and write. Returns false if it'd block. */
+	bool read_write();
+	void wait_for(Stream &, uint32_t events);
+	void finish();
 };
 
-struct StreamWrite
+/**
+ * Wait for a full output buffer to take more
+ */
+struct StreamBufferedWrite
 : public StreamIO
 {
 	const std::string &src;
 
-	StreamWrite(Stream *s, const std::string &src)
-	: StreamIO(s, EPOLLOUT)
+	StreamBufferedWrite(Stream &s, const std::string &src)
+	: StreamIO(&s, EPOLLOUT)
 	, src(src)
 	{}
 
 	virtual void handle();
 };
 
+/**
+ * Wait for buffered output to go out and then close the stream
+ *
+ * Every engine that might have the stream registered forgets it
+ * before the fd is closed and can be reused.
+ */
+struct StreamClose
+: public StreamIO
+{
+	std::vector< IoEngine * > engines;
+	bool more;
+
+	StreamClose(Stream &s, const std::vector< IoEngine * > &engines)
+	: StreamIO(&s, EPOLLOUT)
+	, engines(engines)
+	, more(false)
+	{}
+
+	virtual void handle();
+	virtual bool waiting() const { return more; }
+};
+
+#define READ_BUFFER_SIZE	65536
+
+/**
+ * Bytes read from a stream but not yet used
+ *
+ * Filled by big reads straight from the fd and emptied from the
+ * front. The unused bytes are moved back to the start when there's
+ * no space left at the end.
+ */
+struct ReadBuffer
+{
+	char *data;
+	uint32_t capacity;
+	uint32_t begin;
+	uint32_t end;
+
+	ReadBuffer()
+	: data(NULL)
+	, capacity(0)
+	, begin(0)
+	, end(0)
+	{}
+	~ReadBuffer()
+	{
+		delete[] data;
+	}
+
+	bool empty() const { return begin == end; }
+	uint32_t size() const { return end - begin; }
+	/** Take a line off the front, w/o the newline, if there is one */
+	bool getline(std::string &line);
+	/** Take len bytes off the front */
+	void take(std::string &, uint32_t len);
+	/** Take whatever is left */
+	void take_all(std::string &);
+	void append(const char *bytes, uint32_t len);
+
+private:
+	/** Make sure there's space at the end for len more bytes */
+	void reserve(uint32_t len);
+	/** Start over once it's empty */
+	void reset();
+
+	ReadBuffer(const ReadBuffer &);
+};
+
+#define WRITE_BUFFER_LIMIT	65536
+#define WRITE_CHUNK_SIZE	4096
+#define WRITE_IOV_MAX	64
+
+/**
+ * Output waiting to be written to a stream
+ *
+ * Small writes are appended to the last chunk so one writev can
+ * cover a lot of them.
+ */
+struct WriteBuffer
+{
+	std::list< std::string > chunks;
+	size_t bytes;
+	// how much of the first chunk has been written already
+	size_t offset;
+
+	WriteBuffer()
+	: chunks()
+	, bytes(0)
+	, offset(0)
+	{}
+
+	bool empty() const { return bytes == 0; }
+	bool full() const { return bytes >= WRITE_BUFFER_LIMIT; }
+	void append(const std::string &);
+	/**
+	 * Write as much as the fd will take. Stops early if the fd
+	 * is nonblocking and would block.
+	 */
+	void flush(int fd);
+};
+
+/**
+ * Reads go through the stream's own buffer rather than stdio so a
+ * getline only waits when there isn't a whole line buffered already.
+ *
+ * Writes go into an output buffer that's flushed by the worker when
+ * it switches tasks, so writes from many frames go out together.
+ * Writers only wait when the buffer is full.
+ *
+ * Frames on any worker may use the same stream so both buffers
+ * are locked.
+ */
 struct Stream
 {
 	int fd;
 	FILE *file;
+	ReadBuffer rbuf;
+	WriteBuffer wbuf;
+	pthread_spinlock_t rlock;
+	pthread_spinlock_t wlock;
+	// held by FileIoPool threads while they read so they take turns
+	pthread_mutex_t read_mutex;
+	bool eof;
 
 	Stream(int fd, FILE *file)
 	: fd(fd)
 	, file(file)
-	{}
+	, rbuf()
+	, wbuf()
+	, eof(false)
+	{
+		pthread_spin_init(&rlock, PTHREAD_PROCESS_PRIVATE);
+		pthread_spin_init(&wlock, PTHREAD_PROCESS_PRIVATE);
+		pthread_mutex_init(&read_mutex, NULL);
+	}
 
 	virtual ~Stream() {}
-	virtual StreamIO * getline(qbrt_value &dst) = 0;
-	virtual StreamIO * write(const std::string &src) = 0;
+	virtual StreamIO * getline(qbrt_value &dst);
+	/** Read len bytes, or fewer if the stream ends first */
+	virtual StreamIO * read(qbrt_value &dst, size_t len);
+	StreamIO * write(const std::string &src);
+	/**
+	 * Write out any buffered output
+	 * Returns true if there's none left.
+	 */
+	bool flush();
+	/** Call w/ wlock held */
+	virtual void flush_locked() { wbuf.flush(fd); }
+	/** Can the stream be waited on w/ an IoEngine? */
+	virtual bool pollable() const = 0;
+	/**
+	 * Close the fd. Output that's still buffered is dropped,
+	 * StreamClose is what waits for it to go out first.
+	 */
+	virtual void close();
 };
 
+/**
+ * A pipe or other stream that may have to wait
+ *
+ * Its io is done through the worker's IoEngine and output is
+ * flushed w/o blocking.
+ */
 struct ByteStream
 : public Stream
 {
+	bool nonblocking;
+
 	ByteStream(int fd, FILE *file)
 	: Stream(fd, file)
+	, nonblocking(false)
 	{}
 
-	StreamIO * getline(qbrt_value &dst);
-	StreamIO * write(const std::string &src);
+	void flush_locked();
+	bool pollable() const { return true; }
 };
 
+/**
+ * A regular file or other stream that can't be polled
+ *
+ * Reads are done on a FileIoPool thread while the frame waits.
+ * Buffered output is flushed from the worker, a regular file takes
+ * it w/o waiting on the disk.
+ */
 struct FileStream
 : public Stream
 {
@@ -77,8 +401,252 @@ struct FileStream
 	: Stream(fd, file)
 	{}
 
+	bool pollable() const { return false; }
+};
+
+/**
+ * A file mapped read-only into memory
+ *
+ * Lines are found in the mapping itself, so a getline never reads,
+ * never waits and the only copy is into the new string.
+ */
+struct MappedStream
+: public Stream
+{
+	const char *data;
+	size_t size;
+	size_t pos;
+	// copying out of the mapping w/o rlock, it stays until they're done
+	uint32_t readers;
+	bool closing;
+
+	MappedStream(int fd, const char *data, size_t size)
+	: Stream(fd, NULL)
+	, data(data)
+	, size(size)
+	, pos(0)
+	, readers(0)
+	, closing(false)
+	{}
+	~MappedStream();
+	void close();
+
 	StreamIO * getline(qbrt_value &dst);
-	StreamIO * write(const std::string &src);
+	StreamIO * read(qbrt_value &dst, size_t len);
+	bool pollable() const { return false; }
+
+private:
+	void done_reading();
+	void unmap_locked(const char *&mapping, size_t &mapping_size);
+};
+
+/** Map a file to read. Returns NULL if it can't be opened. */
+MappedStream * map_file(const std::string &path);
+
+/**
+ * A connected TCP or Unix domain socket
+ */
+struct SocketStream
+: public ByteStream
+{
+	SocketStream(int fd)
+	: ByteStream(fd, NULL)
+	{
+		// sockets are always opened nonblocking
+		nonblocking = true;
+	}
+};
+
+/**
+ * A socket listening for connections
+ */
+struct ListenStream
+: public Stream
+{
+	// the socket file for a Unix domain socket, removed on close
+	std::string path;
+
+	ListenStream(int fd, const std::string &path)
+	: Stream(fd, NULL)
+	, path(path)
+	{}
+
+	bool pollable() const { return true; }
+	void close();
+};
+
+/**
+ * Accept the next connection as a SocketStream
+ */
+struct StreamAccept
+: public StreamIO
+{
+	qbrt_value &dst;
+
+	StreamAccept(ListenStream &s, qbrt_value &dest)
+	: StreamIO(&s, EPOLLIN)
+	, dst(dest)
+	{}
+
+	virtual void handle();
+	virtual bool request(IoRequest &);
+	virtual bool complete(int32_t result);
+};
+
+/**
+ * Wait for a nonblocking connect to finish
+ */
+struct StreamConnect
+: public StreamIO
+{
+	qbrt_value &dst;
+
+	StreamConnect(SocketStream &s, qbrt_value &dest)
+	: StreamIO(&s, EPOLLOUT)
+	, dst(dest)
+	{}
+
+	virtual void handle();
+};
+
+/**
+ * Socket addresses are either "unix:<path>" or "<host>:<port>".
+ * An empty host listens on all interfaces.
+ *
+ * These return NULL and set errno on failure.
+ */
+ListenStream * listen_socket(const std::string &address);
+/**
+ * The connect may still be in progress when this returns, in which
+ * case inprogress is set and the stream isn't writable until it's done.
+ */
+SocketStream * connect_socket(const std::string &address, bool &inprogress);
+
+
+/**
+ * A child process started w/ io/spawn
+ *
+ * The fd is a pidfd that becomes readable when the child exits, so
+ * waiting for it is just more io for the worker's IoEngine. W/o pidfd
+ * support the fd is -1 and the wait blocks on a FileIoPool thread.
+ */
+struct ChildStream
+: public Stream
+{
+	pid_t pid;
+	int exit_code;
+	bool exited;
+
+	ChildStream(int fd, pid_t pid)
+	: Stream(fd, NULL)
+	, pid(pid)
+	, exit_code(0)
+	, exited(false)
+	{}
+
+	bool pollable() const { return fd >= 0; }
+};
+
+/**
+ * Wait for a child to exit and set dst to its exit code
+ */
+struct StreamWaitChild
+: public StreamIO
+{
+	qbrt_value &dst;
+
+	StreamWaitChild(ChildStream &s, qbrt_value &dest)
+	: StreamIO(&s, EPOLLIN)
+	, dst(dest)
+	{}
+
+	virtual void handle();
+};
+
+/**
+ * Start a program w/ pipes for its stdin, stdout and stderr.
+ * The program is looked up in PATH if it has no slash.
+ * Returns NULL and sets errno if it can't be started.
+ */
+ChildStream * spawn_child(const std::vector< std::string > &argv
+		, Stream *&in, Stream *&out, Stream *&err);
+
+
+/**
+ * Waits on stream io for a worker
+ *
+ * A frame is given to the engine w/ its io set and comes back out of
+ * wait() once that io has been done.
+ */
+struct IoEngine
+{
+	virtual ~IoEngine() {}
+	virtual const char * name() const = 0;
+
+	/**
+	 * Start the io for a frame. Returns true if it could be done
+	 * right away, in which case the frame doesn't have to wait.
+	 */
+	virtual bool watch(CodeFrame *) = 0;
+	/**
+	 * Stop waiting on a frame so it can move to another worker.
+	 * Only valid if migratable() is true.
+	 */
+	virtual void unwatch(CodeFrame *) = 0;
+	/** Can frames waiting on io be taken back out of this engine? */
+	virtual bool migratable() const = 0;
+	/**
+	 * Do whatever io is ready, waiting up to timeout milliseconds
+	 * if there isn't any yet. Frames that are done are added to done.
+	 */
+	virtual void wait(std::list< CodeFrame * > &done, int timeout) = 0;
+	/** Make a wait() return early. Can be called from any thread. */
+	virtual void wake() = 0;
+	/**
+	 * Drop anything kept for a stream that's about to be closed.
+	 * Can be called from any thread, before the fd is closed.
+	 */
+	virtual void forget(Stream *) {}
+};
+
+IoEngine * new_epoll_engine();
+/** Returns NULL if io_uring isn't available */
+IoEngine * new_uring_engine();
+/**
+ * Create the engine by name, "uring" or "epoll". An empty name
+ * means io_uring if it's available and epoll otherwise.
+ */
+IoEngine * new_io_engine(const std::string &name);
+/** Wake up whatever is waiting on an eventfd */
+void wake_eventfd(int fd);
+/** Reset an eventfd after it's been woken */
+void drain_eventfd(int fd);
+
+
+#define FILE_IO_THREADS	4
+
+/**
+ * Threads for blocking io so it doesn't hold up a worker
+ *
+ * A frame is submitted w/ its io set. When the io is done the frame
+ * goes on its worker's iodone list and the worker's engine is woken.
+ */
+struct FileIoPool
+{
+	FileIoPool(int threads);
+
+	void submit(Worker &, CodeFrame *);
+
+private:
+	typedef std::pair< Worker *, CodeFrame * > Job;
+	static void * run(void *);
+
+	std::list< Job > jobs;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+
+	// don't copy
+	FileIoPool(const FileIoPool &);
 };
 
 #endif
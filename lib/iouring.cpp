@@ -0,0 +1,344 @@
+#include "io.h"
+#include "qbrt/schedule.h"
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstring>
+#include <cerrno>
+#include <poll.h>
+#include <iostream>
+
+using namespace std;
+
+#define URING_ENTRIES 64
+
+// low bit of the user data marks a poll, rather than the io itself
+#define URING_POLL_TAG	((uint64_t) 1)
+// user data for the poll on the wake eventfd. never a frame pointer
+#define URING_WAKE	((uint64_t) 2)
+
+
+static int io_uring_setup(unsigned entries, io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete
+		, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete
+			, flags, NULL, 0);
+}
+
+/**
+ * Completion based engine. Reads, writes and accepts are submitted
+ * to the kernel as they are, and anything else is submitted as a poll
+ * and then handled the same as with epoll.
+ *
+ * Submissions are queued until the next wait() so they go to the
+ * kernel in batches, and completions are read out of the shared ring
+ * w/o a syscall. Under load that's less than one syscall per io.
+ */
+struct UringEngine
+: public IoEngine
+{
+	UringEngine()
+	: ringfd(-1)
+	, sq_ring(NULL)
+	, cq_ring(NULL)
+	, sqes(NULL)
+	, sq_ring_size(0)
+	, cq_ring_size(0)
+	, unsubmitted(0)
+	, wakefd(eventfd(0, EFD_NONBLOCK))
+	, wake_armed(false)
+	{}
+
+	~UringEngine()
+	{
+		if (sqes) {
+			munmap(sqes, sq_entries * sizeof(io_uring_sqe));
+		}
+		if (cq_ring && cq_ring != sq_ring) {
+			munmap(cq_ring, cq_ring_size);
+		}
+		if (sq_ring) {
+			munmap(sq_ring, sq_ring_size);
+		}
+		if (ringfd >= 0) {
+			close(ringfd);
+		}
+		close(wakefd);
+	}
+
+	bool open();
+
+	const char * name() const { return "uring"; }
+
+	bool watch(CodeFrame *);
+	void unwatch(CodeFrame *) {}
+	// submitted io can't be pulled back out of the kernel
+	bool migratable() const { return false; }
+	void wait(list< CodeFrame * > &done, int timeout);
+	void wake() { wake_eventfd(wakefd); }
+
+private:
+	io_uring_sqe * next_sqe();
+	void submit(unsigned min_complete);
+	void reap(list< CodeFrame * > &done);
+	void submit_overflow();
+
+	int ringfd;
+	uint8_t *sq_ring;
+	uint8_t *cq_ring;
+	io_uring_sqe *sqes;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+
+	unsigned unsubmitted;
+	// watched when the submission queue was full
+	list< CodeFrame * > overflow;
+	__kernel_timespec timeout_spec;
+	int wakefd;
+	// is there a poll on wakefd in the ring?
+	bool wake_armed;
+};
+
+bool UringEngine::open()
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ringfd = io_uring_setup(URING_ENTRIES, &params);
+	if (ringfd < 0) {
+		return false;
+	}
+
+	sq_entries = params.sq_entries;
+	sq_ring_size = params.sq_off.array + sq_entries * sizeof(unsigned);
+	cq_ring_size = params.cq_off.cqes
+		+ params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap(params.features & IORING_FEAT_SINGLE_MMAP);
+	if (single_mmap && cq_ring_size > sq_ring_size) {
+		sq_ring_size = cq_ring_size;
+	}
+
+	void *ptr = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE
+			, MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED) {
+		return false;
+	}
+	sq_ring = (uint8_t *) ptr;
+	if (single_mmap) {
+		cq_ring = sq_ring;
+	} else {
+		ptr = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE
+				, MAP_SHARED | MAP_POPULATE, ringfd
+				, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED) {
+			return false;
+		}
+		cq_ring = (uint8_t *) ptr;
+	}
+	ptr = mmap(NULL, sq_entries * sizeof(io_uring_sqe)
+			, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE
+			, ringfd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		return false;
+	}
+	sqes = (io_uring_sqe *) ptr;
+
+	sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+	sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+	sq_mask = (unsigned *) (sq_ring + params.sq_off.ring_mask);
+	sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+	cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+	cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+	cq_mask = (unsigned *) (cq_ring + params.cq_off.ring_mask);
+	cqes = (io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+	return true;
+}
+
+/**
+ * Get the next free submission entry, submitting what's queued
+ * if the ring is full. NULL if it's still full after that.
+ */
+io_uring_sqe * UringEngine::next_sqe()
+{
+	unsigned tail(*sq_tail);
+	unsigned head(__atomic_load_n(sq_head, __ATOMIC_ACQUIRE));
+	if (tail - head >= sq_entries) {
+		submit(0);
+		head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= sq_entries) {
+			return NULL;
+		}
+	}
+	unsigned index(tail & *sq_mask);
+	io_uring_sqe *sqe = &sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	// the kernel doesn't look at the tail until the next enter
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++unsubmitted;
+	return sqe;
+}
+
+void UringEngine::submit(unsigned min_complete)
+{
+	unsigned flags(min_complete ? IORING_ENTER_GETEVENTS : 0);
+	int result(io_uring_enter(ringfd, unsubmitted, min_complete, flags));
+	if (result < 0) {
+		if (errno != EINTR) {
+			perror("io_uring_enter");
+		}
+		return;
+	}
+	unsubmitted -= result;
+}
+
+bool UringEngine::watch(CodeFrame *cf)
+{
+	io_uring_sqe *sqe = next_sqe();
+	if (!sqe) {
+		// still parked, it's submitted once there's room
+		overflow.push_back(cf);
+		return false;
+	}
+	StreamIO &io(*cf->io);
+	IoRequest req;
+	if (!io.request(req)) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = io.stream->fd;
+		sqe->poll32_events = io.events;
+		sqe->user_data = (uint64_t) cf | URING_POLL_TAG;
+	} else if (req.op == IOREQ_ACCEPT) {
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = req.fd;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = (uint64_t) cf;
+	} else {
+		sqe->opcode = (req.op == IOREQ_WRITE)
+			? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = req.fd;
+		sqe->addr = (uint64_t) req.buf;
+		sqe->len = req.len;
+		// use the current file position
+		sqe->off = (uint64_t) -1;
+		sqe->user_data = (uint64_t) cf;
+	}
+	return false;
+}
+
+void UringEngine::reap(list< CodeFrame * > &done)
+{
+	unsigned head(*cq_head);
+	unsigned tail(__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+	for (; head != tail; ++head) {
+		const io_uring_cqe &cqe(cqes[head & *cq_mask]);
+		if (!cqe.user_data) {
+			// a timeout from wait()
+			continue;
+		}
+		if (cqe.user_data == URING_WAKE) {
+			drain_eventfd(wakefd);
+			wake_armed = false;
+			continue;
+		}
+		CodeFrame *cf = (CodeFrame *) (cqe.user_data & ~URING_POLL_TAG);
+		if (cqe.user_data & URING_POLL_TAG) {
+			cf->io->handle();
+			if (cf->io->waiting()) {
+				// not done, poll for what it's waiting on now
+				watch(cf);
+				continue;
+			}
+		} else if (!cf->io->complete(cqe.res)) {
+			// partial write, go again for the rest
+			watch(cf);
+			continue;
+		}
+		done.push_back(cf);
+	}
+	__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * Submit the frames that didn't fit in the ring when they were
+ * watched. Any that still don't fit go back on the list.
+ */
+void UringEngine::submit_overflow()
+{
+	list< CodeFrame * > retry;
+	retry.swap(overflow);
+	list< CodeFrame * >::iterator it(retry.begin());
+	for (; it!=retry.end(); ++it) {
+		watch(*it);
+	}
+}
+
+void UringEngine::wait(list< CodeFrame * > &done, int timeout)
+{
+	reap(done);
+	// reaping makes room for completions, so the kernel
+	// can take more submissions
+	if (!overflow.empty()) {
+		submit_overflow();
+	}
+	if (!done.empty() || timeout == 0) {
+		if (unsubmitted) {
+			submit(0);
+		}
+		return;
+	}
+
+	// nothing else to do so block until some io finishes,
+	// someone wakes us or the timeout is up
+	io_uring_sqe *sqe;
+	if (!wake_armed && (sqe = next_sqe())) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = wakefd;
+		sqe->poll32_events = POLLIN;
+		sqe->user_data = URING_WAKE;
+		wake_armed = true;
+	}
+	sqe = next_sqe();
+	if (!sqe) {
+		// no room for the timeout, so don't block w/o one
+		submit(0);
+		reap(done);
+		return;
+	}
+	timeout_spec.tv_sec = timeout / 1000;
+	timeout_spec.tv_nsec = (timeout % 1000) * 1000000;
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->addr = (uint64_t) &timeout_spec;
+	sqe->len = 1;
+	// or after 1 other completion
+	sqe->off = 1;
+	sqe->user_data = 0;
+	submit(1);
+	reap(done);
+}
+
+IoEngine * new_uring_engine()
+{
+	UringEngine *engine = new UringEngine();
+	if (!engine->open()) {
+		delete engine;
+		return NULL;
+	}
+	return engine;
+}
@@ -0,0 +1,294 @@
+#include "qbc.h"
+#include "qbrt/stmt.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Liveness based register allocation
+ *
+ * The function's statements are flattened into nodes in the same order
+ * the code is generated, w/ a fork's code right after the fork. Each
+ * node gets the registers live into and out of it. Each local register
+ * is given the interval from the first node it's live at to the last.
+ * Registers w/ intervals that don't overlap share a slot.
+ *
+ * An interval includes the node where its register is last read, so
+ * an instruction never writes a slot it also reads from another
+ * register. Registers used w/ ref or lcontext can be pointed at from
+ * elsewhere or hold a ref, so they're kept for the whole function.
+ */
+
+typedef set< string > NameSet;
+
+struct LiveNode
+{
+	Stmt *stmt;
+	NameSet use;
+	NameSet def;
+	NameSet live_in;
+	NameSet live_out;
+	vector< int > next;
+	// where a goto, if or match can jump to
+	string jump;
+	// where the parent continues after a fork
+	int postfork;
+	bool fallthrough;
+
+	LiveNode(Stmt *s)
+	: stmt(s)
+	, postfork(-1)
+	, fallthrough(true)
+	{}
+};
+
+struct LiveInterval
+{
+	string name;
+	int start;
+	int end;
+
+	LiveInterval(const string &name, int i)
+	: name(name)
+	, start(i)
+	, end(i)
+	{}
+
+	friend bool operator < (const LiveInterval &a, const LiveInterval &b)
+	{
+		return a.start < b.start
+			|| (a.start == b.start && a.name < b.name);
+	}
+};
+
+struct FlowGraph
+{
+	vector< LiveNode > node;
+	map< string, int > label;
+	NameSet pinned;
+	const RegAlloc &regs;
+
+	FlowGraph(const RegAlloc &regs)
+	: regs(regs)
+	{}
+
+	/** Is this register a local or a field of one? Not an arg. */
+	bool local(const AsmReg *r) const
+	{
+		return r && r->reg_type == '$'
+			&& regs.registry.find(r->name) == regs.registry.end();
+	}
+	bool local_whole(const AsmReg *r) const
+	{
+		return local(r) && r->ext < 0 && r->sub_name.empty();
+	}
+	void add_use(LiveNode &n, const AsmReg *r) const
+	{
+		if (local(r)) {
+			n.use.insert(r->name);
+		}
+	}
+};
+
+static void flatten(FlowGraph &g, Stmt::List &stmts, const AsmReg *fork_target)
+{
+	Stmt::List::iterator it(stmts.begin());
+	for (; it!=stmts.end(); ++it) {
+		int i(g.node.size());
+		g.node.push_back(LiveNode(*it));
+
+		StmtRegs regs;
+		inspect_registers(*it, regs);
+		list< AsmReg ** >::const_iterator sit(regs.src.begin());
+		for (; sit!=regs.src.end(); ++sit) {
+			g.add_use(g.node[i], **sit);
+		}
+		list< AsmReg * >::const_iterator uit(regs.use.begin());
+		for (; uit!=regs.use.end(); ++uit) {
+			g.add_use(g.node[i], *uit);
+		}
+		for (uit=regs.mod.begin(); uit!=regs.mod.end(); ++uit) {
+			g.add_use(g.node[i], *uit);
+		}
+		if (g.local(regs.dst)) {
+			g.node[i].def.insert(regs.dst->name);
+			if (regs.branch || !g.local_whole(regs.dst)) {
+				// a field write or a match that jumps
+				// keeps the rest of the old value
+				g.node[i].use.insert(regs.dst->name);
+			}
+		}
+
+		label_stmt *ls;
+		fork_stmt *fork;
+		ref_stmt *ref;
+		lcontext_stmt *lcontext;
+		if ((ls = dynamic_cast< label_stmt * >(*it))) {
+			g.label[ls->label.name] = i;
+		} else if (dynamic_cast< goto_stmt * >(*it)) {
+			g.node[i].jump = static_cast< goto_stmt * >(*it)->label.name;
+			g.node[i].fallthrough = false;
+		} else if (dynamic_cast< return_stmt * >(*it)) {
+			// a fork's target goes back to the parent
+			if (g.local(fork_target)) {
+				g.node[i].use.insert(fork_target->name);
+			}
+			g.node[i].fallthrough = false;
+		} else if ((fork = dynamic_cast< fork_stmt * >(*it))) {
+			if (fork->has_code()) {
+				flatten(g, *fork->code, fork->dst);
+			}
+			g.node[i].postfork = g.node.size();
+		} else if ((ref = dynamic_cast< ref_stmt * >(*it))) {
+			if (g.local_whole(ref->src)) {
+				g.pinned.insert(ref->src->name);
+			}
+			if (g.local_whole(ref->dst)) {
+				g.pinned.insert(ref->dst->name);
+			}
+		} else if ((lcontext = dynamic_cast< lcontext_stmt * >(*it))) {
+			if (g.local_whole(lcontext->dst)) {
+				g.pinned.insert(lcontext->dst->name);
+			}
+		} else if (regs.branch) {
+			if_stmt *ifs(dynamic_cast< if_stmt * >(*it));
+			iffail_stmt *iffail(dynamic_cast< iffail_stmt * >(*it));
+			match_stmt *match(dynamic_cast< match_stmt * >(*it));
+			matchargs_stmt *margs(dynamic_cast< matchargs_stmt * >(*it));
+			if (ifs) {
+				g.node[i].jump = ifs->label.name;
+			} else if (iffail) {
+				g.node[i].jump = iffail->label.name;
+			} else if (match) {
+				g.node[i].jump = match->nonmatch.name;
+			} else if (margs) {
+				g.node[i].jump = margs->nonmatch.name;
+			}
+		}
+	}
+}
+
+static void link_nodes(FlowGraph &g)
+{
+	int n(g.node.size());
+	for (int i(0); i<n; ++i) {
+		LiveNode &node(g.node[i]);
+		if (node.fallthrough && i + 1 < n) {
+			node.next.push_back(i + 1);
+		}
+		if (node.postfork >= 0 && node.postfork < n) {
+			node.next.push_back(node.postfork);
+		}
+		if (!node.jump.empty()) {
+			map< string, int >::const_iterator
+				it(g.label.find(node.jump));
+			if (it != g.label.end()) {
+				node.next.push_back(it->second);
+			}
+		}
+	}
+}
+
+static void find_live_registers(FlowGraph &g)
+{
+	bool changed(true);
+	while (changed) {
+		changed = false;
+		for (int i(g.node.size() - 1); i>=0; --i) {
+			LiveNode &node(g.node[i]);
+			NameSet out;
+			vector< int >::const_iterator nit(node.next.begin());
+			for (; nit!=node.next.end(); ++nit) {
+				const NameSet &next_in(g.node[*nit].live_in);
+				out.insert(next_in.begin(), next_in.end());
+			}
+			NameSet in(node.use);
+			NameSet::const_iterator it(out.begin());
+			for (; it!=out.end(); ++it) {
+				if (!node.def.count(*it)) {
+					in.insert(*it);
+				}
+			}
+			if (in != node.live_in || out != node.live_out) {
+				node.live_in.swap(in);
+				node.live_out.swap(out);
+				changed = true;
+			}
+		}
+	}
+}
+
+static void extend_interval(map< string, LiveInterval > &interval
+		, const NameSet &names, int i)
+{
+	NameSet::const_iterator it(names.begin());
+	for (; it!=names.end(); ++it) {
+		map< string, LiveInterval >::iterator
+			iit(interval.find(*it));
+		if (iit == interval.end()) {
+			interval.insert(make_pair(*it, LiveInterval(*it, i)));
+		} else {
+			iit->second.start = min(iit->second.start, i);
+			iit->second.end = max(iit->second.end, i);
+		}
+	}
+}
+
+void assign_slots(Stmt::List &code, RegAlloc &regs)
+{
+	FlowGraph g(regs);
+	flatten(g, code, NULL);
+	link_nodes(g);
+	find_live_registers(g);
+
+	map< string, LiveInterval > interval;
+	int n(g.node.size());
+	for (int i(0); i<n; ++i) {
+		const LiveNode &node(g.node[i]);
+		extend_interval(interval, node.live_in, i);
+		extend_interval(interval, node.live_out, i);
+		extend_interval(interval, node.use, i);
+		extend_interval(interval, node.def, i);
+	}
+	NameSet::const_iterator pit(g.pinned.begin());
+	for (; pit!=g.pinned.end(); ++pit) {
+		map< string, LiveInterval >::iterator
+			iit(interval.find(*pit));
+		if (iit != interval.end()) {
+			iit->second.start = 0;
+			iit->second.end = n - 1;
+		}
+	}
+
+	vector< LiveInterval > sorted;
+	map< string, LiveInterval >::const_iterator it(interval.begin());
+	for (; it!=interval.end(); ++it) {
+		sorted.push_back(it->second);
+	}
+	sort(sorted.begin(), sorted.end());
+
+	// linear scan, reusing the lowest slot that's free
+	multimap< int, uint8_t > active;
+	set< uint8_t > free_slots;
+	uint8_t slotc(0);
+	vector< LiveInterval >::const_iterator sit(sorted.begin());
+	for (; sit!=sorted.end(); ++sit) {
+		while (!active.empty() && active.begin()->first < sit->start) {
+			free_slots.insert(active.begin()->second);
+			active.erase(active.begin());
+		}
+		uint8_t slot;
+		if (free_slots.empty()) {
+			slot = regs.argc + slotc++;
+		} else {
+			slot = *free_slots.begin();
+			free_slots.erase(free_slots.begin());
+		}
+		regs.slot[sit->name] = slot;
+		active.insert(make_pair(sit->end, slot));
+	}
+	regs.counter = regs.argc + slotc;
+}
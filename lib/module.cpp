@@ -5,6 +5,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <iostream>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using namespace std;
 
@@ -166,108 +174,45 @@ struct ProtocolFunctionSearch
 	~ProtocolFunctionSearch() {}
 };
 
-struct PolymorphFunctionSearch
+static int compare_param_types(const char *values, const char *params)
 {
-	typedef FunctionHeader resource_t;
-	static const uint16_t resource_type_id = RESOURCE_FUNCTION;
-
-	/**
-	 * Compare protocol & function to the function at i
-	 */
-	int compare(const ResourceTable &tbl, uint16_t i) const
-	{
-		const FunctionHeader *f = tbl.ptr< FunctionHeader >(i);
-		if (PFC_OVERRIDE < f->fcontext) {
-			cerr << "wtf is this fcontext? " << f->fcontext
-				<< endl;
-			return 0;
-		}
-		if (PFC_OVERRIDE > f->fcontext) {
-			return 1;
-		}
-
-		const PolymorphResource *poly;
-		poly = tbl.ptr< PolymorphResource >(f->context_idx());
-		const ModSym &protoms(fetch_modsym(tbl, poly->protocol_idx()));
-		// compare protocol module
-		const char *other_mod = fetch_string(tbl, protoms.mod_name());
-		if (this->proto_mod < other_mod) {
-			return -1;
-		}
-		if (this->proto_mod > other_mod) {
-			return 1;
-		}
-		// compare protocol symbol
-		const char *other_sym = fetch_string(tbl, protoms.sym_name());
-		if (this->proto_name < other_sym) {
-			return -1;
+	int value_len(strlen(values));
+	int param_len(strlen(params));
+	int cmp_len(value_len < param_len ? value_len : param_len);
+	int vi(0), pi(0);
+	while (vi < value_len && pi < param_len) {
+		if (values[vi] == params[pi]) {
+			++vi;
+			++pi;
+			continue;
 		}
-		if (this->proto_name > other_sym) {
-			return 1;
+		if (strncmp(params + pi, "*/", 2) == 0) {
+			while (values[++vi] != ')');
+			while (params[++pi] != ')');
+			continue;
 		}
-
-		const char *fname = fetch_string(tbl, f->name_idx());
-		if (function < fname) {
+		if (values[vi] < params[pi]) {
 			return -1;
 		}
-		if (function > fname) {
-			return 1;
-		}
-
-		const char *param_types =
-				fetch_string(tbl, f->param_types_idx());
-		return compare_types(value_types.c_str(), param_types);
+		// values[vi] must be > params[pi]
+		return 1;
 	}
 
-	static int compare_types(const char *values, const char *params)
-	{
-		int value_len(strlen(values));
-		int param_len(strlen(params));
-		int cmp_len(value_len < param_len ? value_len : param_len);
-		int vi(0), pi(0);
-		while (vi < value_len && pi < param_len) {
-			if (values[vi] == params[pi]) {
-				++vi;
-				++pi;
-				continue;
-			}
-			if (strncmp(params + pi, "*/", 2) == 0) {
-				while (values[++vi] != ')');
-				while (params[++pi] != ')');
-				continue;
-			}
-			if (values[vi] < params[pi]) {
-				return -1;
-			}
-			// values[vi] must be > params[pi]
-			return 1;
-		}
-
-		int value_rem(value_len - vi);
-		int param_rem(param_len - pi);
-		if (value_rem < param_rem) {
-			return -1;
-		}
-		if (value_rem > param_rem) {
-			return +1;
-		}
-		return 0;
+	int value_rem(value_len - vi);
+	int param_rem(param_len - pi);
+	if (value_rem < param_rem) {
+		return -1;
 	}
+	if (value_rem > param_rem) {
+		return +1;
+	}
+	return 0;
+}
 
-	const std::string &proto_mod;
-	const std::string &proto_name;
-	const std::string &function;
-	const std::string &value_types;
-
-	PolymorphFunctionSearch(const std::string &pmod
-			, const std::string &pname, const std::string &f
-			, const string &value_types)
-		: proto_mod(pmod)
-		, proto_name(pname)
-		, function(f)
-		, value_types(value_types)
-	{}
-};
+bool match_param_types(const std::string &values, const std::string &params)
+{
+	return compare_param_types(values.c_str(), params.c_str()) == 0;
+}
 
 struct ConstructSearch
 {
@@ -339,19 +284,6 @@ const QbrtFunction * Module::fetch_protocol_function(
 	return qbrt_function(f);
 }
 
-const QbrtFunction * Module::fetch_override(const string &protomod
-		, const string &protoname, const string &fname
-		, const string &value_types) const
-{
-	const FunctionHeader *f;
-	PolymorphFunctionSearch query(protomod, protoname, fname, value_types);
-	f = resource.find(query);
-	if (!f) {
-		return NULL;
-	}
-	return qbrt_function(f);
-}
-
 const Type * indexed_datatype(const Module &mod, uint16_t idx)
 {
 	map< uint16_t, const Type * >::const_iterator it;
@@ -382,105 +314,367 @@ const QbrtFunction * Module::qbrt_function(const FunctionHeader *f) const
 	return result;
 }
 
-bool open_qb(ifstream &objstr, const std::string &objname)
+/**
+ * A QBPATH directory and the modules in it. It's only read again
+ * when its mtime changes, which is whenever a file is added,
+ * removed or renamed in it.
+ */
+struct QbDirectory
 {
-	const char *envpath(getenv("QBPATH"));
-	if (!(envpath && *envpath)) {
-		envpath = ".";
+	string path;
+	timespec mtime;
+	set< string > modules;
+
+	QbDirectory(const string &path)
+	: path(path)
+	{
+		mtime.tv_sec = 0;
+		mtime.tv_nsec = 0;
+	}
+};
+
+static pthread_mutex_t g_qbpath_lock = PTHREAD_MUTEX_INITIALIZER;
+static string g_qbpath;
+static vector< QbDirectory > g_qbpath_dirs;
+
+static void scan_qb_directory(QbDirectory &dir, const timespec &mtime)
+{
+	dir.modules.clear();
+	dir.mtime = mtime;
+	DIR *d = opendir(dir.path.c_str());
+	if (!d) {
+		return;
 	}
-	char *path(strdup(envpath));
-
-	const string qbname(objname +".qb");
-	const char *dir = strtok(path, ":");
-	char truedir[4096];
-	while (dir) {
-		realpath(dir, truedir);
-		string filename(truedir);
-		filename += "/" + qbname;
-		objstr.open(filename.c_str(), ios::in | ios::binary);
-		if (objstr) {
+	const dirent *ent;
+	while ((ent = readdir(d))) {
+		size_t len(strlen(ent->d_name));
+		if (len > 3 && strcmp(ent->d_name + len - 3, ".qb") == 0) {
+			dir.modules.insert(string(ent->d_name, len - 3));
+		}
+	}
+	closedir(d);
+}
+
+/**
+ * Rescan any directories that changed since they were last read.
+ * Returns true if any did.
+ */
+static bool refresh_qb_directories()
+{
+	bool changed(false);
+	vector< QbDirectory >::iterator it(g_qbpath_dirs.begin());
+	for (; it!=g_qbpath_dirs.end(); ++it) {
+		struct stat st;
+		timespec mtime = { 0, 0 };
+		if (stat(it->path.c_str(), &st) == 0) {
+			mtime = st.st_mtim;
+		}
+		if (mtime.tv_sec == it->mtime.tv_sec
+				&& mtime.tv_nsec == it->mtime.tv_nsec) {
+			continue;
+		}
+		// a directory that doesn't exist has no modules
+		scan_qb_directory(*it, mtime);
+		changed = true;
+	}
+	return changed;
+}
+
+static void index_qbpath(const string &qbpath)
+{
+	g_qbpath = qbpath;
+	g_qbpath_dirs.clear();
+	size_t start(0);
+	while (start <= qbpath.size()) {
+		size_t colon(qbpath.find(':', start));
+		if (colon == string::npos) {
+			colon = qbpath.size();
+		}
+		string dir(qbpath.substr(start, colon - start));
+		start = colon + 1;
+		if (dir.empty()) {
+			continue;
+		}
+		char truedir[PATH_MAX];
+		if (realpath(dir.c_str(), truedir)) {
+			dir = truedir;
+		}
+		g_qbpath_dirs.push_back(QbDirectory(dir));
+	}
+	refresh_qb_directories();
+}
+
+static bool find_qb(const string &objname, string &filename)
+{
+	vector< QbDirectory >::const_iterator it(g_qbpath_dirs.begin());
+	for (; it!=g_qbpath_dirs.end(); ++it) {
+		if (it->modules.count(objname)) {
+			filename = it->path +"/"+ objname +".qb";
 			return true;
 		}
-		dir = strtok(NULL, ":");
 	}
-	free(path);
-	cerr << "failed to find " << qbname << " in QBPATH=" << envpath << endl;
 	return false;
 }
 
-void read_header(ObjectHeader &h, istream &input)
+/**
+ * The directories are only read when QBPATH changes or a module
+ * isn't where the index says, so most loads are a single open
+ * and a missing module costs a stat per directory.
+ */
+int open_qb(const std::string &objname)
 {
-	input.read((char *) &h, ObjectHeader::SIZE);
-	h.qbrt_version = be32toh(h.qbrt_version);
-	h.flags = be64toh(h.flags);
-	h.name = be16toh(h.name);
-	h.version = be16toh(h.version);
-	h.iteration = be16toh(h.iteration);
-	h.imports = be16toh(h.imports);
-	h.source_filename = be16toh(h.source_filename);
+	const char *envpath(getenv("QBPATH"));
+	if (!(envpath && *envpath)) {
+		envpath = ".";
+	}
+
+	int fd(-1);
+	string filename;
+	pthread_mutex_lock(&g_qbpath_lock);
+	if (envpath != g_qbpath) {
+		index_qbpath(envpath);
+	}
+	if (find_qb(objname, filename)) {
+		fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+	if (fd < 0 && refresh_qb_directories()
+			&& find_qb(objname, filename)) {
+		fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+	pthread_mutex_unlock(&g_qbpath_lock);
+
+	if (fd < 0) {
+		cerr << "failed to find " << objname << ".qb in QBPATH="
+			<< envpath << endl;
+	}
+	return fd;
 }
 
-void read_resource_table(ResourceTable &tbl, istream &input)
+void read_header(ObjectHeader &h, const uint8_t *input)
 {
-	tbl.data_size = read32(input);
-	tbl.resource_count = read16(input);
-	uint32_t index_size(tbl.resource_count * ResourceInfo::SIZE);
-
-	uint8_t *data = new uint8_t[tbl.data_size];
-	uint8_t *index = new uint8_t[index_size];
+	memcpy(&h, input, ObjectHeader::SIZE);
+	h.qbrt_version = qb32toh(h.qbrt_version);
+	h.flags = qb64toh(h.flags);
+	h.name = qb16toh(h.name);
+	h.version = qb16toh(h.version);
+	h.iteration = qb16toh(h.iteration);
+	h.imports = qb16toh(h.imports);
+	h.source_filename = qb16toh(h.source_filename);
+}
 
-	input.read((char *) data, tbl.data_size);
-	input.read((char *) index, index_size);
+/**
+ * Point the table into the mapped file. Returns false if the file
+ * is too short for it.
+ */
+bool read_resource_table(ResourceTable &tbl, const uint8_t *input
+		, size_t size)
+{
+	const uint8_t *tblhdr(input + ObjectHeader::SIZE);
+	tbl.data_size = read32(tblhdr);
+	tbl.resource_count = read16(tblhdr + 4);
+	uint32_t index_size(tbl.resource_count * ResourceInfo::SIZE);
+	if (size < (size_t) tbl.index_offset() + index_size) {
+		return false;
+	}
 
-	tbl.data = data;
-	tbl.index = index;
+	tbl.data = input + ResourceTable::DATA_OFFSET;
+	tbl.index = input + tbl.index_offset();
+	return true;
 }
 
-Module * read_module(const string &objname)
+/**
+ * Read the module at the start of some mapped bytes. The module
+ * name comes from the module itself if objname is empty.
+ */
+static Module * parse_module(const string &objname, const uint8_t *input
+		, size_t size)
 {
-	ifstream in;
-	if (!open_qb(in, objname)) {
-		return NULL;
+	string label(objname.empty() ? "image" : objname);
+	if (size < ResourceTable::DATA_OFFSET) {
+		cerr << "module file is truncated: " << label & DIE;
 	}
 	Module *mod = new Module(objname);
-	read_header(mod->header, in);
-	read_resource_table(mod->resource, in);
-	in.close();
+	read_header(mod->header, input);
+	if (mod->header.qbrt_version != QBRT_VERSION) {
+		cerr << "module " << label << " is for qbrt version "
+			<< mod->header.qbrt_version << ", not " << QBRT_VERSION
+			<< ". compile it again w/ qbc" & DIE;
+	}
+	if (!read_resource_table(mod->resource, input, size)) {
+		cerr << "module file is truncated: " << label & DIE;
+	}
+	// sized now so linking never moves it under a running worker
+	mod->resource.link.resize(mod->resource.resource_count);
 	if (mod->header.name == 0) {
-		cerr << "module name is not set for: " << objname & DIE;
+		cerr << "module name is not set for: " << label & DIE;
 	}
 	const char *header_name(fetch_string(mod->resource, mod->header.name));
-	if (header_name != objname) {
+	if (objname.empty()) {
+		mod->name = header_name;
+	} else if (header_name != objname) {
 		cerr << "module name mismatch: " << mod->header.name << "/"
 			<< (int) *header_name << " != " << objname & DIE;
 	}
+	return mod;
+}
+
+/**
+ * The .qb file is mapped rather than read, so the resources are
+ * used straight from the page cache and modules loaded by several
+ * processes share the same pages.
+ */
+Module * read_module(const string &objname)
+{
+	int fd(open_qb(objname));
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		cerr << "cannot stat module " << objname << ": "
+			<< strerror(errno) & DIE;
+	}
+	size_t size(st.st_size);
+	if (size < ResourceTable::DATA_OFFSET) {
+		cerr << "module file is truncated: " << objname & DIE;
+	}
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		cerr << "cannot map module " << objname << ": "
+			<< strerror(errno) & DIE;
+	}
 
+	Module *mod = parse_module(objname, (const uint8_t *) mapping, size);
+	mod->mapping = mapping;
+	mod->mapping_size = size;
 	return mod;
 }
 
-const CFunction * fetch_c_function(const Module &m, const std::string &name)
+void module_imports(const Module &mod, vector< string > &names)
 {
-	pair< multimap< string, CFunction >::const_iterator
-		, multimap< string, CFunction >::const_iterator > range;
-	range = m.cfunction.equal_range(name);
-	if (range.first == range.second) {
+	if (!mod.header.imports) {
+		return;
+	}
+	const ResourceTable &tbl(mod.resource);
+	const ImportResource *import = tbl.ptr< ImportResource >(
+			mod.header.imports);
+	for (uint16_t i(0); i<import->count(); ++i) {
+		names.push_back(fetch_string(tbl, import->modules(i)));
+	}
+}
+
+/**
+ * Fill in the functions from the module's link table in the image.
+ * The rest of the links are done w/ the rest of the modules.
+ */
+static void link_image_module(Module &mod, const vector< Module * > &modules
+		, const uint8_t *links)
+{
+	ResourceTable &tbl(mod.resource);
+	for (uint16_t i(0); i<tbl.resource_count; ++i) {
+		const ImageLink *link((const ImageLink *)
+				(links + i * ImageLink::SIZE));
+		if (link->module() == IMAGE_NO_LINK) {
+			continue;
+		}
+		if (tbl.type(i) != RESOURCE_MODSYM
+				|| link->module() >= modules.size()) {
+			cerr << "bad image link in " << mod.name << ": " << i
+				& DIE;
+		}
+		const Module &target(*modules[link->module()]);
+		uint16_t fidx(link->function());
+		if (fidx >= target.resource.resource_count
+				|| target.resource.type(fidx) != RESOURCE_FUNCTION) {
+			cerr << "bad image link in " << mod.name << ": " << i
+				& DIE;
+		}
+		tbl.link[i].module = &target;
+		tbl.link[i].qbrt = target.function_at(fidx);
+	}
+}
+
+/**
+ * The whole image is mapped once and stays mapped for the life of
+ * the process. The modules point into it the same as for .qb files.
+ */
+Module * read_image(const string &path, vector< Module * > &modules)
+{
+	int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd < 0) {
+		cerr << "cannot open image " << path << ": " << strerror(errno)
+			<< endl;
 		return NULL;
 	}
-	multimap< string, CFunction >::const_iterator it(range.first);
-	for (; it != range.second; ++it) {
-		if (it->second.fcontext() == PFC_NONE) {
-			// there should be only 1 regular function with
-			// this name. looks like we found it.
-			return &it->second;
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		cerr << "cannot stat image " << path << ": "
+			<< strerror(errno) & DIE;
+	}
+	size_t size(st.st_size);
+	if (size < ImageHeader::SIZE) {
+		cerr << "image file is truncated: " << path & DIE;
+	}
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		cerr << "cannot map image " << path << ": "
+			<< strerror(errno) & DIE;
+	}
+
+	return parse_image(path, (const uint8_t *) mapping, size, modules);
+}
+
+Module * parse_image(const string &path, const uint8_t *input, size_t size
+		, vector< Module * > &modules)
+{
+	if (size < ImageHeader::SIZE) {
+		cerr << "image file is truncated: " << path & DIE;
+	}
+	const ImageHeader *hdr((const ImageHeader *) input);
+	if (memcmp(hdr->magic, IMAGE_MAGIC, 4) != 0) {
+		cerr << "not an application image: " << path & DIE;
+	}
+	if (hdr->qbrt_version() != QBRT_VERSION) {
+		cerr << "image " << path << " is for qbrt version "
+			<< hdr->qbrt_version() << ", not " << QBRT_VERSION
+			<< ". build it again w/ qbc --image" & DIE;
+	}
+	uint16_t count(hdr->module_count());
+	if (hdr->main_module() >= count
+			|| size < ImageHeader::SIZE + count * ImageModule::SIZE) {
+		cerr << "image file is truncated: " << path & DIE;
+	}
+	const ImageModule *entry((const ImageModule *)
+			(input + ImageHeader::SIZE));
+	for (uint16_t i(0); i<count; ++i) {
+		if ((size_t) entry[i].offset() + entry[i].size() > size) {
+			cerr << "image file is truncated: " << path & DIE;
+		}
+		modules.push_back(parse_module("", input + entry[i].offset()
+					, entry[i].size()));
+	}
+	// link after they're all read so links can go any direction
+	for (uint16_t i(0); i<count; ++i) {
+		Module &mod(*modules[i]);
+		size_t links(entry[i].links());
+		if (links + mod.resource.resource_count * ImageLink::SIZE > size) {
+			cerr << "image file is truncated: " << path & DIE;
 		}
+		link_image_module(mod, modules, input + links);
 	}
+	return modules[hdr->main_module()];
+}
 
-	return NULL;
+Module::~Module()
+{
+	if (mapping) {
+		munmap(const_cast< void * >(mapping), mapping_size);
+	}
 }
 
-const CFunction * fetch_c_override(const Module &m, const std::string &protomod
-		, const std::string &protoname, const std::string &name
-		, const std::string &value_types)
+const CFunction * fetch_c_function(const Module &m, const std::string &name)
 {
 	pair< multimap< string, CFunction >::const_iterator
 		, multimap< string, CFunction >::const_iterator > range;
@@ -490,17 +684,13 @@ const CFunction * fetch_c_override(const Module &m, const std::string &protomod
 	}
 	multimap< string, CFunction >::const_iterator it(range.first);
 	for (; it != range.second; ++it) {
-		if (it->second.proto_module != protomod) {
-			continue;
-		}
-		if (it->second.proto_name != protoname) {
-			continue;
-		}
-		if (it->second.param_types != value_types) {
-			continue;
+		if (it->second.fcontext() == PFC_NONE) {
+			// there should be only 1 regular function with
+			// this name. looks like we found it.
+			return &it->second;
 		}
-		return &it->second;
 	}
+
 	return NULL;
 }
 
@@ -0,0 +1,834 @@
+#include "qbc.h"
+#include "qbrt/stmt.h"
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdint.h>
+
+using namespace std;
+
+/**
+ * Optimization passes for qbc -O
+ *
+ * These run on each function's statements before registers are
+ * allocated, so registers are still known by name. A few rules keep
+ * them safe w/o a full data flow analysis:
+ *
+ * Knowledge about register values only lasts until the next label,
+ * jump or fork. Registers that are ever the source or destination of
+ * a ref, or that hold a context, can change behind the function's
+ * back so nothing is assumed about them. Stores are only removed if
+ * they can't fail the frame and the registers they read are known
+ * to be readable.
+ */
+
+// stop after this many rounds even if the passes are still finding things
+#define OPTIMIZE_MAX_ROUNDS	8
+
+typedef set< string > RegSet;
+
+struct KnownValue
+{
+	// 'i' for an int, 'b' for a bool
+	char type;
+	int32_t value;
+
+	KnownValue()
+	: type(0)
+	, value(0)
+	{}
+	KnownValue(char typ, int32_t val)
+	: type(typ)
+	, value(val)
+	{}
+};
+typedef map< string, KnownValue > KnownMap;
+
+/** Is this a whole $ or % register, not a field or a special register */
+static bool whole_reg(const AsmReg *r)
+{
+	return r && (r->reg_type == '$' || r->reg_type == '%')
+		&& r->ext < 0 && r->sub_name.empty();
+}
+
+/** Is this register or a field of it a $ or % register? */
+static bool named_reg(const AsmReg *r)
+{
+	return r && (r->reg_type == '$' || r->reg_type == '%');
+}
+
+static bool bool_modsym(const AsmModSym &ms, bool &value)
+{
+	if (ms.module.value != "core") {
+		return false;
+	}
+	if (ms.symbol.value == "True") {
+		value = true;
+		return true;
+	} else if (ms.symbol.value == "False") {
+		value = false;
+		return true;
+	}
+	return false;
+}
+
+static void write_reg(StmtRegs &regs, AsmReg *dst, bool pure)
+{
+	if (whole_reg(dst)) {
+		regs.dst = dst;
+		regs.pure = pure;
+	} else if (named_reg(dst)) {
+		// writing a field modifies the value in the primary register
+		regs.mod.push_back(dst);
+	}
+}
+
+void inspect_registers(Stmt *s, StmtRegs &regs)
+{
+	binaryop_stmt *binop;
+	call_stmt *call;
+	calllazy_stmt *calllazy;
+	cfailure_stmt *cfailure;
+	cmp_stmt *cmp;
+	consti_stmt *consti;
+	consts_stmt *consts;
+	consthash_stmt *consthash;
+	copy_stmt *copy;
+	ctuple_stmt *ctuple;
+	fieldget_stmt *fieldget;
+	fieldset_stmt *fieldset;
+	fork_stmt *fork;
+	if_stmt *ifs;
+	iffail_stmt *iffail;
+	lcontext_stmt *lcontext;
+	lconstruct_stmt *lconstruct;
+	lfunc_stmt *lfunc;
+	match_stmt *match;
+	matchargs_stmt *matchargs;
+	newproc_stmt *newproc;
+	patternvar_stmt *patternvar;
+	recv_stmt *recv;
+	ref_stmt *ref;
+	stracc_stmt *stracc;
+	bool b;
+
+	if ((binop = dynamic_cast< binaryop_stmt * >(s))) {
+		regs.src.push_back(&binop->a);
+		regs.src.push_back(&binop->b);
+		// idiv fails on a 0 divisor
+		write_reg(regs, binop->result, binop->op != '/');
+		regs.checked = true;
+	} else if ((call = dynamic_cast< call_stmt * >(s))) {
+		regs.use.push_back(call->function);
+		regs.use.push_back(call->a);
+		regs.use.push_back(call->b);
+		write_reg(regs, call->result, false);
+	} else if ((calllazy = dynamic_cast< calllazy_stmt * >(s))) {
+		regs.use.push_back(calllazy->function);
+		write_reg(regs, calllazy->result, false);
+	} else if ((cfailure = dynamic_cast< cfailure_stmt * >(s))) {
+		write_reg(regs, cfailure->dst, false);
+	} else if ((cmp = dynamic_cast< cmp_stmt * >(s))) {
+		regs.src.push_back(&cmp->a);
+		regs.src.push_back(&cmp->b);
+		write_reg(regs, cmp->result, true);
+		regs.checked = true;
+	} else if ((consti = dynamic_cast< consti_stmt * >(s))) {
+		write_reg(regs, consti->dst, true);
+	} else if ((consts = dynamic_cast< consts_stmt * >(s))) {
+		write_reg(regs, consts->dst, true);
+	} else if ((consthash = dynamic_cast< consthash_stmt * >(s))) {
+		write_reg(regs, consthash->dst, true);
+	} else if ((copy = dynamic_cast< copy_stmt * >(s))) {
+		regs.src.push_back(&copy->src);
+		write_reg(regs, copy->dst, true);
+		regs.checked = true;
+	} else if ((ctuple = dynamic_cast< ctuple_stmt * >(s))) {
+		write_reg(regs, ctuple->dst, true);
+	} else if ((fieldget = dynamic_cast< fieldget_stmt * >(s))) {
+		regs.use.push_back(fieldget->src);
+		write_reg(regs, fieldget->dst, false);
+	} else if ((fieldset = dynamic_cast< fieldset_stmt * >(s))) {
+		regs.use.push_back(fieldset->src);
+		regs.mod.push_back(fieldset->dst);
+	} else if ((fork = dynamic_cast< fork_stmt * >(s))) {
+		write_reg(regs, fork->dst, false);
+	} else if ((ifs = dynamic_cast< if_stmt * >(s))) {
+		regs.src.push_back(&ifs->reg);
+		regs.checked = true;
+		regs.branch = true;
+	} else if ((iffail = dynamic_cast< iffail_stmt * >(s))) {
+		regs.use.push_back(iffail->reg);
+		regs.branch = true;
+	} else if ((lcontext = dynamic_cast< lcontext_stmt * >(s))) {
+		write_reg(regs, lcontext->dst, false);
+	} else if ((lconstruct = dynamic_cast< lconstruct_stmt * >(s))) {
+		// other constructs are linked when the module loads
+		write_reg(regs, lconstruct->dst
+				, bool_modsym(*lconstruct->modsym, b));
+	} else if ((lfunc = dynamic_cast< lfunc_stmt * >(s))) {
+		write_reg(regs, lfunc->dst, false);
+	} else if ((match = dynamic_cast< match_stmt * >(s))) {
+		regs.use.push_back(match->pattern);
+		regs.use.push_back(match->input);
+		write_reg(regs, match->result, false);
+		regs.branch = true;
+	} else if ((matchargs = dynamic_cast< matchargs_stmt * >(s))) {
+		regs.use.push_back(matchargs->pattern);
+		regs.mod.push_back(matchargs->result);
+		regs.branch = true;
+	} else if ((newproc = dynamic_cast< newproc_stmt * >(s))) {
+		regs.use.push_back(newproc->func);
+		write_reg(regs, newproc->pid, false);
+	} else if ((patternvar = dynamic_cast< patternvar_stmt * >(s))) {
+		write_reg(regs, patternvar->dst, true);
+	} else if ((recv = dynamic_cast< recv_stmt * >(s))) {
+		regs.use.push_back(recv->timeout);
+		write_reg(regs, recv->dst, false);
+	} else if ((ref = dynamic_cast< ref_stmt * >(s))) {
+		regs.use.push_back(ref->src);
+		write_reg(regs, ref->dst, true);
+	} else if ((stracc = dynamic_cast< stracc_stmt * >(s))) {
+		regs.use.push_back(stracc->src);
+		regs.mod.push_back(stracc->dst);
+	}
+}
+
+/**
+ * Collect the registers that are read anywhere in the function
+ * and the ones that shouldn't be touched
+ */
+static void scan_registers(Stmt::List &stmts, RegSet &read, RegSet &untracked)
+{
+	Stmt::List::iterator it(stmts.begin());
+	for (; it!=stmts.end(); ++it) {
+		StmtRegs regs;
+		inspect_registers(*it, regs);
+		list< AsmReg ** >::const_iterator sit(regs.src.begin());
+		for (; sit!=regs.src.end(); ++sit) {
+			if (named_reg(**sit)) {
+				read.insert((**sit)->name);
+			}
+		}
+		list< AsmReg * >::const_iterator uit(regs.use.begin());
+		for (; uit!=regs.use.end(); ++uit) {
+			if (named_reg(*uit)) {
+				read.insert((*uit)->name);
+			}
+		}
+		for (uit=regs.mod.begin(); uit!=regs.mod.end(); ++uit) {
+			if (named_reg(*uit)) {
+				read.insert((*uit)->name);
+			}
+		}
+
+		ref_stmt *ref(dynamic_cast< ref_stmt * >(*it));
+		lcontext_stmt *lcontext(dynamic_cast< lcontext_stmt * >(*it));
+		fork_stmt *fork(dynamic_cast< fork_stmt * >(*it));
+		if (ref) {
+			if (named_reg(ref->src)) {
+				untracked.insert(ref->src->name);
+			}
+			if (named_reg(ref->dst)) {
+				untracked.insert(ref->dst->name);
+			}
+		} else if (lcontext) {
+			if (named_reg(lcontext->dst)) {
+				untracked.insert(lcontext->dst->name);
+			}
+		} else if (fork && fork->has_code()) {
+			scan_registers(*fork->code, read, untracked);
+		}
+	}
+}
+
+/** Collect the labels that are jumped to from anywhere in the function */
+static void scan_labels(const Stmt::List &stmts, RegSet &labels)
+{
+	Stmt::List::const_iterator it(stmts.begin());
+	for (; it!=stmts.end(); ++it) {
+		goto_stmt *gs;
+		if_stmt *ifs;
+		iffail_stmt *iffail;
+		match_stmt *match;
+		matchargs_stmt *matchargs;
+		fork_stmt *fork;
+		if ((gs = dynamic_cast< goto_stmt * >(*it))) {
+			labels.insert(gs->label.name);
+		} else if ((ifs = dynamic_cast< if_stmt * >(*it))) {
+			labels.insert(ifs->label.name);
+		} else if ((iffail = dynamic_cast< iffail_stmt * >(*it))) {
+			labels.insert(iffail->label.name);
+		} else if ((match = dynamic_cast< match_stmt * >(*it))) {
+			labels.insert(match->nonmatch.name);
+		} else if ((matchargs = dynamic_cast< matchargs_stmt * >(*it))) {
+			labels.insert(matchargs->nonmatch.name);
+		} else if ((fork = dynamic_cast< fork_stmt * >(*it))) {
+			if (fork->has_code()) {
+				scan_labels(*fork->code, labels);
+			}
+		}
+	}
+}
+
+/** Collect the registers a statement writes to */
+static void written_regs(Stmt *s, RegSet &written)
+{
+	StmtRegs regs;
+	inspect_registers(s, regs);
+	if (regs.dst) {
+		written.insert(regs.dst->name);
+	}
+	list< AsmReg * >::const_iterator it(regs.mod.begin());
+	for (; it!=regs.mod.end(); ++it) {
+		if (named_reg(*it)) {
+			written.insert((*it)->name);
+		}
+	}
+	fork_stmt *fork(dynamic_cast< fork_stmt * >(s));
+	if (fork && fork->has_code()) {
+		Stmt::List::const_iterator fit(fork->code->begin());
+		for (; fit!=fork->code->end(); ++fit) {
+			written_regs(*fit, written);
+		}
+	}
+}
+
+/** Get the label a jump statement goes to, NULL if it's not a jump */
+static AsmLabel * jump_label(Stmt *s)
+{
+	goto_stmt *gs;
+	if_stmt *ifs;
+	iffail_stmt *iffail;
+	match_stmt *match;
+	matchargs_stmt *matchargs;
+	if ((gs = dynamic_cast< goto_stmt * >(s))) {
+		return &gs->label;
+	} else if ((ifs = dynamic_cast< if_stmt * >(s))) {
+		return &ifs->label;
+	} else if ((iffail = dynamic_cast< iffail_stmt * >(s))) {
+		return &iffail->label;
+	} else if ((match = dynamic_cast< match_stmt * >(s))) {
+		return &match->nonmatch;
+	} else if ((matchargs = dynamic_cast< matchargs_stmt * >(s))) {
+		return &matchargs->nonmatch;
+	}
+	return NULL;
+}
+
+
+/** Get the value of a constant register */
+static bool const_value(reg_t reg, KnownValue &kv)
+{
+	if (reg == CONST_REG_TRUE) {
+		kv = KnownValue('b', true);
+		return true;
+	} else if (reg == CONST_REG_FALSE) {
+		kv = KnownValue('b', false);
+		return true;
+	}
+	return false;
+}
+
+
+struct FoldState
+{
+	typedef map< string, Stmt::List::iterator > PendingMap;
+	typedef map< string, AsmReg * > CopyMap;
+
+	const RegSet &untracked;
+	KnownMap known;
+	// registers that hold a copy of another register
+	CopyMap copy;
+	// registers w/ values that can be read w/o failing or waiting
+	RegSet safe;
+	// removable stores that haven't been read yet
+	PendingMap pending;
+
+	FoldState(const RegSet &untracked)
+	: untracked(untracked)
+	{}
+
+	bool tracked(const AsmReg *r) const
+	{
+		return whole_reg(r) && untracked.find(r->name) == untracked.end();
+	}
+	bool safe_reg(const AsmReg *r) const
+	{
+		if (!r || r->reg_type == 'c') {
+			return true;
+		}
+		return tracked(r) && safe.find(r->name) != safe.end();
+	}
+	bool known_value(const AsmReg *r, KnownValue &kv) const
+	{
+		if (r && r->reg_type == 'c') {
+			return const_value(r->specialid, kv);
+		} else if (!tracked(r)) {
+			return false;
+		}
+		KnownMap::const_iterator it(known.find(r->name));
+		if (it == known.end()) {
+			return false;
+		}
+		kv = it->second;
+		return true;
+	}
+	void clear()
+	{
+		known.clear();
+		copy.clear();
+		safe.clear();
+		pending.clear();
+	}
+	/** Forget what's known about a register that's changed */
+	void forget(const string &name)
+	{
+		known.erase(name);
+		copy.erase(name);
+		CopyMap::iterator it(copy.begin());
+		while (it != copy.end()) {
+			if (it->second->name == name) {
+				copy.erase(it++);
+			} else {
+				++it;
+			}
+		}
+	}
+};
+
+/**
+ * Make a statement that sets a register to a known value. bools are
+ * copied from the constant registers same as lconstruct does.
+ */
+static Stmt * known_stmt(AsmReg *dst, const KnownValue &kv)
+{
+	if (kv.type == 'b') {
+		return new copy_stmt(dst, AsmReg::create_const(
+					kv.value ? CONST_REG_TRUE : CONST_REG_FALSE));
+	}
+	return new consti_stmt(dst, kv.value);
+}
+
+/**
+ * Replace a statement w/ a simpler one if its operands are known.
+ * Return the new statement or NULL to remove it, or the same one
+ * if it can't be folded.
+ */
+static Stmt * fold_stmt(Stmt *s, const FoldState &state)
+{
+	binaryop_stmt *binop;
+	cmp_stmt *cmp;
+	copy_stmt *copy;
+	if_stmt *ifs;
+	KnownValue a;
+	KnownValue b;
+
+	if ((binop = dynamic_cast< binaryop_stmt * >(s))) {
+		if (!state.known_value(binop->a, a)
+				|| !state.known_value(binop->b, b)
+				|| a.type != 'i' || b.type != 'i') {
+			return s;
+		}
+		int64_t result;
+		switch (binop->op) {
+			case '+':
+				result = (int64_t) a.value + b.value;
+				break;
+			case '-':
+				result = (int64_t) a.value - b.value;
+				break;
+			case '*':
+				result = (int64_t) a.value * b.value;
+				break;
+			default:
+				// leave division to fail at runtime
+				return s;
+		}
+		if (result < INT32_MIN || result > INT32_MAX) {
+			return s;
+		}
+		return known_stmt(binop->result, KnownValue('i', result));
+	} else if ((cmp = dynamic_cast< cmp_stmt * >(s))) {
+		if (!state.known_value(cmp->a, a)
+				|| !state.known_value(cmp->b, b)
+				|| a.type != b.type) {
+			return s;
+		}
+		int comparison(a.value < b.value ? -1
+				: (a.value > b.value ? 1 : 0));
+		bool result;
+		switch (cmp->opcode) {
+			case OP_CMP_EQ:
+				result = comparison == 0;
+				break;
+			case OP_CMP_NOTEQ:
+				result = comparison != 0;
+				break;
+			case OP_CMP_GT:
+				result = comparison > 0;
+				break;
+			case OP_CMP_GTEQ:
+				result = comparison >= 0;
+				break;
+			case OP_CMP_LT:
+				result = comparison < 0;
+				break;
+			default:
+				// qbrt evaluates cmp<= as >= for now,
+				// so leave it to qbrt
+				return s;
+		}
+		return known_stmt(cmp->result, KnownValue('b', result));
+	} else if ((copy = dynamic_cast< copy_stmt * >(s))) {
+		if (copy->src->reg_type == 'c'
+				|| !state.known_value(copy->src, a)) {
+			return s;
+		}
+		return known_stmt(copy->dst, a);
+	} else if ((ifs = dynamic_cast< if_stmt * >(s))) {
+		if (!state.known_value(ifs->reg, a) || a.type != 'b') {
+			return s;
+		}
+		// if continues when the value matches the check
+		if ((bool) a.value == ifs->check) {
+			return NULL;
+		}
+		return new goto_stmt(ifs->label.name);
+	}
+	return s;
+}
+
+/**
+ * Fold constants, propagate copies and remove dead stores
+ * in one pass over a statement list
+ *
+ * result is the fork target when this is the code for a fork
+ */
+static bool fold_block(Stmt::List &stmts, const RegSet &read
+		, const RegSet &untracked, const AsmReg *result)
+{
+	bool changed(false);
+	FoldState state(untracked);
+	FoldState::PendingMap::iterator pit;
+
+	Stmt::List::iterator it(stmts.begin());
+	while (it != stmts.end()) {
+		Stmt *s(*it);
+		fork_stmt *fork(dynamic_cast< fork_stmt * >(s));
+		if (dynamic_cast< label_stmt * >(s)
+				|| dynamic_cast< goto_stmt * >(s)) {
+			state.clear();
+			++it;
+			continue;
+		} else if (dynamic_cast< return_stmt * >(s)) {
+			// registers are gone after a return, except
+			// a fork's target goes back to the parent
+			if (named_reg(result)) {
+				state.pending.erase(result->name);
+			}
+			for (pit=state.pending.begin(); pit!=state.pending.end()
+					; ++pit) {
+				stmts.erase(pit->second);
+			}
+			changed = changed || !state.pending.empty();
+			state.clear();
+			++it;
+			continue;
+		} else if (fork) {
+			// the fork gets its own copy of the registers
+			if (fork->has_code()) {
+				changed = fold_block(*fork->code, read, untracked
+						, fork->dst) || changed;
+			}
+			state.clear();
+			++it;
+			continue;
+		}
+
+		// replace operands w/ the registers they're copies of
+		StmtRegs regs;
+		inspect_registers(s, regs);
+		list< AsmReg ** >::iterator sit(regs.src.begin());
+		for (; sit!=regs.src.end(); ++sit) {
+			if (!state.tracked(**sit)) {
+				continue;
+			}
+			FoldState::CopyMap::const_iterator
+				cit(state.copy.find((**sit)->name));
+			if (cit != state.copy.end()) {
+				**sit = new AsmReg(*cit->second);
+				changed = true;
+			}
+		}
+
+		Stmt *folded(fold_stmt(s, state));
+		if (!folded) {
+			it = stmts.erase(it);
+			changed = true;
+			continue;
+		} else if (folded != s) {
+			s = *it = folded;
+			changed = true;
+			regs = StmtRegs();
+			inspect_registers(s, regs);
+			if (dynamic_cast< goto_stmt * >(s)) {
+				state.clear();
+				++it;
+				continue;
+			}
+		}
+
+		// it's ok to remove the store if reading its operands
+		// couldn't have failed the frame
+		bool removable(regs.pure && regs.dst
+				&& regs.dst->reg_type == '$'
+				&& state.tracked(regs.dst));
+		for (sit=regs.src.begin(); sit!=regs.src.end(); ++sit) {
+			removable = removable && state.safe_reg(**sit);
+			if (named_reg(**sit)) {
+				state.pending.erase((**sit)->name);
+			}
+		}
+		list< AsmReg * >::const_iterator uit(regs.use.begin());
+		for (; uit!=regs.use.end(); ++uit) {
+			removable = removable && state.safe_reg(*uit);
+			if (named_reg(*uit)) {
+				state.pending.erase((*uit)->name);
+			}
+		}
+		for (uit=regs.mod.begin(); uit!=regs.mod.end(); ++uit) {
+			if (named_reg(*uit)) {
+				state.pending.erase((*uit)->name);
+				state.forget((*uit)->name);
+			}
+		}
+		if (regs.checked) {
+			for (sit=regs.src.begin(); sit!=regs.src.end(); ++sit) {
+				if (state.tracked(**sit)) {
+					state.safe.insert((**sit)->name);
+				}
+			}
+		}
+
+		if (regs.branch) {
+			// the stores might be read wherever it jumps to
+			state.pending.clear();
+		}
+		if (!regs.dst) {
+			++it;
+			continue;
+		}
+
+		const string &dst(regs.dst->name);
+		if (removable && read.find(dst) == read.end()) {
+			it = stmts.erase(it);
+			changed = true;
+			continue;
+		}
+		pit = state.pending.find(dst);
+		if (pit != state.pending.end()) {
+			// overwritten before it was read
+			stmts.erase(pit->second);
+			state.pending.erase(pit);
+			changed = true;
+		}
+
+		state.forget(dst);
+		state.safe.erase(dst);
+		if (!state.tracked(regs.dst)) {
+			++it;
+			continue;
+		}
+
+		consti_stmt *consti(dynamic_cast< consti_stmt * >(s));
+		lconstruct_stmt *lconstruct(dynamic_cast< lconstruct_stmt * >(s));
+		copy_stmt *copy(dynamic_cast< copy_stmt * >(s));
+		KnownValue kv;
+		bool b;
+		if (consti) {
+			state.known[dst] = KnownValue('i', consti->value);
+		} else if (lconstruct && bool_modsym(*lconstruct->modsym, b)) {
+			state.known[dst] = KnownValue('b', b);
+		} else if (copy && state.known_value(copy->src, kv)) {
+			state.known[dst] = kv;
+		} else if (copy && state.tracked(copy->src)
+				&& copy->src->name != dst) {
+			state.copy[dst] = copy->src;
+		}
+		// binaryop stores a failure on a bad operand
+		if (regs.pure && !dynamic_cast< binaryop_stmt * >(s)
+				&& (!copy || state.safe_reg(copy->src))) {
+			state.safe.insert(dst);
+		}
+		if (removable) {
+			state.pending[dst] = it;
+		}
+		++it;
+	}
+	return changed;
+}
+
+/**
+ * Find the statement that runs first after a label,
+ * skipping other labels
+ */
+static Stmt::List::iterator label_target(Stmt::List &stmts
+		, Stmt::List::iterator it)
+{
+	while (it != stmts.end() && dynamic_cast< label_stmt * >(*it)) {
+		++it;
+	}
+	return it;
+}
+
+/**
+ * Thread jumps through other gotos, remove jumps to the next
+ * statement and remove code that can't be reached
+ */
+static bool jump_block(Stmt::List &stmts, const RegSet &read)
+{
+	bool changed(false);
+	map< string, Stmt::List::iterator > label;
+	Stmt::List::iterator it;
+	for (it=stmts.begin(); it!=stmts.end(); ++it) {
+		label_stmt *ls(dynamic_cast< label_stmt * >(*it));
+		fork_stmt *fork(dynamic_cast< fork_stmt * >(*it));
+		if (ls) {
+			label[ls->label.name] = it;
+		} else if (fork && fork->has_code()) {
+			changed = jump_block(*fork->code, read) || changed;
+		}
+	}
+
+	it = stmts.begin();
+	while (it != stmts.end()) {
+		AsmLabel *lbl(jump_label(*it));
+		if (!lbl) {
+			++it;
+			continue;
+		}
+
+		// follow gotos, but not around in a loop
+		RegSet visited;
+		Stmt::List::iterator target;
+		for (;;) {
+			map< string, Stmt::List::iterator >::const_iterator
+				lit(label.find(lbl->name));
+			if (lit == label.end()) {
+				target = stmts.end();
+				break;
+			}
+			visited.insert(lbl->name);
+			target = label_target(stmts, lit->second);
+			goto_stmt *next(target == stmts.end() ? NULL
+					: dynamic_cast< goto_stmt * >(*target));
+			if (!next || visited.count(next->label.name)) {
+				break;
+			}
+			lbl->name = next->label.name;
+			changed = true;
+		}
+
+		if (dynamic_cast< goto_stmt * >(*it)) {
+			Stmt::List::iterator next(it);
+			if (target != stmts.end()
+					&& label_target(stmts, ++next) == target) {
+				// goto the next statement
+				it = stmts.erase(it);
+				changed = true;
+				continue;
+			}
+			if (target != stmts.end()
+					&& dynamic_cast< return_stmt * >(*target)) {
+				*it = new return_stmt();
+				changed = true;
+			}
+		}
+		++it;
+	}
+
+	// remove labels that nothing jumps to
+	RegSet used_labels;
+	scan_labels(stmts, used_labels);
+	it = stmts.begin();
+	while (it != stmts.end()) {
+		label_stmt *ls(dynamic_cast< label_stmt * >(*it));
+		if (ls && !used_labels.count(ls->label.name)) {
+			it = stmts.erase(it);
+			changed = true;
+		} else {
+			++it;
+		}
+	}
+
+	// remove code between a goto or return and the next label
+	RegSet allocated;
+	bool reachable(true);
+	it = stmts.begin();
+	while (it != stmts.end()) {
+		RegSet written;
+		written_regs(*it, written);
+		if (dynamic_cast< label_stmt * >(*it)) {
+			reachable = true;
+		} else if (!reachable) {
+			// keep the first write to a register that's read
+			// later so it's still allocated before the read
+			bool first_write(false);
+			RegSet::const_iterator wit(written.begin());
+			for (; wit!=written.end(); ++wit) {
+				first_write = first_write || (read.count(*wit)
+						&& !allocated.count(*wit));
+			}
+			if (!first_write) {
+				it = stmts.erase(it);
+				changed = true;
+				continue;
+			}
+		} else if (dynamic_cast< goto_stmt * >(*it)
+				|| dynamic_cast< return_stmt * >(*it)) {
+			reachable = false;
+		}
+		allocated.insert(written.begin(), written.end());
+		++it;
+	}
+	return changed;
+}
+
+static void optimize_function(dfunc_stmt &func)
+{
+	if (!func.has_code()) {
+		return;
+	}
+	for (int i(0); i<OPTIMIZE_MAX_ROUNDS; ++i) {
+		RegSet read;
+		RegSet untracked;
+		scan_registers(*func.code, read, untracked);
+		bool changed(fold_block(*func.code, read, untracked, NULL));
+		changed = jump_block(*func.code, read) || changed;
+		if (!changed) {
+			break;
+		}
+	}
+}
+
+void optimize(Stmt::List &stmts)
+{
+	Stmt::List::iterator it(stmts.begin());
+	for (; it!=stmts.end(); ++it) {
+		dfunc_stmt *func;
+		protocol_stmt *proto;
+		bind_stmt *bind;
+		if ((func = dynamic_cast< dfunc_stmt * >(*it))) {
+			optimize_function(*func);
+		} else if ((proto = dynamic_cast< protocol_stmt * >(*it))) {
+			if (proto->functions) {
+				optimize(*proto->functions);
+			}
+		} else if ((bind = dynamic_cast< bind_stmt * >(*it))) {
+			if (bind->functions) {
+				optimize(*bind->functions);
+			}
+		}
+	}
+}
@@ -2,6 +2,7 @@
 #include <list>
 #include <map>
 #include <set>
+#include <stdio.h>
 #include <stdlib.h>
 #include <vector>
 #include <errno.h>
@@ -25,6 +26,7 @@ using namespace std;
 Stmt::List *parsed_stmts;
 uint16_t AsmResource::NULL_INDEX = 0;
 string g_parse_module;
+static bool g_optimize(false);
 
 typedef std::list< ResourceInfo > ResourceIndex;
 
@@ -70,13 +72,13 @@ uint32_t label_index(const label_map &lmap, const std::string &lbl)
 
 void write16(ostream &out, uint16_t value)
 {
-	value = htobe16(value);
+	value = htoqb16(value);
 	out.write((const char *) &value, 2);
 }
 
 void write32(ostream &out, uint32_t value)
 {
-	value = htobe32(value);
+	value = htoqb32(value);
 	out.write((const char *) &value, 4);
 }
 
@@ -388,7 +390,8 @@ void RegAlloc::alloc_dst(AsmReg &reg, const string &type)
 		reg.idx = it->second;
 		return;
 	}
-	reg.idx = counter++;
+	it = slot.find(reg.name);
+	reg.idx = it != slot.end() ? it->second : counter++;
 	registry[reg.name] = reg.idx;
 }
 
@@ -677,19 +680,19 @@ void init_constant_registers()
  */
 void write_header(ostream &out, const ObjectHeader &h)
 {
-	ObjectHeader be;
-	be.magic[0] = h.magic[0];
-	be.magic[1] = h.magic[1];
-	be.magic[2] = h.magic[2];
-	be.magic[3] = h.magic[3];
-	be.qbrt_version = htobe32(h.qbrt_version);
-	be.flags = htobe64(h.flags);
-	be.name = htobe16(h.name);
-	be.version = htobe16(h.version);
-	be.iteration = htobe16(h.iteration);
-	be.imports = htobe16(h.imports);
-	be.source_filename = htobe16(h.source_filename);
-	out.write((const char *) &be, ObjectHeader::SIZE);
+	ObjectHeader qb;
+	qb.magic[0] = h.magic[0];
+	qb.magic[1] = h.magic[1];
+	qb.magic[2] = h.magic[2];
+	qb.magic[3] = h.magic[3];
+	qb.qbrt_version = htoqb32(h.qbrt_version);
+	qb.flags = htoqb64(h.flags);
+	qb.name = htoqb16(h.name);
+	qb.version = htoqb16(h.version);
+	qb.iteration = htoqb16(h.iteration);
+	qb.imports = htoqb16(h.imports);
+	qb.source_filename = htoqb16(h.source_filename);
+	out.write((const char *) &qb, ObjectHeader::SIZE);
 }
 
 /**
@@ -944,7 +947,7 @@ void write_resource_index(ostream &out, const ResourceIndex &index)
 
 	ResourceIndex::const_iterator it(index.begin());
 	for (; it!=index.end(); ++it) {
-		ResourceInfo r(htobe32(it->_offset), htobe16(it->_type));
+		ResourceInfo r(htoqb32(it->_offset), htoqb16(it->_type));
 		out.write((const char *) &r, ResourceInfo::SIZE);
 	}
 }
@@ -1336,7 +1339,7 @@ bool compile_module(ModuleMap &modmap, const string &module_name)
 	}
 
 	ObjectBuilder obj(module_name);
-	obj.header.qbrt_version = 13;
+	obj.header.qbrt_version = QBRT_VERSION;
 	obj.header.set_application(1);
 
 	cout << "---\n";
@@ -1344,6 +1347,9 @@ bool compile_module(ModuleMap &modmap, const string &module_name)
 	Stmt::List *stmts = parse(fin);
 	g_parse_module.clear();
 	set_function_context(*stmts, FCT_TRADITIONAL, NULL);
+	if (g_optimize) {
+		optimize(*stmts);
+	}
 
 	obj.rs.set_module_version(22, "bbd");
 	collect_resources(obj.rs, *stmts);
@@ -1361,27 +1367,209 @@ bool compile_module(ModuleMap &modmap, const string &module_name)
 
 	generate_code(obj.rs);
 
+	// write a new file and move it into place rather than overwrite
+	// the old one that qbrt might still have mapped
+	string tmp_name(output_name +".tmp");
 	ofstream out;
-	out.open(output_name.c_str(), ios::binary | ios::out);
+	out.open(tmp_name.c_str(), ios::binary | ios::out);
 	if (!out) {
-		cerr << "error opening outputfile: " << output_name << endl;
+		cerr << "error opening outputfile: " << tmp_name << endl;
 		return false;
 	}
 	write_object(out, obj);
 	out.close();
+	if (rename(tmp_name.c_str(), output_name.c_str()) < 0) {
+		cerr << "error writing outputfile: " << output_name << ": "
+			<< strerror(errno) << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Find the function resource a ModSym refers to, the same one
+ * Module::fetch_function would find. Returns 0 if there isn't one.
+ */
+uint16_t link_function(const Module &mod, const char *fname)
+{
+	const ResourceTable &tbl(mod.resource);
+	for (uint16_t i(1); i<tbl.resource_count; ++i) {
+		if (tbl.type(i) != RESOURCE_FUNCTION) {
+			continue;
+		}
+		const FunctionHeader *f = tbl.ptr< FunctionHeader >(i);
+		if (strcmp(fname, fetch_string(tbl, f->name_idx())) == 0) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Add a module and everything it imports to the image list
+ */
+void collect_image_module(vector< Module * > &modules
+		, map< string, uint16_t > &module_index, const string &name)
+{
+	// qbrt has its own io module in C
+	if (name == "io" || module_index.find(name) != module_index.end()) {
+		return;
+	}
+	Module *mod = read_module(name);
+	if (!mod) {
+		cerr << "could not load module for image: " << name & DIE;
+	}
+	module_index[name] = modules.size();
+	modules.push_back(mod);
+	vector< string > imports;
+	module_imports(*mod, imports);
+	vector< string >::const_iterator it(imports.begin());
+	for (; it!=imports.end(); ++it) {
+		collect_image_module(modules, module_index, *it);
+	}
+}
+
+void write_image_link(ostream &out, uint16_t module, uint16_t function)
+{
+	uint16_t link[2];
+	link[0] = htoqb16(module);
+	link[1] = htoqb16(function);
+	out.write((const char *) link, ImageLink::SIZE);
+}
+
+void write_image_links(ostream &out, const Module &mod
+		, const vector< Module * > &modules
+		, const map< string, uint16_t > &module_index)
+{
+	const ResourceTable &tbl(mod.resource);
+	for (uint16_t i(0); i<tbl.resource_count; ++i) {
+		if (i == 0 || tbl.type(i) != RESOURCE_MODSYM) {
+			write_image_link(out, IMAGE_NO_LINK, 0);
+			continue;
+		}
+		const ModSym &modsym(fetch_modsym(tbl, i));
+		string modname(fetch_string(tbl, modsym.mod_name()));
+		if (modname == "./") {
+			modname = mod.name;
+		}
+		map< string, uint16_t >::const_iterator it;
+		it = module_index.find(modname);
+		uint16_t fidx(0);
+		if (it != module_index.end()) {
+			fidx = link_function(*modules[it->second]
+					, fetch_string(tbl, modsym.sym_name()));
+		}
+		// C functions and anything missing are still looked up
+		// by name when they're loaded
+		if (fidx) {
+			write_image_link(out, it->second, fidx);
+		} else {
+			write_image_link(out, IMAGE_NO_LINK, 0);
+		}
+	}
+}
+
+uint32_t image_align(uint32_t offset)
+{
+	return (offset + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+}
+
+/**
+ * Bundle a compiled module and all the modules it uses into one file
+ * for qbrt, w/ the lfunc calls between them already linked
+ */
+bool write_image(const string &module_name)
+{
+	vector< Module * > modules;
+	map< string, uint16_t > module_index;
+	collect_image_module(modules, module_index, module_name);
+	// qbrt always loads these
+	collect_image_module(modules, module_index, "core");
+	collect_image_module(modules, module_index, "list");
+
+	uint16_t count(modules.size());
+	uint32_t links(ImageHeader::SIZE + count * ImageModule::SIZE);
+	uint32_t offset(links);
+	vector< Module * >::const_iterator it;
+	for (it=modules.begin(); it!=modules.end(); ++it) {
+		offset += (*it)->resource.resource_count * ImageLink::SIZE;
+	}
+
+	string output_name(module_name + IMAGE_EXT);
+	string tmp_name(output_name +".tmp");
+	cout << "image " << output_name << ": " << count << " modules\n";
+	ofstream out;
+	out.open(tmp_name.c_str(), ios::binary | ios::out);
+	if (!out) {
+		cerr << "error opening outputfile: " << tmp_name << endl;
+		return false;
+	}
+
+	ImageHeader hdr;
+	memcpy(hdr.magic, IMAGE_MAGIC, 4);
+	hdr._qbrt_version = htoqb32(QBRT_VERSION);
+	hdr._module_count = htoqb16(count);
+	hdr._main_module = htoqb16(0);
+	out.write((const char *) &hdr, ImageHeader::SIZE);
+
+	for (it=modules.begin(); it!=modules.end(); ++it) {
+		offset = image_align(offset);
+		ImageModule entry;
+		entry._offset = htoqb32(offset);
+		entry._size = htoqb32((*it)->mapping_size);
+		entry._links = htoqb32(links);
+		out.write((const char *) &entry, ImageModule::SIZE);
+		offset += (*it)->mapping_size;
+		links += (*it)->resource.resource_count * ImageLink::SIZE;
+	}
+	for (it=modules.begin(); it!=modules.end(); ++it) {
+		write_image_links(out, **it, modules, module_index);
+	}
+	for (it=modules.begin(); it!=modules.end(); ++it) {
+		uint32_t pos(out.tellp());
+		static const char padding[IMAGE_ALIGN] = { 0 };
+		out.write(padding, image_align(pos) - pos);
+		out.write((const char *) (*it)->mapping, (*it)->mapping_size);
+	}
+	out.close();
+	for (it=modules.begin(); it!=modules.end(); ++it) {
+		delete *it;
+	}
+	if (!out || rename(tmp_name.c_str(), output_name.c_str()) < 0) {
+		cerr << "error writing outputfile: " << output_name << ": "
+			<< strerror(errno) << endl;
+		return false;
+	}
 	return true;
 }
 
 int main(int argc, const char **argv)
 {
-	if (argc != 2) {
-		cerr << "usage: " << argv[0] << " <module>\n";
+	bool image(false);
+	int i(1);
+	for (; i<argc - 1; ++i) {
+		if (strcmp(argv[i], "-O") == 0) {
+			g_optimize = true;
+		} else if (strcmp(argv[i], "--image") == 0) {
+			image = true;
+		} else {
+			break;
+		}
+	}
+	if (i != argc - 1) {
+		cerr << "usage: " << argv[0] << " [-O] [--image] <module>\n";
 		return 1;
 	}
+	const char *module_name(argv[argc - 1]);
 
 	init_compiler();
 	ModuleMap modules;
-	compile_module(modules, argv[1]);
+	if (!compile_module(modules, module_name)) {
+		return 1;
+	}
+	if (image && !write_image(module_name)) {
+		return 1;
+	}
 
 	return 0;
 }
@@ -17,6 +17,8 @@ struct RegAlloc
 	typedef std::map< std::string, uint8_t > CountMap;
 
 	CountMap registry;
+	// registers already given a shared slot by liveness
+	CountMap slot;
 	const uint8_t argc;
 	uint8_t counter;
 
@@ -106,12 +108,16 @@ struct AsmReg
 	static AsmReg * arg(const std::string &name);
 	void parse_subindex(const std::string &idx);
 
-	static inline AsmReg * create_void()
+	static inline AsmReg * create_const(reg_t id)
 	{
 		AsmReg *r = new AsmReg('c');
-		r->specialid = CONST_REG_VOID;
+		r->specialid = id;
 		return r;
 	}
+	static inline AsmReg * create_void()
+	{
+		return create_const(CONST_REG_VOID);
+	}
 	static AsmReg * create_special(uint16_t id);
 	static inline AsmReg * create_result()
 	{
@@ -336,6 +342,40 @@ struct DeclList
 
 void set_function_context(Stmt::List &, uint8_t asmfc, AsmResource *);
 void allocate_registers(Stmt::List &, RegAlloc *);
+/** Optimize the code in each function, for qbc -O */
+void optimize(Stmt::List &);
+
+/** What a statement does w/ registers, for the optimizer and liveness */
+struct StmtRegs
+{
+	// operands that can be replaced w/ a register holding the same value
+	std::list< AsmReg ** > src;
+	// other registers that are read
+	std::list< AsmReg * > use;
+	// registers whose values are modified in place
+	std::list< AsmReg * > mod;
+	// the whole register that's written, NULL if none
+	AsmReg *dst;
+	// can be removed if dst is never read after
+	bool pure;
+	// reads go through READ_REG, so the frame fails on a bad value
+	bool checked;
+	// may jump to a label rather than continue
+	bool branch;
+
+	StmtRegs()
+	: dst(NULL)
+	, pure(false)
+	, checked(false)
+	, branch(false)
+	{}
+};
+void inspect_registers(Stmt *, StmtRegs &);
+/**
+ * Give the function's local registers slots in the RegAlloc,
+ * sharing slots b/n registers that aren't live at the same time
+ */
+void assign_slots(Stmt::List &, RegAlloc &);
 
 void label_next(AsmFunc &, const std::string &lbl);
 void asm_jump(AsmFunc &, const std::string &lbl, jump_instruction *);
@@ -76,6 +76,14 @@ void print_call_instruction(const call_instruction &i)
 	cout << endl;
 }
 
+void print_call_lazy_instruction(const call_lazy_instruction &i)
+{
+	cout << "calllazy";
+	print_register(i.result_reg);
+	print_register(i.func_reg);
+	cout << endl;
+}
+
 void print_call1_instruction(const call1_instruction &i)
 {
 	cout << "call1";
@@ -146,7 +154,8 @@ void print_patternvar_instruction(const patternvar_instruction &i)
 
 void print_recv_instruction(const recv_instruction &i)
 {
-	cout << "recv " << pretty_reg(i.dst) << endl;
+	cout << "recv " << pretty_reg(i.dst) << ' ' << pretty_reg(i.timeout)
+		<< endl;
 }
 
 void print_stracc_instruction(const stracc_instruction &i)
@@ -296,6 +305,8 @@ instruction_printer PRINTER[NUM_OP_CODES] = {0};
 void set_printers()
 {
 	PRINTER[OP_CALL] = (instruction_printer) print_call_instruction;
+	PRINTER[OP_CALL_LAZY] =
+		(instruction_printer) print_call_lazy_instruction;
 	PRINTER[OP_CALL1] = (instruction_printer) print_call1_instruction;
 	PRINTER[OP_CALL2] = (instruction_printer) print_call2_instruction;
 	PRINTER[OP_CFAILURE] = (instruction_printer) print_cfailure_instruction;
@@ -440,6 +451,9 @@ void print_function_code(const FunctionHeader &f, uint32_t size
 		}
 	}
 
+	int frame(f.argc + f.regc);
+	cout << "frame size:" << frame << " registers, "
+		<< (frame * sizeof(qbrt_value)) << " bytes\n";
 	cout << "code size:" << size << endl;
 	const uint8_t *code(f.code());
 	while (pc < size) {
@@ -533,7 +547,8 @@ void print_escaped_string(const ResourceTable &tbl, uint16_t index)
 	const StringResource &str(
 			tbl.obj< StringResource >(index));
 	ostringstream o;
-	for (int i(0); i<str.bytes; ++i) {
+	uint16_t bytes(qb16toh(str.bytes));
+	for (int i(0); i<bytes; ++i) {
 		switch (str.value[i]) {
 			case '\n':
 				o << "\\n";
@@ -549,7 +564,7 @@ void print_escaped_string(const ResourceTable &tbl, uint16_t index)
 				break;
 		}
 	}
-	printf("str(%u) \"%s\"\n", str.bytes, o.str().c_str());
+	printf("str(%u) \"%s\"\n", bytes, o.str().c_str());
 }
 
 void print_modsym(const ResourceTable &tbl, uint16_t index)
@@ -6,6 +6,7 @@
 #include "qbrt/map.h"
 #include "qbrt/vector.h"
 #include "qbrt/module.h"
+#include "qbrt/snapshot.h"
 #include "io.h"
 #include "instruction/arithmetic.h"
 #include "instruction/function.h"
@@ -24,6 +25,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <signal.h>
 
 using namespace std;
 
@@ -40,9 +42,7 @@ int inspect_indent(0);
 	if (fail) { \
 		fail->trace_down(ctx.module_name(), ctx.function_name(), \
 			ctx.pc(), __FILE__, __LINE__); \
-		FunctionCall &call(ctx.worker().current->function_call()); \
-		qbrt_value::fail(*call.result, fail); \
-		call.cfstate = CFS_FAILED; \
+		ctx.worker().current->fail(fail); \
 		return; \
 	}} while (0)
 
@@ -121,40 +121,78 @@ struct OpContext
 	{
 		Failure *f = new Failure(type, module_name(), function_name()
 				, pc(), file, line);
-		qbrt_value::fail(*dstvalue(SPECIAL_REG_RESULT), f);
-		worker().current->cfstate = CFS_FAILED;
+		worker().current->fail(f);
 		return f;
 	}
 	void fail_frame(Failure *f)
 	{
-		qbrt_value::fail(*dstvalue(SPECIAL_REG_RESULT), f);
-		worker().current->cfstate = CFS_FAILED;
+		worker().current->fail(f);
 	}
 };
 
+/**
+ * Replace a promise w/ its value if it's been fulfilled.
+ * Otherwise mark the current frame as waiting for it.
+ */
+static inline bool redeem_promise(qbrt_value *ref, OpContext &ctx)
+{
+	Promise *promise = ref->data.promise;
+	if (promise->redeem(*ref)) {
+		promise->release();
+		return true;
+	}
+	Worker &w(ctx.worker());
+	w.current->cfstate = CFS_PEERWAIT;
+	// a frame that's retrying is already on the list
+	if (!w.current->waiting_for_promise) {
+		promise->mark_to_notify(w.current->waiting_for_promise);
+	}
+	return false;
+}
+
+void qbrtcall(Worker &, qbrt_value &res, function_value *);
+
+/**
+ * Evaluate a lazy call and replace the thunk w/ its result so
+ * it's only evaluated once. Returns false if the frame has to wait
+ * for the call to finish first, in which case the current
+ * instruction runs again when the call returns.
+ */
+static inline bool force_thunk(qbrt_value *ref, OpContext &ctx)
+{
+	function_value *f = ref->data.f;
+	Worker &w(ctx.worker());
+	CodeFrame *caller(w.current);
+	qbrt_value::set_void(*ref);
+	qbrtcall(w, *ref, f);
+	return w.current == caller && caller->cfstate == CFS_READY;
+}
+
 /**
  * Given a value, follow it's references. Then check for failure.
  */
 static inline qbrt_value * readable_value(qbrt_value *val, OpContext &ctx
 		, const char *file, uint16_t lineno)
 {
+	if (!val) {
+		// already failed looking up the register
+		return NULL;
+	}
 	qbrt_value *ref(val);
 	while (ref->type->id == VT_REF) {
 		ref = ref->data.ref;
 	}
+	if (ref->type->id == VT_PROMISE && !redeem_promise(ref, ctx)) {
+		return NULL;
+	}
+	if (ref->type->id == VT_THUNK && !force_thunk(ref, ctx)) {
+		return NULL;
+	}
 	if (ref->type->id == VT_FAILURE) {
 		Failure *fail = ref->data.failure;
 		fail->trace_down(ctx.module_name(), ctx.function_name(),
 			ctx.pc(), file, lineno);
-		FunctionCall &call(ctx.worker().current->function_call());
-		qbrt_value::fail(*call.result, fail);
-		call.cfstate = CFS_FAILED;
-		return NULL;
-	} else if (ref->type->id == VT_PROMISE) {
-		Worker &w(ctx.worker());
-		w.current->cfstate = CFS_PEERWAIT;
-		ref->data.promise->mark_to_notify(
-				w.current->waiting_for_promise);
+		ctx.worker().current->fail(fail);
 		return NULL;
 	}
 	return ref;
@@ -163,6 +201,10 @@ static inline qbrt_value * readable_value(qbrt_value *val, OpContext &ctx
 static inline qbrt_value * writable_value(qbrt_value *val, OpContext &ctx
 		, const char *file, uint16_t lineno)
 {
+	if (!val) {
+		// already failed looking up the register
+		return NULL;
+	}
 	qbrt_value *ref(val);
 	while (ref->type->id == VT_REF) {
 		ref = ref->data.ref;
@@ -174,16 +216,19 @@ static inline qbrt_value * writable_value(qbrt_value *val, OpContext &ctx
 static inline qbrt_value * readable_failed_value(qbrt_value *val, OpContext &ctx
 		, const char *file, uint16_t lineno)
 {
+	if (!val) {
+		// already failed looking up the register
+		return NULL;
+	}
 	qbrt_value *ref(val);
 	while (ref->type->id == VT_REF) {
 		ref = ref->data.ref;
 	}
 	// don't check for failures b/c we want to hear about those in this case
-	if (ref->type->id == VT_PROMISE) {
-		Worker &w(ctx.worker());
-		w.current->cfstate = CFS_PEERWAIT;
-		ref->data.promise->mark_to_notify(
-				w.current->waiting_for_promise);
+	if (ref->type->id == VT_PROMISE && !redeem_promise(ref, ctx)) {
+		return NULL;
+	}
+	if (ref->type->id == VT_THUNK && !force_thunk(ref, ctx)) {
 		return NULL;
 	}
 	return ref;
@@ -323,10 +368,10 @@ public:
 	virtual const char * function_name() const { return func.name(); }
 	virtual int & pc() const { return frame.pc; }
 	virtual uint8_t argc() const { return func.header->argc; }
-	virtual uint8_t regc() const { return func.num_values(); }
+	virtual uint8_t regc() const { return frame.num_values(); }
 	virtual qbrt_value * value(uint8_t reg)
 	{
-		return &func.value(reg);
+		return &frame.value(reg);
 	}
 	virtual qbrt_value * result()
 	{
@@ -339,35 +384,27 @@ public:
 		if (REG_IS_PRIMARY(reg)) {
 			primary = REG_EXTRACT_PRIMARY(reg);
 			if (primary >= regc()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
-			return follow_ref(&func.value(primary));
+			return follow_ref(&frame.value(primary));
 		} else if (REG_IS_SECONDARY(reg)) {
 			primary = REG_EXTRACT_SECONDARY1(reg);
 			if (primary >= regc()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
-			if (qbrt_value::failed(func.value(primary))) {
-				qbrt_value::fail(*func.result
-					, func.value(primary).data.failure);
-				frame.cfstate = CFS_FAILED;
+			if (qbrt_value::failed(frame.value(primary))) {
+				frame.fail(frame.value(primary).data.failure);
 				return NULL;
 			}
 			secondary = REG_EXTRACT_SECONDARY2(reg);
-			qbrt_value_index *idx(func.value(primary).data.reg);
+			qbrt_value_index *idx(frame.value(primary).data.reg);
 			if (secondary >= idx->num_values()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
 			return follow_ref(&idx->value(secondary));
@@ -387,35 +424,27 @@ public:
 		if (REG_IS_PRIMARY(reg)) {
 			primary = REG_EXTRACT_PRIMARY(reg);
 			if (primary >= regc()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
-			return follow_ref(&func.value(primary));
+			return follow_ref(&frame.value(primary));
 		} else if (REG_IS_SECONDARY(reg)) {
 			primary = REG_EXTRACT_SECONDARY1(reg);
 			if (primary >= regc()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
-			if (qbrt_value::failed(func.value(primary))) {
-				qbrt_value::fail(*func.result
-					, func.value(primary).data.failure);
-				frame.cfstate = CFS_FAILED;
+			if (qbrt_value::failed(frame.value(primary))) {
+				frame.fail(frame.value(primary).data.failure);
 				return NULL;
 			}
 			secondary = REG_EXTRACT_SECONDARY2(reg);
-			qbrt_value_index *idx(func.value(primary).data.reg);
+			qbrt_value_index *idx(frame.value(primary).data.reg);
 			if (secondary >= idx->num_values()) {
-				qbrt_value::fail(*func.result
-					, FAIL_REGISTER404(module_name(),
-						function_name(), pc()));
-				frame.cfstate = CFS_FAILED;
+				frame.fail(FAIL_REGISTER404(module_name(),
+					function_name(), pc()));
 				return NULL;
 			}
 			return follow_ref(&idx->value(secondary));
@@ -434,16 +463,16 @@ public:
 	virtual qbrt_value & refvalue(uint16_t reg)
 	{
 		if (REG_IS_PRIMARY(reg)) {
-			return func.value(REG_EXTRACT_PRIMARY(reg));
+			return frame.value(REG_EXTRACT_PRIMARY(reg));
 		} else if (REG_IS_SECONDARY(reg)) {
 			uint16_t r1(REG_EXTRACT_SECONDARY1(reg));
 			uint16_t r2(REG_EXTRACT_SECONDARY2(reg));
-			if (!qbrt_value::is_value_index(func.value(r1))) {
+			if (!qbrt_value::is_value_index(frame.value(r1))) {
 				cerr << "cannot access secondary register: "
 					<< r1 << endl;
 				return *(qbrt_value *) NULL;
 			}
-			return func.value(r1).data.reg->value(r2);
+			return frame.value(r1).data.reg->value(r2);
 		}
 		cerr << "Unsupported ref register: " << reg << endl;
 		return *(qbrt_value *) NULL;
@@ -452,14 +481,14 @@ public:
 	{
 		if (REG_IS_PRIMARY(reg)) {
 			uint16_t r(REG_EXTRACT_PRIMARY(reg));
-			if (qbrt_value::failed(func.value(r))) {
-				return func.value(r).data.failure;
+			if (qbrt_value::failed(frame.value(r))) {
+				return frame.value(r).data.failure;
 			}
 		} else if (REG_IS_SECONDARY(reg)) {
 			uint16_t r1(REG_EXTRACT_SECONDARY1(reg));
 			uint16_t r2(REG_EXTRACT_SECONDARY2(reg));
-			if (qbrt_value::failed(func.value(r1))) {
-				return func.value(r1).data.failure;
+			if (qbrt_value::failed(frame.value(r1))) {
+				return frame.value(r1).data.failure;
 			}
 		}
 		return NULL;
@@ -477,7 +506,10 @@ public:
 
 	virtual void io(StreamIO *op)
 	{
-		frame.io_push(op);
+		// io that was done right away comes back NULL
+		if (op) {
+			frame.io_push(op);
+		}
 	}
 
 private:
@@ -602,7 +634,10 @@ public:
 
 	virtual void io(StreamIO *op)
 	{
-		frame.io_push(op);
+		// io that was done right away comes back NULL
+		if (op) {
+			frame.io_push(op);
+		}
 	}
 
 private:
@@ -725,13 +760,18 @@ void execute_fork(OpContext &ctx, const fork_instruction &i)
 {
 	Worker &w(ctx.worker());
 	CodeFrame &parent(*w.current);
-	CodeFrame *child(fork_frame(parent));
+	ParallelPath *child(fork_frame(parent, i.result));
 	child->pc = parent.pc + fork_instruction::SIZE;
-	w.fresh->push_back(child);
+	// one ref for the child, one for the fork target register
+	child->promise = new Promise(w.id);
+	child->promise->retain();
 
 	qbrt_value &fork_target(*ctx.dstvalue(i.result));
-	qbrt_value::promise(fork_target, new Promise(w.id));
+	qbrt_value::promise(fork_target, child->promise);
 	ctx.pc() += i.jump();
+	// the child may start on another worker right away
+	// so it has to be fully set up before this
+	schedule_fork(w, child);
 }
 
 void execute_goto(OpContext &ctx, const goto_instruction &i)
@@ -942,9 +982,6 @@ void execute_lcontext(OpContext &ctx, const lcontext_instruction &i)
 void execute_lconstruct(OpContext &ctx, const lconstruct_instruction &i)
 {
 	const ResourceTable &resource(ctx.resource());
-	const FullId cons(fetch_fullid(resource, i.modsym));
-	const Module *mod(find_module(ctx.worker(), cons.module));
-
 	Failure *fail;
 	qbrt_value *dst(ctx.dstvalue(i.reg));
 	if (!dst) {
@@ -955,6 +992,17 @@ void execute_lconstruct(OpContext &ctx, const lconstruct_instruction &i)
 		return;
 	}
 
+	const ModSymLink *link(resource.linked(i.modsym));
+	if (link && link->construct) {
+		Construct *cons = new Construct(*link->module, *link->construct);
+		qbrt_value::construct(*dst, link->type, cons);
+		ctx.pc() += lconstruct_instruction::SIZE;
+		return;
+	}
+
+	// a module that couldn't be linked, look it up by name
+	const FullId cons(fetch_fullid(resource, i.modsym));
+	const Module *mod(find_module(ctx.worker(), cons.module));
 	if (mod) {
 		Module::load_construct(*dst, *mod, cons.id);
 	} else {
@@ -971,10 +1019,6 @@ void execute_lconstruct(OpContext &ctx, const lconstruct_instruction &i)
 void execute_loadfunc(OpContext &ctx, const lfunc_instruction &i)
 {
 	const ResourceTable &resource(ctx.resource());
-	const ModSym &modsym(fetch_modsym(resource, i.modsym));
-	const char *modname = fetch_string(resource, modsym.mod_name());
-	const char *fname = fetch_string(resource, modsym.sym_name());
-	const Module *mod(find_module(ctx.worker(), modname));
 	Failure *fail;
 
 	qbrt_value *dst(ctx.dstvalue(i.reg));
@@ -986,6 +1030,22 @@ void execute_loadfunc(OpContext &ctx, const lfunc_instruction &i)
 		return;
 	}
 
+	const ModSymLink *link(resource.linked(i.modsym));
+	if (link && (link->qbrt || link->cfunc)) {
+		if (link->qbrt) {
+			qbrt_value::f(*dst, new function_value(link->qbrt));
+		} else {
+			qbrt_value::f(*dst, new function_value(link->cfunc));
+		}
+		ctx.pc() += lfunc_instruction::SIZE;
+		return;
+	}
+
+	// a module that couldn't be linked, look it up by name
+	const ModSym &modsym(fetch_modsym(resource, i.modsym));
+	const char *modname = fetch_string(resource, modsym.mod_name());
+	const char *fname = fetch_string(resource, modsym.sym_name());
+	const Module *mod(find_module(ctx.worker(), modname));
 	if (!mod) {
 		fail = FAIL_MODULE404(ctx.module_name(), ctx.function_name()
 				, ctx.pc());
@@ -1091,7 +1151,9 @@ void execute_newproc(OpContext &ctx, const newproc_instruction &i)
 	const QbrtFunction *qfunc;
 	qfunc = dynamic_cast< const QbrtFunction * >(fval->func);
 	FunctionCall *call = new FunctionCall(*qfunc, *fval);
-	ProcessRoot *proc = new_process(w.app, call);
+	// new processes start at the same priority as their creator
+	ProcessRoot *proc = new_process(w.app, call
+			, w.current->proc->priority);
 	qbrt_value::i(pid, proc->pid);
 }
 
@@ -1108,16 +1170,39 @@ void execute_patternvar(OpContext &ctx, const patternvar_instruction &i)
 	ctx.pc() += patternvar_instruction::SIZE;
 }
 
+/**
+ * Park the frame until there's a message. It runs this again when
+ * it's woken, by a message or its deadline.
+ */
 void execute_recv(OpContext &ctx, const recv_instruction &i)
 {
 	Worker &w(ctx.worker());
-	if (w.current->proc->recv.empty()) {
-		w.current->cfstate = CFS_PEERWAIT;
+	CodeFrame &cf(*w.current);
+	if (cf.proc->recv.empty()) {
+		const qbrt_value *timeout;
+		READ_REG(timeout, ctx, i.timeout);
+		if (timeout->type->id != VT_INT) {
+			cf.cfstate = CFS_RECVWAIT;
+			return;
+		}
+		if (!cf.deadline) {
+			cf.deadline = clock_usec() + timeout->data.i * 1000;
+		}
+		if (clock_usec() < cf.deadline) {
+			cf.cfstate = CFS_RECVWAIT;
+			return;
+		}
+		cf.deadline = 0;
+		qbrt_value::fail(*ctx.dstvalue(i.dst), NEW_FAILURE("timeout"
+				, ctx.module_name(), ctx.function_name()
+				, ctx.pc()));
+		ctx.pc() += recv_instruction::SIZE;
 		return;
 	}
 
+	cf.deadline = 0;
 	qbrt_value &dst(*ctx.dstvalue(i.dst));
-	qbrt_value *msg(w.current->proc->recv.pop());
+	qbrt_value *msg(cf.proc->recv.pop());
 	dst = *msg;
 	ctx.pc() += recv_instruction::SIZE;
 }
@@ -1183,24 +1268,82 @@ void execute_loadtype(OpContext &ctx, const loadtype_instruction &i)
 void execute_loadobj(OpContext &ctx, const loadobj_instruction &i)
 {
 	const char *modname = fetch_string(ctx.resource(), i.modname);
-	load_module(ctx.worker(), modname);
+	if (!load_module(ctx.worker(), modname)) {
+		Failure *f = FAIL_MODULE404(ctx.module_name()
+				, ctx.function_name(), ctx.pc());
+		f->debug << "Cannot load module: '" << modname << "'";
+		ctx.fail_frame(f);
+		return;
+	}
 	ctx.pc() += loadobj_instruction::SIZE;
 }
 
 void call(Worker &ctx, qbrt_value &res, qbrt_value &f);
 
+/**
+ * Evaluate the lazy args of a function that can't take thunks. C
+ * functions read their args directly and protocol functions are
+ * dispatched on the arg types. Regular qbrt functions get the thunks
+ * and evaluate them when they're read.
+ *
+ * Returns false if the frame has to wait for a lazy call, in which
+ * case the call runs again when it's done.
+ */
+static bool force_lazy_args(OpContext &ctx, qbrt_value &func_reg)
+{
+	qbrt_value *fval(follow_ref(&func_reg));
+	if (fval->type->id != VT_FUNCTION) {
+		return true;
+	}
+	function_value &f(*fval->data.f);
+	if (PFC_TYPE(f.fcontext()) == FCT_TRADITIONAL && !f.func->cfunc()) {
+		return true;
+	}
+	for (uint8_t a(0); a<f.argc; ++a) {
+		qbrt_value *arg(follow_ref(&f.value(a)));
+		if (arg->type->id == VT_THUNK && !force_thunk(arg, ctx)) {
+			return false;
+		}
+	}
+	return true;
+}
+
 void execute_call(OpContext &ctx, const call_instruction &i)
 {
 	qbrt_value *output;
 	WRITE_REG(output, ctx, i.result_reg);
 
 	qbrt_value &func_reg(*ctx.dstvalue(i.func_reg));
+	if (!force_lazy_args(ctx, func_reg)) {
+		return;
+	}
 
 	// increment pc so it's in the right place when we get back
 	ctx.pc() += call_instruction::SIZE;
 	call(ctx.worker(), *output, func_reg);
 }
 
+void execute_call_lazy(OpContext &ctx, const call_lazy_instruction &i)
+{
+	const qbrt_value *func;
+	qbrt_value *output;
+	READ_REG(func, ctx, i.func_reg);
+	WRITE_REG(output, ctx, i.result_reg);
+
+	if (func->type->id != VT_FUNCTION) {
+		Failure *fail = FAIL_TYPE(ctx.module_name()
+				, ctx.function_name(), ctx.pc());
+		fail->debug << "cannot make lazy call of type: "
+			<< (int) func->type->id;
+		ctx.fail_frame(fail);
+		return;
+	}
+	// copy it so later changes to the function's args don't leak
+	// into the lazy call
+	qbrt_value::thunk(*output, dup_function_value(*func->data.f));
+	ctx.pc() += call_lazy_instruction::SIZE;
+}
+
 void execute_return(OpContext &ctx, const return_instruction &i)
 {
 	Worker &w(ctx.worker());
@@ -1209,12 +1352,7 @@ void execute_return(OpContext &ctx, const return_instruction &i)
 
 void fail(OpContext &ctx, Failure *f)
 {
-	qbrt_value &result(*ctx.dstvalue(SPECIAL_REG_RESULT));
-	qbrt_value::fail(result, f);
-
-	Worker &w(ctx.worker());
-	w.current->cfstate = CFS_FAILED;
-	// where to set the failure?
+	ctx.fail_frame(f);
 }
 
 typedef void (*executioner)(OpContext &, const instruction &);
@@ -1225,6 +1363,7 @@ void init_executioners()
 	executioner *x = EXECUTIONER;
 
 	x[OP_CALL] = (executioner) execute_call;
+	x[OP_CALL_LAZY] = (executioner) execute_call_lazy;
 	x[OP_RETURN] = (executioner) execute_return;
 	x[OP_CFAILURE] = (executioner) execute_cfailure;
 	x[OP_CMP_EQ] = (executioner) execute_cmp;
@@ -1293,38 +1432,16 @@ void override_function(Worker &w, function_value &funcval)
 		return;
 	}
 
-	if (pfc_type == FCT_POLYMORPH) {
-		// no override. reset the func to the protocol function
-		// if it was previously overridden
-		const Function *def_func =
-			find_default_function(w, *funcval.func);
-		reassign_func(funcval, def_func);
-	}
-
 	ostringstream value_type_stream;
 	load_function_value_types(value_type_stream, funcval);
 	string value_types(value_type_stream.str());
 
-	const Function &func(*funcval.func);
-	const QbrtFunction *qfunc;
-	qfunc = dynamic_cast< const QbrtFunction * >(&func);
-	if (!qfunc) {
-		cerr << "not a qbrt_function_value\n";
-		return;
-	}
-
-	const char *proto_name = func.protocol_name();
-	const QbrtFunction *overridef(find_override(w, func.mod->name.c_str()
-				, proto_name, funcval.name(), value_types));
-	if (overridef) {
-		reassign_func(funcval, overridef);
-	} else {
-		const CFunction *cfunc = find_c_override(w
-				, func.mod->name.c_str()
-				, proto_name, funcval.name(), value_types);
-		if (cfunc) {
-			reassign_func(funcval, cfunc);
-		}
+	// an override that was picked for earlier values dispatches
+	// the same as its protocol function
+	const Function *f(dispatch_function(w.app, *funcval.func
+				, value_types));
+	if (f && f != funcval.func) {
+		reassign_func(funcval, f);
 	}
 }
 
@@ -1335,6 +1452,7 @@ void qbrtcall(Worker &w, qbrt_value &res, function_value *f)
 		w.current->cfstate = CFS_FAILED;
 		return;
 	}
+	charge_reductions(w, CALL_REDUCTIONS);
 
 	// check that none of the function args are bad first
 	WorkerCContext failctx(w, *f);
@@ -1346,8 +1464,7 @@ void qbrtcall(Worker &w, qbrt_value &res, function_value *f)
 			fail->trace_down(failed_call.mod->name
 					, failed_call.name(), w.current->pc
 					, __FILE__, __LINE__);
-			qbrt_value::fail(*failed_call.result, fail);
-			w.current->cfstate = CFS_FAILED;
+			w.current->fail(fail);
 			return;
 		}
 	}
@@ -1380,7 +1497,6 @@ void qbrtcall(Worker &w, qbrt_value &res, function_value *f)
 		if (!val) {
 			cerr << "wtf null value?\n";
 		}
-		const Type *valtype = val->type;
 		const ParamResource &param(qfunc->header->params[i]);
 		const char *name = fetch_string(resource, param.name_idx());
 		const TypeSpecResource &type(
@@ -1394,11 +1510,38 @@ void qbrtcall(Worker &w, qbrt_value &res, function_value *f)
 		}
 		const char *type_name =
 			fetch_string(resource, type_ms.sym_name());
-		if (valtype->module != type_mod || valtype->name != type_name) {
+		// no copies, this is on every call
+		const char *val_mod = val->type->module.c_str();
+		const char *val_name = val->type->name.c_str();
+		if (val->type->id == VT_THUNK) {
+			// a lazy arg isn't evaluated until the function reads
+			// it, so check the type its call is declared to return
+			const QbrtFunction *lazyf =
+				dynamic_cast< const QbrtFunction * >(
+						val->data.f->func);
+			if (!lazyf) {
+				// C functions don't declare a result type
+				continue;
+			}
+			const ResourceTable &lazyres(lazyf->mod->resource);
+			const TypeSpecResource &rtype(
+				lazyres.obj< TypeSpecResource >(
+					lazyf->header->result_type_idx()));
+			const ModSym &rtype_ms(
+				fetch_modsym(lazyres, rtype.name_idx()));
+			val_mod = fetch_string(lazyres, rtype_ms.mod_name());
+			if (val_mod[0] == '*' && val_mod[1] == '\0') {
+				continue;
+			}
+			val_name = fetch_string(lazyres, rtype_ms.sym_name());
+		}
+		if (strcmp(val_mod, type_mod) != 0
+				|| strcmp(val_name, type_name) != 0)
+		{
 			cerr << "Type Mismatch: parameter " << name << '/' << i
 				<< " expected to be " << type_mod << '/'
 				<< type_name << ", instead received "
-				<< valtype->module << '/' << valtype->name
+				<< val_mod << '/' << val_name
 				<< " " << w.current->function_call().name()
 				<< ':' << w.current->pc << endl;
 			exit(1);
@@ -1550,6 +1693,10 @@ ostream & inspect(ostream &out, const qbrt_value &v)
 		case VT_STREAM:
 			out << "stream";
 			break;
+		case VT_THUNK:
+			out << "lazy ";
+			inspect_function_value(out, *v.data.f);
+			break;
 	}
 	return out;
 }
@@ -1606,6 +1753,45 @@ void core_wid(OpContext &ctx, qbrt_value &result)
 	qbrt_value::i(result, ctx.worker().id);
 }
 
+/**
+ * Set how many reductions a task may run before it's rotated to the
+ * back of its worker's queue. Returns the previous budget.
+ * A budget less than 1 leaves the current budget in place and one
+ * that doesn't fit in the budget's int32_t is capped.
+ */
+void core_reduction_budget(OpContext &ctx, qbrt_value &result)
+{
+	const qbrt_value &budget(*ctx.srcvalue(PRIMARY_REG(0)));
+	Application &app(ctx.worker().app);
+	// the other workers read it when they pick their next task
+	int32_t prev;
+	if (budget.data.i > 0) {
+		// anything bigger is the same as no limit
+		int32_t b(budget.data.i > INT32_MAX ? INT32_MAX
+				: (int32_t) budget.data.i);
+		prev = __atomic_exchange_n(&app.reduction_budget, b
+				, __ATOMIC_RELAXED);
+	} else {
+		prev = __atomic_load_n(&app.reduction_budget
+				, __ATOMIC_RELAXED);
+	}
+	qbrt_value::i(result, prev);
+}
+
+/**
+ * Set the priority of the current process. Returns the previous
+ * priority. Anything other than a valid priority leaves it unchanged.
+ */
+void core_priority(OpContext &ctx, qbrt_value &result)
+{
+	const qbrt_value &pri(*ctx.srcvalue(PRIMARY_REG(0)));
+	ProcessRoot &proc(*ctx.worker().current->proc);
+	qbrt_value::i(result, proc.priority);
+	if (pri.data.i >= 0 && pri.data.i < NUM_PRIORITIES) {
+		proc.priority = pri.data.i;
+	}
+}
+
 void core_send(OpContext &ctx, qbrt_value &out)
 {
 	const qbrt_value &pid(*ctx.srcvalue(PRIMARY_REG(0)));
@@ -1628,6 +1814,41 @@ void core_send(OpContext &ctx, qbrt_value &out)
 	}
 }
 
+void core_sleep(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &ms(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (ms.type->id != VT_INT) {
+		cerr << "first argument to sleep is not an int\n";
+		exit(2);
+	}
+	if (ms.data.i <= 0) {
+		return;
+	}
+	CodeFrame &cf(*ctx.worker().current);
+	cf.deadline = clock_usec() + ms.data.i * 1000;
+	cf.cfstate = CFS_TIMEWAIT;
+}
+
+/**
+ * Send this process its ticker id every interval
+ */
+void core_timer(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &ms(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (ms.type->id != VT_INT || ms.data.i <= 0) {
+		cerr << "first argument to timer is not a positive int\n";
+		exit(2);
+	}
+	Worker &w(ctx.worker());
+	qbrt_value::i(out, start_ticker(w, w.current->proc->pid, ms.data.i));
+}
+
+void core_cancel_timer(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &id(*ctx.srcvalue(PRIMARY_REG(0)));
+	qbrt_value::b(out, cancel_ticker(ctx.worker().app, id.data.i));
+}
+
 /** Convert a string value to a string, straight copy */
 void core_str_from_str(OpContext &ctx, qbrt_value &result)
 {
@@ -1693,6 +1914,23 @@ void core_open(OpContext &ctx, qbrt_value &out)
 	qbrt_value::stream(out, new FileStream(fd, f));
 }
 
+void core_mmap(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &filename(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (filename.type->id != VT_STRING) {
+		cerr << "first argument to mmap is not a string\n";
+		cerr << "argument is type: " << (int)filename.type->id << endl;
+		exit(2);
+	}
+	MappedStream *s = map_file(*filename.data.str);
+	if (!s) {
+		cerr << "cannot map file " << *filename.data.str << ": "
+			<< strerror(errno) << endl;
+		exit(2);
+	}
+	qbrt_value::stream(out, s);
+}
+
 void core_getline(OpContext &ctx, qbrt_value &out)
 {
 	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
@@ -1703,6 +1941,209 @@ void core_getline(OpContext &ctx, qbrt_value &out)
 	ctx.io(stream.data.stream->getline(out));
 }
 
+/**
+ * Fail w/ the reason for the last socket error
+ * C functions don't have a pc so the failure names the io function.
+ */
+static void socket_failure(qbrt_value &out, const char *op
+		, const string &address)
+{
+	Failure *f = NEW_FAILURE("socketfailure", "io", op, 0);
+	f->debug << op << ' ' << address << ": " << strerror(errno);
+	qbrt_value::fail(out, f);
+}
+
+void core_listen(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &address(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (address.type->id != VT_STRING) {
+		cerr << "first argument to listen is not a string\n";
+		exit(2);
+	}
+	ListenStream *s = listen_socket(*address.data.str);
+	if (!s) {
+		socket_failure(out, "listen", *address.data.str);
+		return;
+	}
+	qbrt_value::stream(out, s);
+}
+
+void core_accept(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
+	if (stream.type->id != VT_STREAM) {
+		cerr << "first argument to accept is not a stream\n";
+		exit(2);
+	}
+	ListenStream *s = dynamic_cast< ListenStream * >(stream.data.stream);
+	if (!s) {
+		cerr << "first argument to accept is not a listening socket\n";
+		exit(2);
+	}
+	ctx.io(new StreamAccept(*s, out));
+}
+
+void core_connect(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &address(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (address.type->id != VT_STRING) {
+		cerr << "first argument to connect is not a string\n";
+		exit(2);
+	}
+	bool inprogress;
+	SocketStream *s = connect_socket(*address.data.str, inprogress);
+	if (!s) {
+		socket_failure(out, "connect", *address.data.str);
+		return;
+	}
+	if (inprogress) {
+		ctx.io(new StreamConnect(*s, out));
+		return;
+	}
+	qbrt_value::stream(out, s);
+}
+
+void core_read(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
+	const qbrt_value &len(*ctx.srcvalue(PRIMARY_REG(1)));
+	if (stream.type->id != VT_STREAM) {
+		cerr << "first argument to read is not a stream\n";
+		exit(2);
+	}
+	if (len.type->id != VT_INT || len.data.i < 0) {
+		cerr << "second argument to read is not a length\n";
+		exit(2);
+	}
+	ctx.io(stream.data.stream->read(out, len.data.i));
+}
+
+void core_readall(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
+	if (stream.type->id != VT_STREAM) {
+		cerr << "first argument to readall is not a stream\n";
+		exit(2);
+	}
+	ctx.io(stream.data.stream->read(out, READ_ALL));
+}
+
+/**
+ * Copy the rest of one stream into another. Returns the number of
+ * bytes copied.
+ */
+void core_copy(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &src(*ctx.dstvalue(PRIMARY_REG(0)));
+	qbrt_value &dst(*ctx.dstvalue(PRIMARY_REG(1)));
+	if (src.type->id != VT_STREAM) {
+		cerr << "first argument to copy is not a stream\n";
+		exit(2);
+	}
+	if (dst.type->id != VT_STREAM) {
+		cerr << "second argument to copy is not a stream\n";
+		exit(2);
+	}
+	ctx.io(new StreamCopy(*src.data.stream, *dst.data.stream, out));
+}
+
+/**
+ * Start a program from a list of its arguments. Returns a tuple
+ * of the child and its stdin, stdout and stderr.
+ */
+void core_spawn(OpContext &ctx, qbrt_value &out)
+{
+	const qbrt_value &args(*ctx.srcvalue(PRIMARY_REG(0)));
+	if (args.type->id != VT_LIST) {
+		cerr << "first argument to spawn is not a list\n";
+		exit(2);
+	}
+	vector< string > argv;
+	qbrt_value next(args);
+	qbrt_value item;
+	qbrt_value empty;
+	List::is_empty(empty, next);
+	while (!empty.data.b) {
+		List::head(item, next);
+		if (item.type->id != VT_STRING) {
+			cerr << "spawn arguments must be strings\n";
+			exit(2);
+		}
+		argv.push_back(*item.data.str);
+		List::pop(next, next);
+		List::is_empty(empty, next);
+	}
+
+	Stream *in, *child_out, *err;
+	ChildStream *child(spawn_child(argv, in, child_out, err));
+	if (!child) {
+		Failure *f = NEW_FAILURE("spawnfailure", "io", "spawn", 0);
+		f->debug << "spawn " << (argv.empty() ? "" : argv[0]) << ": "
+			<< strerror(errno);
+		qbrt_value::fail(out, f);
+		return;
+	}
+	Tuple *tup = new Tuple(4);
+	qbrt_value::stream(tup->value(0), child);
+	qbrt_value::stream(tup->value(1), in);
+	qbrt_value::stream(tup->value(2), child_out);
+	qbrt_value::stream(tup->value(3), err);
+	qbrt_value::tuple(out, tup);
+}
+
+/**
+ * Wait for a child to exit. Returns its exit code.
+ */
+void core_wait(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
+	if (stream.type->id != VT_STREAM) {
+		cerr << "first argument to wait is not a stream\n";
+		exit(2);
+	}
+	ChildStream *child = dynamic_cast< ChildStream * >(stream.data.stream);
+	if (!child) {
+		cerr << "first argument to wait is not a child process\n";
+		exit(2);
+	}
+	ctx.io(new StreamWaitChild(*child, out));
+}
+
+void core_close(OpContext &ctx, qbrt_value &out)
+{
+	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
+	if (stream.type->id != VT_STREAM) {
+		cerr << "first argument to close is not a stream\n";
+		exit(2);
+	}
+	Stream *s(stream.data.stream);
+	Worker &w(ctx.worker());
+	remove_unflushed(w, s);
+	if (s->fd < 0) {
+		// already closed, nothing left to wait for
+		return;
+	}
+	// any worker's engine might have the stream from a process
+	// that used it there. other workers' unflushed sets drop it
+	// themselves once a flush finds it closed
+	std::vector< IoEngine * > engines;
+	Application::WorkerMap::iterator it(w.app.worker.begin());
+	for (; it!=w.app.worker.end(); ++it) {
+		engines.push_back(it->second->ioengine);
+	}
+	StreamClose *io(new StreamClose(*s, engines));
+	if (!io->blocking()) {
+		// usually nothing's left to flush, and a listening socket
+		// would never be ready for output anyway
+		io->handle();
+		if (!io->waiting()) {
+			delete io;
+			return;
+		}
+	}
+	ctx.io(io);
+}
+
 void core_write(OpContext &ctx, qbrt_value &out)
 {
 	qbrt_value &stream(*ctx.dstvalue(PRIMARY_REG(0)));
@@ -1716,7 +2157,9 @@ void core_write(OpContext &ctx, qbrt_value &out)
 		cerr << "argument is type: " << (int) text.type->id << endl;
 		exit(2);
 	}
-	ctx.io(stream.data.stream->write(*text.data.str));
+	Stream *s(stream.data.stream);
+	ctx.io(s->write(*text.data.str));
+	add_unflushed(ctx.worker(), s);
 }
 
 Module * load_core_module(Application &app)
@@ -1730,6 +2173,13 @@ Module * load_core_module(Application &app)
 	add_c_function(*mod_core, core_send, "send", 2
 			, "io/Stream;core/String;");
 	add_c_function(*mod_core, core_wid, "wid", 0, "");
+	add_c_function(*mod_core, core_sleep, "sleep", 1, "core/Int;");
+	add_c_function(*mod_core, core_timer, "timer", 1, "core/Int;");
+	add_c_function(*mod_core, core_cancel_timer, "cancel_timer", 1
+			, "core/Int;");
+	add_c_function(*mod_core, core_reduction_budget, "reduction_budget", 1
+			, "core/Int;");
+	add_c_function(*mod_core, core_priority, "priority", 1, "core/Int;");
 	add_type(*mod_core, "Int", TYPE_INT);
 	add_type(*mod_core, "String", TYPE_STRING);
 	add_type(*mod_core, "ByteString", TYPE_STRING);
@@ -1746,6 +2196,18 @@ Module * load_io_module(Application &app)
 	add_c_function(*mod_io, core_print, "print", 1, "core/String;");
 	add_c_function(*mod_io, core_open, "open", 2
 			, "core/String;core/String;");
+	add_c_function(*mod_io, core_mmap, "mmap", 1, "core/String;");
+	add_c_function(*mod_io, core_listen, "listen", 1, "core/String;");
+	add_c_function(*mod_io, core_accept, "accept", 1, "io/Stream;");
+	add_c_function(*mod_io, core_connect, "connect", 1, "core/String;");
+	add_c_function(*mod_io, core_read, "read", 2
+			, "io/Stream;core/Int;");
+	add_c_function(*mod_io, core_readall, "readall", 1, "io/Stream;");
+	add_c_function(*mod_io, core_copy, "copy", 2
+			, "io/Stream;io/Stream;");
+	add_c_function(*mod_io, core_spawn, "spawn", 1, "core/List;");
+	add_c_function(*mod_io, core_wait, "wait", 1, "io/Stream;");
+	add_c_function(*mod_io, core_close, "close", 1, "io/Stream;");
 	add_c_function(*mod_io, core_write, "write", 2
 			, "io/Stream;core/String;");
 	add_c_function(*mod_io, core_getline, "getline", 1, "io/Stream;");
@@ -1766,18 +2228,100 @@ Module * load_list_module(Application &app)
 	return mod_list;
 }
 
+/**
+ * Pick the kind of stream for stdin or stdout from its own fd.
+ * Regular files and devices are FileStreams and anything else,
+ * like a pipe or a socket, can be polled as a ByteStream.
+ */
+static Stream * std_stream(FILE *file)
+{
+	int fd(fileno(file));
+	struct stat buf;
+	fstat(fd, &buf);
+	if (S_ISREG(buf.st_mode) || S_ISCHR(buf.st_mode)) {
+		return new FileStream(fd, file);
+	}
+	return new ByteStream(fd, file);
+}
+
+static bool has_ext(const string &objname, const char *ext)
+{
+	size_t extlen(strlen(ext));
+	return objname.size() > extlen
+		&& objname.compare(objname.size() - extlen, extlen, ext) == 0;
+}
+
+static int failure_exit(const qbrt_value &result)
+{
+	Failure *fail = result.data.failure;
+	Failure::write(cerr, *fail);
+	return fail->exit_code.data.i;
+}
+
+static FunctionCall * std_call(qbrt_value &result, const QbrtFunction &func
+		, function_value *funcval, Stream *in, Stream *out)
+{
+	FunctionCall *call = new FunctionCall(result, func, *funcval);
+	qbrt_value::stream(*add_context(call, "stdin"), in);
+	qbrt_value::stream(*add_context(call, "stdout"), out);
+	return call;
+}
+
 int main(int argc, const char **argv)
 {
+	// take a snapshot after __warm, instead of running __main
+	const char *snapshot_path = NULL;
+	if (argc >= 4 && strcmp(argv[1], "--snapshot") == 0) {
+		snapshot_path = argv[2];
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc < 2) {
 		cerr << "an object name is required\n";
 		return 0;
 	}
 	const char *objname = argv[1];
 	init_executioners();
+	init_instruction_sizes();
 	init_const_registers();
+	// a closed socket should fail the write, not kill the process
+	signal(SIGPIPE, SIG_IGN);
 
 
 	Application app;
+	const char *reduction_budget = getenv("QBRT_REDUCTIONS");
+	if (reduction_budget && atoi(reduction_budget) > 0) {
+		app.reduction_budget = atoi(reduction_budget);
+	}
+	const char *io_engine = getenv("QBRT_IO");
+	if (io_engine) {
+		app.io_engine = io_engine;
+	}
+	// an image brings all of its modules w/ it, so load those first
+	// and the rest of the loading finds them already there
+	vector< Module * > image;
+	const Module *image_main(NULL);
+	Snapshot snapshot;
+	if (has_ext(objname, SNAPSHOT_EXT)) {
+		if (!read_snapshot(objname, snapshot)) {
+			return 1;
+		}
+		image = snapshot.module;
+		image_main = snapshot.main;
+	} else if (has_ext(objname, IMAGE_EXT)) {
+		image_main = read_image(objname, image);
+		if (!image_main) {
+			return 1;
+		}
+	}
+	if (image_main) {
+		vector< Module * >::const_iterator it(image.begin());
+		for (; it!=image.end(); ++it) {
+			load_module(app, *it);
+		}
+		objname = image_main->name.c_str();
+	}
+
 	Module *mod_core(load_core_module(app));
 	Module *mod_io(load_io_module(app));
 	Module *mod_list(load_list_module(app));
@@ -1785,13 +2329,57 @@ int main(int argc, const char **argv)
 		return -1;
 	}
 
-	Worker &w0(new_worker(app));
-	Worker &w1(new_worker(app));
+	int num_workers(DEFAULT_WORKERS);
+	const char *workers = getenv("QBRT_WORKERS");
+	if (workers && atoi(workers) > 0) {
+		num_workers = min(atoi(workers), MAX_WORKERS);
+	}
+	for (int i(0); i<num_workers; ++i) {
+		new_worker(app);
+	}
 
 	const Module *main_module = load_module(app, objname);
 	if (!main_module) {
 		return 1;
 	}
+	// so the workers don't have to stop and wait on the disk
+	preload_modules(app, *main_module);
+	if (!link_modules(app)) {
+		return 1;
+	}
+
+	Stream *stream_stdin = std_stream(stdin);
+	Stream *stream_stdout = std_stream(stdout);
+
+	Application::WorkerMap::iterator wit(app.worker.begin());
+	for (; wit!=app.worker.end(); ++wit) {
+		Worker &w(*wit->second);
+		pthread_create(&w.thread, &w.thread_attr, launch_worker, &w);
+	}
+
+	// __warm is run once before __main, or restored from a snapshot
+	// of when it was run before
+	qbrt_value warm;
+	const QbrtFunction *qbrt_warm(main_module->fetch_function("__warm"));
+	if (!snapshot.path.empty()) {
+		restore_warm_value(app, snapshot, warm);
+	} else if (qbrt_warm) {
+		new_process(app, std_call(warm, *qbrt_warm
+					, new function_value(qbrt_warm)
+					, stream_stdin, stream_stdout)
+				, PRIORITY_NORMAL);
+		application_loop(app);
+		if (qbrt_value::failed(warm)) {
+			return failure_exit(warm);
+		}
+	}
+	if (snapshot_path) {
+		app.running = false;
+		if (!write_snapshot(snapshot_path, app, *main_module, warm)) {
+			return 1;
+		}
+		return 0;
+	}
 
 	const QbrtFunction *qbrt_main(main_module->fetch_function("__main"));
 	if (!qbrt_main) {
@@ -1809,52 +2397,32 @@ int main(int argc, const char **argv)
 		for (int i(1); i<argc; ++i) {
 			qbrt_value node;
 			Module::load_construct(node, *mod_list, "Node");
-			qbrt_value::str(node.data.reg->value(0), argv[i]);
+			// the program is named for its module, image or not
+			qbrt_value::str(node.data.reg->value(0)
+					, i == 1 ? objname : argv[i]);
 			node.data.reg->value(1) = head;
 			head = node;
 		}
 		List::reverse(main_func->regv[1], head);
 	}
 
-	Stream *stream_stdin = NULL;
-	Stream *stream_stdout = NULL;
-	struct stat buf;
-	fstat(fileno(stdin), &buf);
-	// printf("mode is %o\n", buf.st_mode);
-	if (S_ISREG(buf.st_mode)) {
-		// cerr << "stdin is a regular file\n";
-		stream_stdin = new FileStream(fileno(stdin), stdin);
-		stream_stdout = new FileStream(fileno(stdout), stdout);
-	} else if (S_ISCHR(buf.st_mode)) {
-		// cerr << "stdin is a character device\n";
-		stream_stdin = new FileStream(fileno(stdin), stdin);
-		stream_stdout = new FileStream(fileno(stdout), stdout);
-	} else if (S_ISFIFO(buf.st_mode)) {
-		// cerr << "stdin is fifo\n";
-		stream_stdin = new ByteStream(fileno(stdin), stdin);
-		stream_stdout = new ByteStream(fileno(stdout), stdout);
-	}
-
-
 	qbrt_value result;
 	qbrt_value::i(result, 0);
-	FunctionCall *main_call = new FunctionCall(result, *qbrt_main
-			, *main_func);
-	qbrt_value::stream(*add_context(main_call, "stdin"), stream_stdin);
-	qbrt_value::stream(*add_context(main_call, "stdout"), stream_stdout);
-	ProcessRoot *main_proc = new_process(app, main_call);
-
-	int tid1 = pthread_create(&w0.thread, &w0.thread_attr
-			, launch_worker, &w0);
-	int tid2 = pthread_create(&w1.thread, &w1.thread_attr
-			, launch_worker, &w1);
+	FunctionCall *main_call = std_call(result, *qbrt_main, main_func
+			, stream_stdin, stream_stdout);
+	if (warm.type->id != VT_VOID) {
+		*add_context(main_call, "warm") = warm;
+	}
+	ProcessRoot *main_proc = new_process(app, main_call, PRIORITY_NORMAL);
 
 	application_loop(app);
+	app.running = false;
+	if (getenv("QBRT_STATS")) {
+		print_stats(cerr, app);
+	}
 
 	if (qbrt_value::failed(result)) {
-		Failure *fail = result.data.failure;
-		Failure::write(cerr, *fail);
-		return fail->exit_code.data.i;
+		return failure_exit(result);
 	}
 
 	return result.data.i;
@@ -48,6 +48,7 @@ typedef void (*c_function)(OpContext &, qbrt_value &out);
 #define VT_PROMISE	0x10
 #define VT_SET		0x11
 #define VT_PATTERNVAR	0x12
+#define VT_THUNK	0x13
 #define VT_FAILURE	0xff
 
 extern Type TYPE_VOID;
@@ -66,6 +67,7 @@ extern Type TYPE_STREAM;
 extern Type TYPE_KIND;
 extern Type TYPE_PROMISE;
 extern Type TYPE_PATTERNVAR;
+extern Type TYPE_THUNK;
 extern Type TYPE_FAILURE;
 
 struct qbrt_value
@@ -143,6 +145,11 @@ struct qbrt_value
 		v.type = &TYPE_STRING;
 		v.data.str = new std::string(s);
 	}
+	static void str(qbrt_value &v, const char *s, size_t len)
+	{
+		v.type = &TYPE_STRING;
+		v.data.str = new std::string(s, len);
+	}
 	static void hashtag(qbrt_value &v, const std::string &h)
 	{
 		v.type = &TYPE_HASHTAG;
@@ -176,6 +183,15 @@ struct qbrt_value
 		v.type = &TYPE_PATTERNVAR;
 		v.data.reg = NULL;
 	}
+	/**
+	 * A function call that hasn't been evaluated yet
+	 * It's replaced w/ its result the first time it's read.
+	 */
+	static void thunk(qbrt_value &v, function_value *f)
+	{
+		v.type = &TYPE_THUNK;
+		v.data.f = f;
+	}
 	static void promise(qbrt_value &v, Promise *p)
 	{
 		v.type = &TYPE_PROMISE;
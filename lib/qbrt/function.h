@@ -29,12 +29,12 @@ public:
 	uint8_t reserved;
 	ParamResource params[1];
 
-	uint16_t name_idx() const { return be16toh(_name_idx); }
-	uint16_t doc_idx() const { return be16toh(_doc_idx); }
-	uint16_t line_no() const { return be16toh(_line_no); }
-	uint16_t context_idx() const { return be16toh(_context_idx); }
-	uint16_t param_types_idx() const { return be16toh(_param_types_idx); }
-	uint16_t result_type_idx() const { return be16toh(_result_type_idx); }
+	uint16_t name_idx() const { return qb16toh(_name_idx); }
+	uint16_t doc_idx() const { return qb16toh(_doc_idx); }
+	uint16_t line_no() const { return qb16toh(_line_no); }
+	uint16_t context_idx() const { return qb16toh(_context_idx); }
+	uint16_t param_types_idx() const { return qb16toh(_param_types_idx); }
+	uint16_t result_type_idx() const { return qb16toh(_result_type_idx); }
 
 	/** Get the address for where code starts */
 	const uint8_t * code() const
@@ -56,21 +56,21 @@ private:
 	uint16_t _typevars[];
 
 public:
-	inline uint16_t name_idx() const { return be16toh(_name_idx); }
-	inline uint16_t doc_idx() const { return be16toh(_doc_idx); }
-	inline uint16_t line_no() const { return be16toh(_line_no); }
+	inline uint16_t name_idx() const { return qb16toh(_name_idx); }
+	inline uint16_t doc_idx() const { return qb16toh(_doc_idx); }
+	inline uint16_t line_no() const { return qb16toh(_line_no); }
 	inline uint16_t func_count() const
 	{
-		return be16toh(_arg_func_count) & 0x3f;
+		return qb16toh(_arg_func_count) & 0x3f;
 	}
 	inline uint8_t argc() const
 	{
-		return be16toh(_arg_func_count) >> 10;
+		return qb16toh(_arg_func_count) >> 10;
 	}
 
 	inline uint16_t typevar_idx(uint16_t i) const
 	{
-		return be16toh(_typevars[i]);
+		return qb16toh(_typevars[i]);
 	}
 
 	static const uint16_t SIZE = 8;
@@ -88,13 +88,13 @@ private:
 	uint16_t _type[]; // TypeSpec array
 
 public:
-	uint16_t protocol_idx() const { return be16toh(_protocol_idx); }
-	uint16_t doc_idx() const { return be16toh(_doc_idx); }
-	uint16_t line_no() const { return be16toh(_line_no); }
-	uint16_t type_count() const { return be16toh(_type_count); }
-	uint16_t func_count() const { return be16toh(_func_count); }
+	uint16_t protocol_idx() const { return qb16toh(_protocol_idx); }
+	uint16_t doc_idx() const { return qb16toh(_doc_idx); }
+	uint16_t line_no() const { return qb16toh(_line_no); }
+	uint16_t type_count() const { return qb16toh(_type_count); }
+	uint16_t func_count() const { return qb16toh(_func_count); }
 
-	uint16_t type(uint16_t i) const { return be16toh(_type[i]); }
+	uint16_t type(uint16_t i) const { return qb16toh(_type[i]); }
 
 	static const uint16_t HEADER_SIZE = 10;
 };
@@ -248,6 +248,11 @@ struct function_value
 
 void load_function_value_types(std::ostringstream &, const function_value &);
 void reassign_func(function_value &funcval, const Function *newfunc);
+/**
+ * Copy a function value and its registers so the copy can be called
+ * without changing the original
+ */
+function_value * dup_function_value(const function_value &);
 
 
 static inline qbrt_value * follow_ref(qbrt_value *val)
@@ -3,11 +3,13 @@
 
 #include "qbrt/resourcetype.h"
 #include <string>
+#include <cstring>
 #include <fstream>
 #include <map>
 #include <set>
 #include <list>
 #include <stack>
+#include <vector>
 #include "string.h"
 #include "function.h"
 
@@ -45,8 +47,8 @@ struct ResourceInfo
 	uint32_t _offset;
 	uint16_t _type;
 
-	uint32_t offset() const { return be32toh(_offset); }
-	uint32_t type() const { return be16toh(_type); }
+	uint32_t offset() const { return qb32toh(_offset); }
+	uint32_t type() const { return qb16toh(_type); }
 
 	ResourceInfo(uint32_t offset, uint16_t typ)
 	: _offset(offset)
@@ -63,8 +65,8 @@ private:
 	uint16_t _sym_name;
 
 public:
-	uint16_t mod_name() const { return be16toh(_mod_name); }
-	uint16_t sym_name() const { return be16toh(_sym_name); }
+	uint16_t mod_name() const { return qb16toh(_mod_name); }
+	uint16_t sym_name() const { return qb16toh(_sym_name); }
 
 	typedef std::vector< ModSym * > Array;
 };
@@ -87,11 +89,65 @@ private:
 	uint16_t _modules[];
 
 public:
-	uint16_t count() const { return be16toh(_count); }
-	uint16_t modules(uint16_t i) const { return be16toh(_modules[i]); }
+	uint16_t count() const { return qb16toh(_count); }
+	uint16_t modules(uint16_t i) const { return qb16toh(_modules[i]); }
 };
 
 
+/**
+ * An application image is a set of .qb files bundled into one file w/
+ * a table of which function each ModSym refers to, so qbrt can load
+ * everything w/ one mmap and not look up any modules or functions.
+ *
+ * After the header is an ImageModule for each module, then the link
+ * tables and then the .qb files themselves.
+ */
+#define IMAGE_MAGIC	"qbim"
+#define IMAGE_EXT	".qbx"
+// an ImageLink that isn't resolved to a function
+#define IMAGE_NO_LINK	0xffff
+// each module in the image starts on this boundary
+#define IMAGE_ALIGN	8
+
+struct ImageHeader
+{
+	char magic[4];
+	uint32_t _qbrt_version;
+	uint16_t _module_count;
+	uint16_t _main_module;
+
+	uint32_t qbrt_version() const { return qb32toh(_qbrt_version); }
+	uint16_t module_count() const { return qb16toh(_module_count); }
+	uint16_t main_module() const { return qb16toh(_main_module); }
+
+	static const uint32_t SIZE = 12;
+};
+
+struct ImageModule
+{
+	uint32_t _offset;
+	uint32_t _size;
+	// offset of the module's link table, an ImageLink per resource
+	uint32_t _links;
+
+	uint32_t offset() const { return qb32toh(_offset); }
+	uint32_t size() const { return qb32toh(_size); }
+	uint32_t links() const { return qb32toh(_links); }
+
+	static const uint32_t SIZE = 12;
+};
+
+struct ImageLink
+{
+	uint16_t _module;
+	uint16_t _function;
+
+	uint16_t module() const { return qb16toh(_module); }
+	uint16_t function() const { return qb16toh(_function); }
+
+	static const uint32_t SIZE = 4;
+};
+
 struct ResourceTableHeader
 {
 	// converted to host byte order when it's read
@@ -109,11 +165,41 @@ struct ResourceTableHeader
 #pragma pack(pop)
 
 
+/**
+ * What an lfunc or lconstruct's ModSym refers to, so it doesn't have
+ * to be looked up by name each time it runs
+ */
+struct ModSymLink
+{
+	const Module *module;
+	const QbrtFunction *qbrt;
+	const CFunction *cfunc;
+	const ConstructResource *construct;
+	const Type *type;
+
+	ModSymLink()
+	: module(NULL)
+	, qbrt(NULL)
+	, cfunc(NULL)
+	, construct(NULL)
+	, type(NULL)
+	{}
+};
+
 struct ResourceTable
 {
 	static const uint32_t DATA_OFFSET =
 		ObjectHeader::SIZE + ResourceTableHeader::SIZE;
 
+	// C modules never read a table so it must start out empty
+	ResourceTable()
+		: data(NULL)
+		, index(NULL)
+		, data_size(0)
+		, resource_count(0)
+		, link_ready(false)
+	{}
+
 	uint16_t type(uint16_t i) const
 	{
 		const ResourceInfo *info;
@@ -193,10 +279,28 @@ struct ResourceTable
 	uint32_t index_offset() const
 	{ return ResourceTable::DATA_OFFSET + this->data_size; }
 
+	/**
+	 * What a ModSym resource was linked to. NULL if the module
+	 * hasn't been linked.
+	 */
+	const ModSymLink * linked(uint16_t modsym) const
+	{
+		// another worker may still be filling in link
+		if (!__atomic_load_n(&link_ready, __ATOMIC_ACQUIRE)) {
+			return NULL;
+		}
+		return modsym < link.size() ? &link[modsym] : NULL;
+	}
+
+	// both point into the module's mapped .qb file
 	const uint8_t *data;
 	const uint8_t *index;
 	uint32_t data_size;
 	uint16_t resource_count;
+	// by resource index, filled in when the module is linked
+	std::vector< ModSymLink > link;
+	// set w/ __atomic release once link is all filled in
+	bool link_ready;
 };
 
 struct Module
@@ -209,9 +313,6 @@ struct Module
 
 	const void * fetch_resource(const std::string &name) const;
 	const QbrtFunction * fetch_function(const std::string &name) const;
-	const QbrtFunction * fetch_override(const std::string &protomod
-		, const std::string &protoname, const std::string &fname
-		, const std::string &param_types) const;
 	const ProtocolResource * fetch_protocol(const std::string &name) const;
 	const QbrtFunction * fetch_protocol_function(
 			const std::string &protocol_name
@@ -219,7 +320,12 @@ struct Module
 
 	Module(const std::string &module_name)
 	: name(module_name)
+	, mapping(NULL)
+	, mapping_size(0)
+	, linked(false)
+	, link_failed(false)
 	{}
+	~Module();
 
 	friend void add_type(Module &, const std::string &name, const Type &);
 	friend const Type * indexed_datatype(const Module &, uint16_t idx);
@@ -227,6 +333,26 @@ struct Module
 	static void load_construct(qbrt_value &, const Module &
 			, const char *name);
 
+	/** The QbrtFunction for a function resource */
+	const QbrtFunction * function_at(uint16_t idx) const
+	{
+		return qbrt_function(resource.ptr< FunctionHeader >(idx));
+	}
+
+	/**
+	 * The .qb file, mapped read-only. NULL for C modules and
+	 * modules in an image, which are part of the image's mapping.
+	 */
+	const void *mapping;
+	size_t mapping_size;
+	/**
+	 * Have the ModSyms in the resource table been linked? Read it
+	 * w/ __atomic acquire outside of the app's link_lock.
+	 */
+	bool linked;
+	// some ModSym couldn't be linked
+	bool link_failed;
+
 private:
 	const QbrtFunction * qbrt_function(const FunctionHeader *) const;
 	mutable std::map< const FunctionHeader *, const QbrtFunction * >
@@ -237,10 +363,26 @@ typedef std::map< std::string, const Module * > ModuleMap;
 
 
 Module * read_module(const std::string &objname);
+/** Append the names of the modules this module imports */
+void module_imports(const Module &, std::vector< std::string > &);
+/**
+ * Load all the modules from an application image and link them.
+ * Returns the main module, or NULL if the image can't be read.
+ */
+Module * read_image(const std::string &path, std::vector< Module * > &);
+/**
+ * Read the modules from an image that's already mapped. The modules
+ * point into the input so it has to stay mapped.
+ */
+Module * parse_image(const std::string &path, const uint8_t *input
+		, size_t size, std::vector< Module * > &);
 
 const CFunction * fetch_c_function(const Module &, const std::string &name);
-const CFunction * fetch_c_override(const Module &, const std::string &protomod
-		, const std::string &protoname, const std::string &name
+/**
+ * Do the types of some values match an override's param types?
+ * A param type in the "*" module matches any type.
+ */
+bool match_param_types(const std::string &value_types
 		, const std::string &param_types);
 
 const ConstructResource * find_construct(const Module &
@@ -280,19 +422,20 @@ CFunction * add_c_override(Module &, c_function
 		, const std::string &name, uint8_t argc
 		, const std::string &param_types);
 
-static inline uint16_t read16(std::istream &in)
+static inline uint16_t read16(const uint8_t *in)
 {
 	uint16_t result;
-	in.read((char *) &result, 2);
-	return be16toh(result);
+	memcpy(&result, in, 2);
+	return qb16toh(result);
 }
-static inline uint32_t read32(std::istream &in)
+static inline uint32_t read32(const uint8_t *in)
 {
 	uint32_t result;
-	in.read((char *) &result, 4);
-	return be32toh(result);
+	memcpy(&result, in, 4);
+	return qb32toh(result);
 }
 
-bool open_qb(std::ifstream &lib, const std::string &qbname);
+/** Find a module's .qb file in QBPATH. Returns the open fd or -1. */
+int open_qb(const std::string &qbname);
 
 #endif
@@ -1,6 +1,22 @@
 #ifndef QBRT_RESOURCETYPE_H
 #define QBRT_RESOURCETYPE_H
 
+#include <endian.h>
+
+/**
+ * Since version 14 the numbers in .qb files are little-endian so
+ * on most hosts the resources are read as they are, w/o swapping
+ * bytes on every access. Older files need to be compiled again.
+ */
+#define QBRT_VERSION	14
+
+#define qb16toh(x)	le16toh(x)
+#define qb32toh(x)	le32toh(x)
+#define qb64toh(x)	le64toh(x)
+#define htoqb16(x)	htole16(x)
+#define htoqb32(x)	htole32(x)
+#define htoqb64(x)	htole64(x)
+
 #define RESOURCE_IMPORT		0x01
 #define RESOURCE_STRING		0x02
 #define RESOURCE_CONSTRUCT	0x03
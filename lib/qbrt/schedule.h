@@ -5,6 +5,7 @@
 #include "qbrt/function.h"
 #include <set>
 #include <list>
+#include <map>
 #include <pthread.h>
 
 
@@ -21,13 +22,60 @@ typedef uint8_t CodeFrameState;
 #define CFS_PEERWAIT	3
 #define CFS_COMPLETE	4
 #define CFS_FAILED	5
+// parked on the worker until the frame's deadline
+#define CFS_TIMEWAIT	6
+// parked until a message comes, or the deadline if there is one
+#define CFS_RECVWAIT	7
 
 typedef uint32_t WorkerID; // this should just be OS thread id?
 
+/**
+ * Reductions a task may spend before it's rotated to the back of
+ * its worker's run queue. One reduction is charged per instruction
+ * and CALL_REDUCTIONS more for each function call.
+ */
+#define DEFAULT_REDUCTION_BUDGET	2000
+#define CALL_REDUCTIONS	4
+
+/** Worker threads, unless QBRT_WORKERS asks for a different number */
+#define DEFAULT_WORKERS	2
+#define MAX_WORKERS	64
+
+/** Threads that load a program's imports at startup */
+#define LOADER_THREADS	4
+
+/**
+ * The load balancer runs every BALANCE_INTERVAL passes of the
+ * application loop and moves a process when the busiest worker has at
+ * least BALANCE_THRESHOLD more queued tasks than the idlest one.
+ */
+#define BALANCE_INTERVAL	10
+#define BALANCE_THRESHOLD	2
+
+/**
+ * Longest a worker waits on io before checking for other work,
+ * in milliseconds. It waits less if a timer is due sooner.
+ */
+#define IO_WAIT_TIMEOUT	100
+
+/**
+ * Process priorities. Each worker has a run queue per priority and
+ * always runs the highest priority work it has, except that a queue
+ * passed over STARVATION_LIMIT times in a row gets the next turn.
+ */
+typedef uint8_t Priority;
+#define PRIORITY_HIGH	0
+#define PRIORITY_NORMAL	1
+#define PRIORITY_LOW	2
+#define NUM_PRIORITIES	3
+#define STARVATION_LIMIT	8
+
 struct ParallelPath;
 struct FunctionCall;
 struct ProcessRoot;
 struct StreamIO;
+struct IoEngine;
+struct FileIoPool;
 struct Module;
 struct Application;
 typedef std::map< std::string, const Module * > ModuleMap;
@@ -48,7 +96,7 @@ public:
 
 private:
 	std::list< qbrt_value * > data;
-	pthread_spinlock_t lock;
+	mutable pthread_spinlock_t lock;
 };
 
 
@@ -62,7 +110,12 @@ struct CodeFrame
 	CodeFrameType cftype;
 	CodeFrameState cfstate;
 	int pc;
+	// when to wake from a sleep or give up on a recv, in
+	// microseconds on the monotonic clock. 0 if there's no deadline
+	int64_t deadline;
 	bool waiting_for_promise;
+	// finished w/ forks still running. the last fork deletes it.
+	bool finished;
 
 	CodeFrame(CodeFrame &parent, CodeFrameType type)
 	: proc(parent.proc)
@@ -71,8 +124,10 @@ struct CodeFrame
 	, cftype(type)
 	, cfstate(CFS_READY)
 	, pc(0)
+	, deadline(0)
 	, frame_context()
 	, waiting_for_promise(false)
+	, finished(false)
 	{}
 
 	CodeFrame(CodeFrameType type)
@@ -82,10 +137,14 @@ struct CodeFrame
 	, cftype(type)
 	, cfstate(CFS_READY)
 	, pc(0)
+	, deadline(0)
 	, frame_context()
 	, waiting_for_promise(false)
+	, finished(false)
 	{}
 
+	virtual ~CodeFrame() {}
+
 	virtual FunctionCall & function_call() = 0;
 	virtual const FunctionCall & function_call() const = 0;
 	void io_push(StreamIO *s)
@@ -96,6 +155,8 @@ struct CodeFrame
 	void io_pop();
 
 	virtual void finish_frame(Worker &) = 0;
+	/** Fail this frame and only this frame */
+	virtual void fail(Failure *) = 0;
 
 	static void backtrace(Failure &, const CodeFrame *);
 	friend qbrt_value * get_context(CodeFrame *, const std::string &);
@@ -135,6 +196,7 @@ struct FunctionCall
 	FunctionCall(const QbrtFunction &func, qbrt_value_index &vals);
 
 	virtual void finish_frame(Worker &);
+	virtual void fail(Failure *);
 
 	FunctionCall & function_call() { return *this; }
 	const FunctionCall & function_call() const { return *this; }
@@ -151,32 +213,51 @@ static inline const instruction & frame_instruction(const CodeFrame &f)
 	return *(const instruction *) (f.function_call().header->code() + f.pc);
 }
 
+/**
+ * A forked path of execution within a function
+ *
+ * A path may run on a different worker than its parent, so it
+ * doesn't share the parent's registers. It gets a snapshot of them
+ * when it's forked and the only value it gives back is whatever is
+ * in the target register when it finishes. That's handed to the
+ * parent through the promise that the parent holds in the same
+ * register.
+ *
+ * The snapshot is a deep copy so neither side can change what the
+ * other sees. Refs are followed and their values copied. Promises are
+ * the only values that are shared.
+ *
+ * A failure is kept in the path and handed to the parent through the
+ * promise too. It never touches the parent's result.
+ */
 struct ParallelPath
 : public CodeFrame
 {
-	ParallelPath(CodeFrame &parent)
-	: CodeFrame(parent, CFT_LOCAL_FORK)
-	, f_call(parent.function_call())
-	{}
+	Promise *promise;
+	reg_t target;
+	qbrt_value failure;
+
+	ParallelPath(CodeFrame &parent, reg_t target);
+	~ParallelPath();
+
 	FunctionCall & function_call() { return f_call; }
 	const FunctionCall & function_call() const { return f_call; }
 
 	virtual void finish_frame(Worker &);
+	virtual void fail(Failure *);
+	qbrt_value * target_value();
 
-	uint8_t num_values() const { return f_call.num_values(); }
-	qbrt_value & value(uint8_t i) { return f_call.value(i); }
-	const qbrt_value & value(uint8_t i) const { return f_call.value(i); }
+	uint8_t num_values() const { return regc; }
+	qbrt_value & value(uint8_t i) { return regv[i]; }
+	const qbrt_value & value(uint8_t i) const { return regv[i]; }
 
 private:
 	FunctionCall &f_call;
+	qbrt_value *regv;
+	uint8_t regc;
 };
 
-static inline ParallelPath * fork_frame(CodeFrame &src)
-{
-	ParallelPath *pp = new ParallelPath(src);
-	src.fork.insert(pp);
-	return pp;
-}
+ParallelPath * fork_frame(CodeFrame &src, reg_t target);
 
 
 struct ProcessRoot
@@ -186,18 +267,100 @@ struct ProcessRoot
 	Channel recv;
 	qbrt_value result;
 	uint64_t pid;
-
-	ProcessRoot(uint64_t pid, FunctionCall *call)
+	uint64_t reductions;
+	// guards the fork sets of this process's frames
+	pthread_spinlock_t fork_lock;
+	// the root call and forks that haven't finished yet. the
+	// process has exited when it gets to 0. use __atomic builtins
+	int32_t tasks;
+	Priority priority;
+
+	ProcessRoot(uint64_t pid, FunctionCall *call, Priority pri)
 	: owner(NULL)
 	, call(call)
 	, recv()
 	, pid(pid)
-	{}
+	, reductions(0)
+	, tasks(1)
+	, priority(pri)
+	{
+		pthread_spin_init(&fork_lock, PTHREAD_PROCESS_PRIVATE);
+	}
 
 	typedef std::map< uint64_t, ProcessRoot * > Map;
 };
 
 
+/**
+ * Numbers a worker publishes for the load balancer
+ *
+ * Written by the worker thread, read by the application thread, so
+ * the fields the worker writes are only accessed w/ __atomic builtins.
+ * reduction_rate and balanced_reductions belong to the balancer.
+ */
+struct WorkerStats
+{
+	uint64_t reductions;
+	uint64_t reduction_rate;
+	uint64_t balanced_reductions;
+	uint64_t migrated_in;
+	uint64_t migrated_out;
+	int32_t queued;
+
+	WorkerStats()
+	: reductions(0)
+	, reduction_rate(0)
+	, balanced_reductions(0)
+	, migrated_in(0)
+	, migrated_out(0)
+	, queued(0)
+	{}
+};
+
+/**
+ * Frames that are ready to run at one priority
+ *
+ * Frames are taken from the front of fresh and put back on stale.
+ * When fresh runs out, fresh and stale are swapped.
+ */
+struct RunQueue
+{
+	CodeFrame::List *fresh;
+	CodeFrame::List *stale;
+	// how many times in a row this queue had work and was passed over
+	int32_t passed;
+
+	RunQueue()
+	: fresh(new CodeFrame::List())
+	, stale(new CodeFrame::List())
+	, passed(0)
+	{}
+
+	bool empty() const { return fresh->empty() && stale->empty(); }
+	int32_t size() const { return fresh->size() + stale->size(); }
+};
+
+/**
+ * A timer that sends its id to a process every interval
+ */
+struct Ticker
+{
+	uint64_t id;
+	uint64_t pid;
+	// microseconds
+	int64_t interval;
+
+	Ticker(uint64_t id, uint64_t pid, int64_t interval)
+	: id(id)
+	, pid(pid)
+	, interval(interval)
+	{}
+};
+
+// keyed by when they're due, on the monotonic clock
+typedef std::multimap< int64_t, CodeFrame * > SleepMap;
+typedef std::multimap< int64_t, Ticker > TickerMap;
+
 /**
  * Function call always assigned to the same worker
  *
@@ -205,13 +368,9 @@ struct ProcessRoot
  * one. No problems when assigned to the same worker.
  *
  * When assigned to a different worker also a different thread.
- * Problems ensue on writable variables.
- * Use message passing to keep things unshared?
- * Normal locking on writable variables?
- * Static analysis to prohibit multiple use of writable vars?
- *
- * These problems can probably be punted on for now and worked out
- * once it's time to add multiple workers
+ * The path works on its own snapshot of the registers and only hands
+ * back its target register through a promise so no register is
+ * written from two threads. See ParallelPath.
  */
 struct Worker
 {
@@ -221,21 +380,57 @@ struct Worker
 	pthread_t thread;
 	pthread_attr_t thread_attr;
 	CodeFrame *current;
-	CodeFrame::List *fresh;
-	CodeFrame::List *stale;
+	RunQueue runq[NUM_PRIORITIES];
+	std::set< CodeFrame * > iowait;
+	// streams written to that may still have buffered output
+	std::set< Stream * > unflushed;
+	// processes and frames handed over from other threads
+	std::list< ProcessRoot * > inbox_proc;
+	CodeFrame::List inbox;
+	// frames whose blocking io was done by the FileIoPool
+	CodeFrame::List iodone;
+	pthread_spinlock_t inbox_lock;
+	// frames parked until a deadline
+	SleepMap sleepers;
+	// frames parked until their process gets a message
+	CodeFrame::List receivers;
+	// tickers can be cancelled from any worker
+	TickerMap tickers;
+	pthread_spinlock_t ticker_lock;
 	qbrt_value drain;
-	int epfd;
+	WorkerStats stats;
+	IoEngine *ioengine;
 	int iocount;
+	int32_t reductions;
 	WorkerID id;
+	// set by the balancer, taken by the worker. use __atomic builtins
+	WorkerID migrate_to;
 	TaskID next_taskid;
 	TaskID next_pid;
 
 	Worker(Application &, WorkerID);
 
-	bool empty() const;
+	bool runnable() const;
+	/** Is there io, a timer or a message to wait for? */
+	bool waiting() const;
+	int32_t queued() const;
 };
 
 void findtask(Worker &);
+void flush_output(Worker &);
+/** Remember a stream this worker has buffered output for */
+void add_unflushed(Worker &, Stream *);
+/** Forget a stream's buffered output, as when it's closed */
+void remove_unflushed(Worker &, Stream *);
+/** Microseconds on the monotonic clock */
+int64_t clock_usec();
+/** Start a ticker for a process. Returns the ticker's id. */
+uint64_t start_ticker(Worker &, uint64_t pid, int64_t interval_ms);
+/** Returns false if there's no ticker w/ that id */
+bool cancel_ticker(Application &, uint64_t id);
+void migrate_process(Worker &src, Worker &dst, ProcessRoot *);
+void schedule_fork(Worker &, ParallelPath *);
+void charge_reductions(Worker &, int32_t);
 inline const Module * current_module(const Worker &w)
 {
 	return w.current->function_call().mod;
@@ -243,28 +438,61 @@ inline const Module * current_module(const Worker &w)
 const Module * find_module(Worker &, const std::string &modname);
 const Module * load_module(Worker &, const std::string &modname);
 
-const Function * find_default_function(Worker &, const Function &);
-const QbrtFunction * find_override(Worker &, const char *protocol_mod
-		, const char *protocol_name, const char *funcname
-		, const std::string &param_types);
-const CFunction * find_c_override(Worker &, const std::string &protomod
-		, const std::string &protoname, const std::string &name
-		, const std::string &param_types);
 
 void gotowork(Worker &);
 void * launch_worker(void *);
 
 
+/**
+ * Everything that implements one protocol function, filled in as
+ * modules are linked
+ */
+struct ProtocolDispatch
+{
+	typedef std::pair< std::string, const Function * > Pattern;
+
+	// by param types
+	std::map< std::string, const Function * > exact;
+	// qbrt overrides w/ "*/" param types, tried in load order
+	std::list< Pattern > pattern;
+	// the protocol's own function, abstract or default
+	const Function *fallback;
+
+	ProtocolDispatch()
+	: fallback(NULL)
+	{}
+};
+// by "<protocol module>/<protocol>/<function>"
+typedef std::map< std::string, ProtocolDispatch > DispatchMap;
+
 struct Application
 {
 	typedef std::map< WorkerID, Worker * > WorkerMap;
 	WorkerMap worker;
 	ModuleMap module;
+	// for module, once the workers or loaders are running
+	pthread_mutex_t module_lock;
+	// so only one thread links modules at a time
+	pthread_mutex_t link_lock;
+	DispatchMap dispatch;
+	pthread_rwlock_t dispatch_lock;
 	ProcessRoot::Map newproc;
 	ProcessRoot::Map recv;
 	pthread_spinlock_t application_lock;
 	WorkerID next_workerid;
 	uint64_t pid_count;
+	uint64_t ticker_count;
+	uint64_t balance_rounds;
+	uint64_t migrations;
+	// name of the io engine for new workers. empty for the default
+	std::string io_engine;
+	FileIoPool *fileio;
+	// set from any worker, use __atomic ops after startup
+	int32_t reduction_budget;
+	// processes that haven't exited, streams w/ buffered output
+	// and processes being handed between workers. application_loop
+	// returns when it's 0. use __atomic builtins
+	int64_t live;
 	bool running;
 
 	Application();
@@ -279,12 +507,33 @@ private:
 const Module * find_app_module(Application &, const std::string &modname);
 const Module * load_module(Application &, const std::string &modname);
 void load_module(Application &, const Module *);
-const CFunction * find_c_override(Application &, const std::string &protomod
-		, const std::string &protoname, const std::string &name
-		, const std::string &param_types);
+/**
+ * Load everything a module imports, and everything those import,
+ * on a pool of loader threads. Returns once they're all loaded.
+ */
+void preload_modules(Application &, const Module &);
+/**
+ * Link any modules that haven't been yet. Returns false if any
+ * of their lfunc or lconstruct targets can't be found.
+ */
+bool link_modules(Application &);
+/**
+ * Find the function to run for a protocol function w/ these value
+ * types. That's the override for the types if there is one, or else
+ * the protocol's own function. NULL if the protocol isn't loaded.
+ */
+const Function * dispatch_function(Application &, const Function &
+		, const std::string &value_types);
 bool send_msg(Application &, uint64_t pid, const qbrt_value &src);
 Worker & new_worker(Application &);
-ProcessRoot * new_process(Application &, FunctionCall *);
+ProcessRoot * new_process(Application &, FunctionCall *, Priority);
+void balance_workers(Application &);
+/**
+ * Hand out new processes until they've all exited and their output
+ * is written. The workers keep going until app.running is cleared,
+ * so this can be called again w/ more processes.
+ */
 void application_loop(Application &);
+void print_stats(std::ostream &, const Application &);
 
 #endif
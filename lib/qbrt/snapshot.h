@@ -0,0 +1,79 @@
+#ifndef QBRT_SNAPSHOT_H
+#define QBRT_SNAPSHOT_H
+
+#include "qbrt/core.h"
+#include "qbrt/resourcetype.h"
+#include <string>
+#include <vector>
+
+struct Application;
+struct Module;
+
+
+/**
+ * A snapshot is an application image w/ the result of the main
+ * module's __warm function saved after it, so a restored qbrt can
+ * go straight to __main w/o loading modules or warming up again.
+ *
+ * The modules in the image are used from the mapping the same as any
+ * other image. The warm value is decoded into new values when it's
+ * restored, since runtime values are all pointers.
+ */
+#define SNAPSHOT_MAGIC	"qbsn"
+#define SNAPSHOT_EXT	".qbs"
+// refers back to a construct, tuple or function already decoded
+#define SNAPSHOT_SHARED	0xfe
+// kinds of function values in the heap
+#define SNAPSHOT_QBRT_FUNCTION	0
+#define SNAPSHOT_C_FUNCTION	1
+
+#pragma pack(push, 1)
+
+/** The image follows the header and the heap follows the image */
+struct SnapshotHeader
+{
+	char magic[4];
+	uint32_t _qbrt_version;
+	uint32_t _heap_offset;
+	uint32_t _heap_size;
+
+	uint32_t qbrt_version() const { return qb32toh(_qbrt_version); }
+	uint32_t heap_offset() const { return qb32toh(_heap_offset); }
+	uint32_t heap_size() const { return qb32toh(_heap_size); }
+
+	static const uint32_t SIZE = 16;
+};
+
+#pragma pack(pop)
+
+struct Snapshot
+{
+	std::string path;
+	std::vector< Module * > module;
+	Module *main;
+	// the encoded warm value, in the snapshot's mapping
+	const uint8_t *heap;
+	uint32_t heap_size;
+
+	Snapshot()
+	: main(NULL)
+	, heap(NULL)
+	, heap_size(0)
+	{}
+};
+
+/**
+ * Save the application's loaded modules and a warm value. Fails if
+ * the value has something that can't be saved, like a stream.
+ */
+bool write_snapshot(const std::string &path, Application &
+		, const Module &main, const qbrt_value &warm);
+/** Map a snapshot and read its modules */
+bool read_snapshot(const std::string &path, Snapshot &);
+/**
+ * Decode the snapshot's warm value. Call it once the C functions
+ * have been added to the modules.
+ */
+void restore_warm_value(Application &, const Snapshot &, qbrt_value &);
+
+#endif
@@ -246,6 +246,21 @@ struct call_stmt
 	void pretty(std::ostream &) const;
 };
 
+struct calllazy_stmt
+: public Stmt
+{
+	calllazy_stmt(AsmReg *result, AsmReg *func)
+		: result(result)
+		, function(func)
+	{}
+	AsmReg *result;
+	AsmReg *function;
+
+	void allocate_registers(RegAlloc *);
+	void generate_code(AsmFunc &);
+	void pretty(std::ostream &) const;
+};
+
 struct cfailure_stmt
 : public Stmt
 {
@@ -675,10 +690,12 @@ struct patternvar_stmt
 struct recv_stmt
 : public Stmt
 {
-	recv_stmt(AsmReg *dst)
+	recv_stmt(AsmReg *dst, AsmReg *timeout)
 	: dst(dst)
+	, timeout(timeout)
 	{}
 	AsmReg *dst;
+	AsmReg *timeout;
 
 	void allocate_registers(RegAlloc *);
 	void generate_code(AsmFunc &);
@@ -2,6 +2,7 @@
 #define QBRT_TYPE_H
 
 #include "qbrt/core.h"
+#include "qbrt/resourcetype.h"
 #include <cstdio>
 #include <list>
 
@@ -15,8 +16,8 @@ private:
 	uint16_t _type_idx;	// TypeSpecResource index
 
 public:
-	uint16_t name_idx() const { return be16toh(_name_idx); }
-	uint16_t type_idx() const { return be16toh(_type_idx); }
+	uint16_t name_idx() const { return qb16toh(_name_idx); }
+	uint16_t type_idx() const { return qb16toh(_type_idx); }
 };
 
 struct TypeSpecResource
@@ -27,9 +28,9 @@ private:
 	uint16_t _args[];	// other TypeSpecResource indexes
 
 public:
-	uint16_t name_idx() const { return be16toh(_name_idx); }
-	uint16_t fullname_idx() const { return be16toh(_fullname_idx); }
-	uint16_t args(uint16_t i) const { return be16toh(_args[i]); }
+	uint16_t name_idx() const { return qb16toh(_name_idx); }
+	uint16_t fullname_idx() const { return qb16toh(_fullname_idx); }
+	uint16_t args(uint16_t i) const { return qb16toh(_args[i]); }
 };
 
 struct DataTypeResource
@@ -43,10 +44,10 @@ private:
 public:
 	uint8_t argc;
 
-	uint16_t name_idx() const { return be16toh(_name_idx); }
-	uint16_t doc_idx() const { return be16toh(_doc_idx); }
-	uint16_t filename_idx() const { return be16toh(_filename_idx); }
-	uint16_t lineno() const { return be16toh(_lineno); }
+	uint16_t name_idx() const { return qb16toh(_name_idx); }
+	uint16_t doc_idx() const { return qb16toh(_doc_idx); }
+	uint16_t filename_idx() const { return qb16toh(_filename_idx); }
+	uint16_t lineno() const { return qb16toh(_lineno); }
 
 	static const uint32_t SIZE = 9;
 };
@@ -65,11 +66,11 @@ public:
 	uint8_t reserved;
 	ParamResource fields[1];
 
-	uint16_t name_idx() const { return be16toh(_name_idx); }
-	uint16_t doc_idx() const { return be16toh(_doc_idx); }
-	uint16_t filename_idx() const { return be16toh(_filename_idx); }
-	uint16_t lineno() const { return be16toh(_lineno); }
-	uint16_t datatype_idx() const { return be16toh(_datatype_idx); }
+	uint16_t name_idx() const { return qb16toh(_name_idx); }
+	uint16_t doc_idx() const { return qb16toh(_doc_idx); }
+	uint16_t filename_idx() const { return qb16toh(_filename_idx); }
+	uint16_t lineno() const { return qb16toh(_lineno); }
+	uint16_t datatype_idx() const { return qb16toh(_datatype_idx); }
 
 	static const uint32_t SIZE = 12;
 };
@@ -191,12 +192,34 @@ struct Promise
 	Promise(TaskID tid);
 	~Promise();
 
+	/**
+	 * Set the flag until the promise is fulfilled. A waiter should
+	 * only be marked once, the list is cleared when it's notified.
+	 */
 	void mark_to_notify(bool &);
 	void notify();
 
+	/** Set the promised value. Called by the promiser when it's done */
+	void fulfill(const qbrt_value &);
+	/** Copy the value to dst if it's been fulfilled */
+	bool redeem(qbrt_value &dst);
+
+	/**
+	 * Promises are shared between threads so they're reference
+	 * counted. It starts w/ 1 ref and is deleted when the last
+	 * holder releases it.
+	 */
+	void retain();
+	void release();
+
 private:
+	void notify_locked();
+
 	std::list< bool * > waiters;
+	qbrt_value value;
 	pthread_spinlock_t lock;
+	int32_t refs;
+	bool fulfilled;
 };
 
 #endif
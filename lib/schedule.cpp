@@ -1,26 +1,36 @@
 #include "qbrt/schedule.h"
 #include "qbrt/module.h"
+#include "qbrt/type.h"
 #include "io.h"
+#include "instruction/function.h"
+#include "instruction/type.h"
+#include <time.h>
 
 using namespace std;
 
-#define MAX_EPOLL_EVENTS 16
 
 
 bool Channel::empty() const
 {
-	return data.empty();
+	pthread_spin_lock(&lock);
+	bool result(data.empty());
+	pthread_spin_unlock(&lock);
+	return result;
 }
 
 void Channel::push(qbrt_value *val)
 {
+	pthread_spin_lock(&lock);
 	data.push_back(val);
+	pthread_spin_unlock(&lock);
 }
 
 qbrt_value * Channel::pop()
 {
+	pthread_spin_lock(&lock);
 	qbrt_value *val = data.front();
 	data.pop_front();
+	pthread_spin_unlock(&lock);
 	return val;
 }
 
@@ -78,29 +88,205 @@ const char * FunctionCall::name() const
 	return fetch_string(mod->resource, header->name_idx());
 }
 
+/**
+ * Check if a frame can be deleted now that it's done. If it still
+ * has forks running, mark it finished so the last one deletes it.
+ */
+static bool release_frame(CodeFrame &f)
+{
+	pthread_spin_lock(&f.proc->fork_lock);
+	bool release(f.fork.empty());
+	f.finished = !release;
+	pthread_spin_unlock(&f.proc->fork_lock);
+	return release;
+}
+
+/**
+ * One of a process's tasks is done. The process has exited once the
+ * root call and all of its forks are.
+ */
+static void end_task(Worker &w, ProcessRoot *proc)
+{
+	if (__atomic_sub_fetch(&proc->tasks, 1, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_sub_fetch(&w.app.live, 1, __ATOMIC_RELEASE);
+	}
+}
+
 void FunctionCall::finish_frame(Worker &w)
 {
 	CodeFrame *call = w.current;
+	ProcessRoot *proc(call->proc);
+	bool root(!call->parent);
 	w.current = w.current->parent;
-	if (call->fork.empty()) {
+	if (release_frame(*call)) {
 		delete call;
-	} else {
-		w.stale->push_back(call);
 	}
+	if (root) {
+		end_task(w, proc);
+	}
+}
+
+void FunctionCall::fail(Failure *f)
+{
+	qbrt_value::fail(*result, f);
+	cfstate = CFS_FAILED;
+}
+
+
+/**
+ * Copy a value into a fork's snapshot
+ *
+ * Nothing in the copy is shared w/ the parent except promises, which
+ * are refcounted. Refs are followed and the value they point to is
+ * copied.
+ */
+static void fork_value(qbrt_value &dst, const qbrt_value &ref)
+{
+	const qbrt_value &src(*follow_ref(const_cast< qbrt_value * >(&ref)));
+	switch (src.type->id) {
+		case VT_STRING:
+			qbrt_value::str(dst, *src.data.str);
+			break;
+		case VT_FUNCTION:
+		case VT_THUNK:
+		{
+			const function_value &sf(*src.data.f);
+			function_value *df = new function_value(sf.func);
+			if (df->regc < sf.regc) {
+				df->realloc(sf.regc);
+			}
+			df->argc = sf.argc;
+			for (uint8_t i(0); i<sf.regc; ++i) {
+				fork_value(df->value(i), sf.value(i));
+			}
+			dst.type = src.type;
+			dst.data.f = df;
+			break;
+		}
+		case VT_TUPLE:
+		{
+			const Tuple &st(*src.data.tuple);
+			Tuple *dt = new Tuple(st.size);
+			for (uint8_t i(0); i<st.size; ++i) {
+				fork_value(dt->data[i], st.data[i]);
+			}
+			qbrt_value::tuple(dst, dt);
+			break;
+		}
+		case VT_CONSTRUCT:
+		{
+			const Construct &sc(*src.data.cons);
+			Construct *dc = new Construct(sc.mod, sc.resource);
+			for (uint8_t i(0); i<sc.num_values(); ++i) {
+				fork_value(dc->fields[i], sc.fields[i]);
+			}
+			qbrt_value::construct(dst, src.type, dc);
+			break;
+		}
+		case VT_PROMISE:
+			src.data.promise->retain();
+			// fall through
+		default:
+			dst = src;
+			break;
+	}
+}
+
+ParallelPath::ParallelPath(CodeFrame &parent, reg_t target)
+: CodeFrame(parent, CFT_LOCAL_FORK)
+, promise(NULL)
+, target(target)
+, failure()
+, f_call(parent.function_call())
+, regv(NULL)
+, regc(parent.num_values())
+{
+	regv = new qbrt_value[regc];
+	for (uint8_t i(0); i<regc; ++i) {
+		fork_value(regv[i], parent.value(i));
+	}
+}
+
+ParallelPath::~ParallelPath()
+{
+	for (uint8_t i(0); i<regc; ++i) {
+		if (regv[i].type->id == VT_PROMISE) {
+			regv[i].data.promise->release();
+		}
+	}
+	delete[] regv;
+}
+
+void ParallelPath::fail(Failure *f)
+{
+	// the parent may be running on another worker. leave its
+	// registers alone and hand the failure back through the promise
+	qbrt_value::fail(failure, f);
+	cfstate = CFS_FAILED;
+}
+
+qbrt_value * ParallelPath::target_value()
+{
+	if (REG_IS_PRIMARY(target)) {
+		uint8_t primary(REG_EXTRACT_PRIMARY(target));
+		return primary < regc ? &regv[primary] : NULL;
+	} else if (REG_IS_SECONDARY(target)) {
+		uint8_t primary(REG_EXTRACT_SECONDARY1(target));
+		uint8_t secondary(REG_EXTRACT_SECONDARY2(target));
+		if (primary >= regc
+				|| !qbrt_value::is_value_index(regv[primary]))
+		{
+			return NULL;
+		}
+		qbrt_value_index *idx(regv[primary].data.reg);
+		if (secondary >= idx->num_values()) {
+			return NULL;
+		}
+		return &idx->value(secondary);
+	}
+	return NULL;
 }
 
 void ParallelPath::finish_frame(Worker &w)
 {
-	w.current->parent->fork.erase(w.current);
-	if (w.current->fork.empty()) {
-		delete w.current;
-	} else {
-		w.stale->push_back(w.current);
+	if (promise) {
+		qbrt_value *result(qbrt_value::failed(failure)
+				? &failure : target_value());
+		promise->fulfill(result ? *result : qbrt_value());
+		promise->release();
+		promise = NULL;
 	}
+
+	CodeFrame *parent_frame(parent);
+	ProcessRoot *fork_proc(proc);
+	pthread_spin_lock(&proc->fork_lock);
+	parent_frame->fork.erase(this);
+	bool orphan(parent_frame->finished && parent_frame->fork.empty());
+	bool release(fork.empty());
+	finished = !release;
+	pthread_spin_unlock(&proc->fork_lock);
+
 	w.current = NULL;
+	if (orphan) {
+		delete parent_frame;
+	}
+	if (release) {
+		delete this;
+	}
+	end_task(w, fork_proc);
 	findtask(w);
 }
 
+ParallelPath * fork_frame(CodeFrame &src, reg_t target)
+{
+	ParallelPath *pp = new ParallelPath(src, target);
+	__atomic_add_fetch(&src.proc->tasks, 1, __ATOMIC_RELAXED);
+	pthread_spin_lock(&src.proc->fork_lock);
+	src.fork.insert(pp);
+	pthread_spin_unlock(&src.proc->fork_lock);
+	return pp;
+}
+
 
 Worker::Worker(Application &app, WorkerID id)
 : app(app)
@@ -109,110 +295,393 @@ Worker::Worker(Application &app, WorkerID id)
 , thread()
 , thread_attr()
 , process()
-, fresh(new CodeFrame::List())
-, stale(new CodeFrame::List())
+, runq()
+, iowait()
+, unflushed()
+, inbox_proc()
+, inbox()
+, iodone()
+, sleepers()
+, receivers()
+, tickers()
 , drain()
-, epfd(0)
+, stats()
+, ioengine(new_io_engine(app.io_engine))
 , iocount(0)
+, reductions(__atomic_load_n(&app.reduction_budget
+			, __ATOMIC_RELAXED))
 , id(id)
+, migrate_to(0)
 , next_taskid(0)
 , next_pid(0)
 {
-	epfd = epoll_create(1);
-	if (epfd < 0) {
-		perror("epoll_create failure");
+	pthread_spin_init(&inbox_lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_spin_init(&ticker_lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+bool Worker::waiting() const
+{
+	if (iocount > 0 || !sleepers.empty() || !receivers.empty()) {
+		return true;
 	}
+	pthread_spin_lock(const_cast< pthread_spinlock_t * >(&ticker_lock));
+	bool ticking(!tickers.empty());
+	pthread_spin_unlock(const_cast< pthread_spinlock_t * >(&ticker_lock));
+	return ticking;
 }
 
-bool Worker::empty() const
+bool Worker::runnable() const
 {
-	bool empty = !current
-		&& (!fresh || fresh->empty())
-		&& (!stale || stale->empty());
-	return empty;
+	for (int p(0); p<NUM_PRIORITIES; ++p) {
+		if (!runq[p].empty()) {
+			return true;
+		}
+	}
+	return false;
 }
 
-void findtask(Worker &w)
+int32_t Worker::queued() const
+{
+	int32_t n(0);
+	for (int p(0); p<NUM_PRIORITIES; ++p) {
+		n += runq[p].size();
+	}
+	return n;
+}
+
+/**
+ * Put a frame at the back of the run queue for its process's priority
+ */
+static inline void requeue(Worker &w, CodeFrame *cf)
+{
+	w.runq[cf->proc->priority].stale->push_back(cf);
+}
+
+/**
+ * Start a frame's io. Returns false if the frame has to wait for it.
+ */
+static bool iowatch(Worker &w, CodeFrame *cf)
 {
-	if (w.fresh->empty()) {
-		if (w.stale->empty()) {
-			// all tasks are waiting on io
-			return;
+	if (cf->io->blocking()) {
+		w.app.fileio->submit(w, cf);
+	} else if (w.ioengine->watch(cf)) {
+		cf->io_pop();
+		cf->cfstate = CFS_READY;
+		return true;
+	}
+	w.iowait.insert(cf);
+	++w.iocount;
+	return false;
+}
+
+/**
+ * Take in any processes that were assigned or migrated to this worker
+ */
+static void receive_processes(Worker &w)
+{
+	std::list< ProcessRoot * > procs;
+	CodeFrame::List frames;
+	int64_t migrated(0);
+	pthread_spin_lock(&w.inbox_lock);
+	procs.swap(w.inbox_proc);
+	frames.swap(w.inbox);
+
+	std::list< ProcessRoot * >::iterator p(procs.begin());
+	for (; p!=procs.end(); ++p) {
+		if ((*p)->owner) {
+			__atomic_add_fetch(&w.stats.migrated_in, 1
+					, __ATOMIC_RELAXED);
+			++migrated;
 		}
-		// out of fresh, swap fresh and stale
-		CodeFrame::List *tmp = w.fresh;
-		w.fresh = w.stale;
-		w.stale = tmp;
+		(*p)->owner = &w;
+		w.process[(*p)->pid] = *p;
+	}
+	CodeFrame::List::iterator f(frames.begin());
+	for (; f!=frames.end(); ++f) {
+		if (!(*f)->io || iowatch(w, *f)) {
+			requeue(w, *f);
+		}
+	}
+	pthread_spin_unlock(&w.inbox_lock);
+	if (migrated) {
+		// the handoffs are done now that the frames are queued
+		__atomic_sub_fetch(&w.app.live, migrated, __ATOMIC_RELEASE);
 	}
-	// move the first fresh task to task
-	w.current = w.fresh->front();
-	w.fresh->pop_front();
 }
 
-const Module * find_module(Worker &w, const std::string &modname)
+static void remove_frames(CodeFrame::List &q, const ProcessRoot *proc)
 {
-	if (modname == "./") {
-		// if the module name is empty, return the current module
-		return current_module(w);
+	CodeFrame::List::iterator it(q.begin());
+	while (it != q.end()) {
+		if ((*it)->proc == proc) {
+			it = q.erase(it);
+		} else {
+			++it;
+		}
 	}
+}
 
-	ModuleMap::const_iterator it(w.module.find(modname));
-	if (it != w.module.end()) {
-		return it->second;
+/**
+ * Move a process and all of its frames from one worker to another
+ *
+ * Must be called from the src worker's thread while it has no
+ * current frame. The frames are handed to dst before they're taken
+ * off of src so the process is never missing from both workers.
+ */
+void migrate_process(Worker &src, Worker &dst, ProcessRoot *proc)
+{
+	CodeFrame::List moving;
+	CodeFrame::List::const_iterator it;
+	for (int p(0); p<NUM_PRIORITIES; ++p) {
+		const RunQueue &q(src.runq[p]);
+		for (it=q.fresh->begin(); it!=q.fresh->end(); ++it) {
+			if ((*it)->proc == proc) {
+				moving.push_back(*it);
+			}
+		}
+		for (it=q.stale->begin(); it!=q.stale->end(); ++it) {
+			if ((*it)->proc == proc) {
+				moving.push_back(*it);
+			}
+		}
 	}
-	it = w.app.module.find(modname);
-	if (it != w.app.module.end()) {
-		w.module[modname] = it->second;
-		return it->second;
+	int moved_io(0);
+	std::set< CodeFrame * >::iterator io(src.iowait.begin());
+	while (io != src.iowait.end()) {
+		if ((*io)->proc != proc) {
+			++io;
+			continue;
+		}
+		// stop watching here before dst starts watching
+		src.ioengine->unwatch(*io);
+		moving.push_back(*io);
+		src.iowait.erase(io++);
+		++moved_io;
 	}
-	return NULL;
+
+	// counted until dst has the frames queued
+	__atomic_add_fetch(&src.app.live, 1, __ATOMIC_RELAXED);
+	pthread_spin_lock(&dst.inbox_lock);
+	dst.inbox_proc.push_back(proc);
+	dst.inbox.splice(dst.inbox.end(), moving);
+	pthread_spin_unlock(&dst.inbox_lock);
+	dst.ioengine->wake();
+
+	for (int p(0); p<NUM_PRIORITIES; ++p) {
+		remove_frames(*src.runq[p].fresh, proc);
+		remove_frames(*src.runq[p].stale, proc);
+	}
+	src.iocount -= moved_io;
+	src.process.erase(proc->pid);
+	__atomic_add_fetch(&src.stats.migrated_out, 1, __ATOMIC_RELAXED);
 }
 
-const QbrtFunction * find_override(Worker &w, const char *protocol_mod
-		, const char *protocol_name, const char *funcname
-		, const string &param_types)
+/**
+ * Does the process have io in progress that can't be moved
+ * to another worker? Parked frames stay put too.
+ */
+static bool io_pinned(const Worker &w, const ProcessRoot *proc)
 {
-	ModuleMap::const_iterator it(w.module.begin());
-	for (; it!=w.module.end(); ++it) {
-		const QbrtFunction *f(it->second->fetch_override(protocol_mod
-				, protocol_name, funcname, param_types));
-		if (f) {
-			return f;
+	std::set< CodeFrame * >::const_iterator it(w.iowait.begin());
+	for (; it!=w.iowait.end(); ++it) {
+		if ((*it)->proc != proc) {
+			continue;
+		}
+		// blocking io comes back to this worker when it's done
+		if (!w.ioengine->migratable() || (*it)->io->blocking()) {
+			return true;
 		}
 	}
-	return NULL;
+	SleepMap::const_iterator s(w.sleepers.begin());
+	for (; s!=w.sleepers.end(); ++s) {
+		if (s->second->proc == proc) {
+			return true;
+		}
+	}
+	CodeFrame::List::const_iterator r(w.receivers.begin());
+	for (; r!=w.receivers.end(); ++r) {
+		if ((*r)->proc == proc) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Hand a process to the worker the balancer picked, if it asked for one
+ */
+static void migrate_out(Worker &w)
+{
+	WorkerID dst_id(__atomic_exchange_n(&w.migrate_to, 0
+				, __ATOMIC_ACQ_REL));
+	Application::WorkerMap::iterator dst(w.app.worker.find(dst_id));
+	if (dst == w.app.worker.end() || dst->second == &w) {
+		return;
+	}
+	// the most recently rotated task is most likely to want the cpu
+	CodeFrame *cf = NULL;
+	for (int p(0); !cf && p<NUM_PRIORITIES; ++p) {
+		if (!w.runq[p].stale->empty()) {
+			cf = w.runq[p].stale->back();
+		} else if (!w.runq[p].fresh->empty()) {
+			cf = w.runq[p].fresh->back();
+		}
+	}
+	if (!cf || !cf->proc || cf->proc->owner != &w) {
+		// forks from processes on other workers stay put
+		return;
+	}
+	if (io_pinned(w, cf->proc)) {
+		// its io has to finish here first
+		return;
+	}
+	migrate_process(w, *dst->second, cf->proc);
 }
 
-const CFunction * find_c_override(Worker &w, const std::string &protomod
-		, const std::string &protoname, const std::string &name
-		, const std::string &param_types)
+/**
+ * Queue a new fork on whichever worker has the least to do,
+ * preferring this one when it's a tie
+ */
+void schedule_fork(Worker &w, ParallelPath *pp)
 {
-	const CFunction *cf;
-	ModuleMap::const_iterator it(w.module.begin());
-	for (; it != w.module.end(); ++it) {
-		cf = fetch_c_override(*it->second, protomod
-				, protoname, name, param_types);
-		if (cf) {
-			return cf;
+	Worker *target(&w);
+	int32_t least(w.queued());
+	Application::WorkerMap::iterator it(w.app.worker.begin());
+	for (; it!=w.app.worker.end(); ++it) {
+		if (it->second == &w) {
+			continue;
 		}
+		// other workers' counts are only as fresh as their last
+		// findtask, only move it if one is strictly less busy
+		int32_t queued(__atomic_load_n(&it->second->stats.queued
+					, __ATOMIC_RELAXED));
+		if (queued < least) {
+			target = it->second;
+			least = queued;
+		}
+	}
+	if (target == &w) {
+		w.runq[pp->proc->priority].fresh->push_back(pp);
+		return;
 	}
-	return find_c_override(w.app, protomod, protoname, name, param_types);
+	pp->cftype = CFT_REMOTE_FORK;
+	pthread_spin_lock(&target->inbox_lock);
+	target->inbox.push_back(pp);
+	pthread_spin_unlock(&target->inbox_lock);
+	target->ioengine->wake();
 }
 
-const Function * find_default_function(Worker &w, const Function &func)
+/**
+ * Pick the highest priority queue that has work, unless a lower
+ * priority queue has been passed over too many times already
+ */
+static RunQueue * pick_queue(Worker &w)
 {
-	if (func.fcontext() != PFC_OVERRIDE) {
-		return NULL; // do nothing here
+	RunQueue *pick = NULL;
+	for (int p(0); p<NUM_PRIORITIES; ++p) {
+		RunQueue &q(w.runq[p]);
+		if (q.empty()) {
+			continue;
+		}
+		if (!pick) {
+			pick = &q;
+		} else if (++q.passed >= STARVATION_LIMIT) {
+			pick = &q;
+		}
 	}
+	if (pick) {
+		pick->passed = 0;
+	}
+	return pick;
+}
 
-	const char *proto_mod = func.protocol_module();
-	const Module *mod(find_module(w, proto_mod));
-	if (!mod) {
-		return NULL;
+/**
+ * Write out whatever output this worker's tasks have buffered
+ */
+void flush_output(Worker &w)
+{
+	std::set< Stream * >::iterator it(w.unflushed.begin());
+	while (it != w.unflushed.end()) {
+		if ((*it)->flush()) {
+			w.unflushed.erase(it++);
+			__atomic_sub_fetch(&w.app.live, 1, __ATOMIC_RELEASE);
+		} else {
+			++it;
+		}
+	}
+}
+
+/**
+ * Buffered output keeps the application going until it's written,
+ * even after the process that wrote it has exited
+ */
+void add_unflushed(Worker &w, Stream *s)
+{
+	if (w.unflushed.insert(s).second) {
+		__atomic_add_fetch(&w.app.live, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void remove_unflushed(Worker &w, Stream *s)
+{
+	if (w.unflushed.erase(s)) {
+		__atomic_sub_fetch(&w.app.live, 1, __ATOMIC_RELEASE);
+	}
+}
+
+void findtask(Worker &w)
+{
+	// output from the last task goes out before the next one starts
+	flush_output(w);
+	receive_processes(w);
+	if (__atomic_load_n(&w.migrate_to, __ATOMIC_ACQUIRE)) {
+		migrate_out(w);
+	}
+	__atomic_store_n(&w.stats.queued, w.queued(), __ATOMIC_RELAXED);
+	RunQueue *q = pick_queue(w);
+	if (!q) {
+		// all tasks are waiting on io
+		return;
+	}
+	if (q->fresh->empty()) {
+		// out of fresh, swap fresh and stale
+		CodeFrame::List *tmp = q->fresh;
+		q->fresh = q->stale;
+		q->stale = tmp;
+	}
+	// move the first fresh task to task
+	w.current = q->fresh->front();
+	q->fresh->pop_front();
+	// each newly picked task gets a full time slice
+	w.reductions = __atomic_load_n(&w.app.reduction_budget
+			, __ATOMIC_RELAXED);
+}
+
+void charge_reductions(Worker &w, int32_t cost)
+{
+	w.reductions -= cost;
+	// only this thread writes it, the balancer just reads it
+	__atomic_store_n(&w.stats.reductions, w.stats.reductions + cost
+			, __ATOMIC_RELAXED);
+	w.current->proc->reductions += cost;
+}
+
+const Module * find_module(Worker &w, const std::string &modname)
+{
+	if (modname == "./") {
+		// if the module name is empty, return the current module
+		return current_module(w);
 	}
 
-	const char *proto_name = func.protocol_name();
-	return mod->fetch_protocol_function(proto_name, func.name());
+	ModuleMap::const_iterator it(w.module.find(modname));
+	if (it != w.module.end()) {
+		return it->second;
+	}
+	const Module *mod(find_app_module(w.app, modname));
+	if (mod) {
+		w.module[modname] = mod;
+	}
+	return mod;
 }
 
 const Module * load_module(Worker &w, const string &objname)
@@ -222,59 +691,218 @@ const Module * load_module(Worker &w, const string &objname)
 	if (it != w.module.end()) {
 		return it->second;
 	}
-	const Module *mod = find_app_module(w.app, objname);
-	if (mod) {
-		w.module[objname] = mod;
-		return mod;
+	const Module *mod = load_module(w.app, objname);
+	if (!mod) {
+		return NULL;
+	}
+	if (!__atomic_load_n(&mod->linked, __ATOMIC_ACQUIRE)) {
+		// only modules that weren't imported get here
+		preload_modules(w.app, *mod);
+		link_modules(w.app);
+	}
+	if (mod->link_failed) {
+		// link_modules already said what's missing
+		return NULL;
 	}
-	mod = read_module(objname);
 	w.module[objname] = mod;
-	load_module(w.app, mod);
 	return mod;
 }
 
+/**
+ * Give a new process to a worker. Called from the application thread
+ * so it goes through the worker's inbox.
+ */
 static void assign_process(Worker &w, ProcessRoot *proc)
 {
-	proc->owner = &w;
-	w.process[proc->pid] = proc;
-	w.stale->push_back(proc->call);
+	pthread_spin_lock(&w.inbox_lock);
+	w.inbox_proc.push_back(proc);
+	w.inbox.push_back(proc->call);
+	pthread_spin_unlock(&w.inbox_lock);
+	// it might be waiting on io w/ nothing else to do
+	w.ioengine->wake();
 }
 
 void iopush(Worker &w)
 {
-	// add this io
-	StreamIO &io(*w.current->io);
-	epoll_event ev;
-	ev.events = io.events;
-	ev.data.ptr = w.current;
-	epoll_ctl(w.epfd, EPOLL_CTL_ADD, io.stream->fd, &ev);
-	++w.iocount;
-	w.current = NULL;
+	// keep going if the io could be done right away
+	if (!iowatch(w, w.current)) {
+		w.current = NULL;
+	}
 }
 
 void iopop(Worker &w, CodeFrame *cf)
 {
-	epoll_ctl(w.epfd, EPOLL_CTL_DEL, cf->io->stream->fd, NULL);
-	--w.iocount;
+	w.iowait.erase(cf);
 	cf->io_pop();
 	cf->cfstate = CFS_READY;
-	w.stale->push_back(cf);
+	requeue(w, cf);
+	// only after it's queued so the worker never looks empty
+	--w.iocount;
+}
+
+int64_t clock_usec()
+{
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * Hold a frame that's waiting on a timer or a message
+ */
+static void park(Worker &w, CodeFrame *cf)
+{
+	if (cf->deadline) {
+		w.sleepers.insert(SleepMap::value_type(cf->deadline, cf));
+	}
+	if (cf->cfstate == CFS_RECVWAIT) {
+		w.receivers.push_back(cf);
+	}
+}
+
+static void unpark(Worker &w, CodeFrame *cf)
+{
+	if (cf->deadline) {
+		SleepMap::iterator it(w.sleepers.lower_bound(cf->deadline));
+		for (; it!=w.sleepers.end() && it->first==cf->deadline; ++it) {
+			if (it->second == cf) {
+				w.sleepers.erase(it);
+				break;
+			}
+		}
+	}
+	if (cf->cfstate == CFS_RECVWAIT) {
+		w.receivers.remove(cf);
+	} else {
+		// a recv checks its own deadline when it runs again
+		cf->deadline = 0;
+	}
+	cf->cfstate = CFS_READY;
+	requeue(w, cf);
+}
+
+uint64_t start_ticker(Worker &w, uint64_t pid, int64_t interval_ms)
+{
+	uint64_t id(__sync_add_and_fetch(&w.app.ticker_count, 1));
+	int64_t interval(interval_ms * 1000);
+	pthread_spin_lock(&w.ticker_lock);
+	w.tickers.insert(TickerMap::value_type(clock_usec() + interval
+				, Ticker(id, pid, interval)));
+	pthread_spin_unlock(&w.ticker_lock);
+	return id;
+}
+
+bool cancel_ticker(Application &app, uint64_t id)
+{
+	bool found(false);
+	Application::WorkerMap::iterator w(app.worker.begin());
+	for (; !found && w!=app.worker.end(); ++w) {
+		Worker &wk(*w->second);
+		pthread_spin_lock(&wk.ticker_lock);
+		TickerMap::iterator it(wk.tickers.begin());
+		for (; it!=wk.tickers.end(); ++it) {
+			if (it->second.id == id) {
+				wk.tickers.erase(it);
+				found = true;
+				break;
+			}
+		}
+		pthread_spin_unlock(&wk.ticker_lock);
+	}
+	return found;
+}
+
+/**
+ * Send the ticks that are due. A ticker whose process can't be
+ * found is dropped. Missed ticks aren't made up, the next one is
+ * a full interval away.
+ */
+static void fire_tickers(Worker &w, int64_t now)
+{
+	pthread_spin_lock(&w.ticker_lock);
+	while (!w.tickers.empty() && w.tickers.begin()->first <= now) {
+		TickerMap::iterator it(w.tickers.begin());
+		Ticker t(it->second);
+		int64_t next(it->first + t.interval);
+		w.tickers.erase(it);
+		qbrt_value tick;
+		qbrt_value::i(tick, t.id);
+		if (!send_msg(w.app, t.pid, tick)) {
+			continue;
+		}
+		if (next <= now) {
+			next = now + t.interval;
+		}
+		w.tickers.insert(TickerMap::value_type(next, t));
+	}
+	pthread_spin_unlock(&w.ticker_lock);
+}
+
+/**
+ * Requeue parked frames that have a message or whose deadline
+ * has passed
+ */
+static void wake_parked(Worker &w)
+{
+	CodeFrame::List::iterator r(w.receivers.begin());
+	while (r != w.receivers.end()) {
+		CodeFrame *cf(*r++);
+		if (!cf->proc->recv.empty()) {
+			unpark(w, cf);
+		}
+	}
+	int64_t now(clock_usec());
+	while (!w.sleepers.empty() && w.sleepers.begin()->first <= now) {
+		unpark(w, w.sleepers.begin()->second);
+	}
+	fire_tickers(w, now);
+}
+
+/**
+ * How long to wait on io, in milliseconds, before the next timer
+ * is due
+ */
+static int wait_timeout(Worker &w)
+{
+	int64_t next(-1);
+	if (!w.sleepers.empty()) {
+		next = w.sleepers.begin()->first;
+	}
+	pthread_spin_lock(&w.ticker_lock);
+	if (!w.tickers.empty()
+			&& (next < 0 || w.tickers.begin()->first < next)) {
+		next = w.tickers.begin()->first;
+	}
+	pthread_spin_unlock(&w.ticker_lock);
+	if (next < 0) {
+		return IO_WAIT_TIMEOUT;
+	}
+	// round up so it doesn't wake just before it's due
+	int64_t ms((next - clock_usec() + 999) / 1000);
+	if (ms <= 0) {
+		return 0;
+	}
+	return ms < IO_WAIT_TIMEOUT ? ms : IO_WAIT_TIMEOUT;
 }
 
 void iowork(Worker &w)
 {
-	epoll_event events[MAX_EPOLL_EVENTS];
-	int timeout(w.fresh->empty() && w.stale->empty() ? 100 : 0);
-	int fdcnt(epoll_wait(w.epfd, events, MAX_EPOLL_EVENTS, timeout));
-	if (fdcnt == -1) {
-		perror("epoll_wait");
-		return;
+	CodeFrame::List done;
+	wake_parked(w);
+	int timeout(w.runnable() ? 0 : wait_timeout(w));
+	if (timeout) {
+		// the io being waited on might be a reply to this output
+		flush_output(w);
 	}
-	for (int i(0); i<fdcnt; ++i) {
-		CodeFrame *cf = static_cast< CodeFrame * >(events[i].data.ptr);
-		cf->io->handle();
-		iopop(w, cf);
+	w.ioengine->wait(done, timeout);
+	pthread_spin_lock(&w.inbox_lock);
+	done.splice(done.end(), w.iodone);
+	pthread_spin_unlock(&w.inbox_lock);
+	CodeFrame::List::iterator it(done.begin());
+	for (; it!=done.end(); ++it) {
+		iopop(w, *it);
 	}
+	wake_parked(w);
 }
 
 void execute_instruction(Worker &, const instruction &);
@@ -296,31 +924,53 @@ void gotowork(Worker &w)
 			qtp.tv_nsec = 2000;
 			nanosleep(&qtp, NULL);
 			sched_yield();
+			if (w.waiting()) {
+				iowork(w);
+			}
 			findtask(w);
 			continue;
 		}
 
 		const instruction &i(frame_instruction(*w.current));
+		charge_reductions(w, 1);
 		execute_instruction(w, i);
 
 		if (w.current->io) {
 			iopush(w);
 		}
-		if (w.iocount > 0) {
+		// check on io when switching tasks rather than after
+		// every instruction
+		bool switching(!w.current || w.reductions <= 0
+				|| w.current->cfstate != CFS_READY);
+		if (switching && w.waiting()) {
 			iowork(w);
 			if (!w.current) {
 				findtask(w);
 			}
 		}
+		if (!w.current) {
+			continue;
+		}
 
 		switch (w.current->cfstate) {
 			case CFS_READY:
-				// continue as normal
+				if (w.reductions <= 0) {
+					// time slice is used up, go to the back
+					// of the line and let something else run
+					requeue(w, w.current);
+					w.current = NULL;
+					findtask(w);
+				}
 				break;
 			case CFS_IOWAIT:
 			case CFS_NEW:
 			case CFS_PEERWAIT:
-				w.stale->push_back(w.current);
+				requeue(w, w.current);
+				w.current = NULL;
+				break;
+			case CFS_TIMEWAIT:
+			case CFS_RECVWAIT:
+				park(w, w.current);
 				w.current = NULL;
 				break;
 			case CFS_FAILED:
@@ -345,73 +995,392 @@ void * launch_worker(void *void_worker)
 Application::Application()
 : next_workerid(1)
 , pid_count(0)
+, ticker_count(0)
+, balance_rounds(0)
+, migrations(0)
+, fileio(new FileIoPool(FILE_IO_THREADS))
+, reduction_budget(DEFAULT_REDUCTION_BUDGET)
+, live(0)
 , running(true)
 {
 	pthread_spin_init(&application_lock, PTHREAD_PROCESS_PRIVATE);
+	pthread_mutex_init(&module_lock, NULL);
+	pthread_mutex_init(&link_lock, NULL);
+	pthread_rwlock_init(&dispatch_lock, NULL);
 }
 
 Application::~Application()
 {
 	pthread_spin_destroy(&application_lock);
+	pthread_mutex_destroy(&module_lock);
+	pthread_mutex_destroy(&link_lock);
+	pthread_rwlock_destroy(&dispatch_lock);
 }
 
 const Module * find_app_module(Application &app, const string &modname)
 {
+	const Module *mod(NULL);
+	pthread_mutex_lock(&app.module_lock);
 	ModuleMap::iterator it;
 	it = app.module.find(modname);
-	if (it == app.module.end()) {
-		return NULL;
+	if (it != app.module.end()) {
+		mod = it->second;
 	}
-	return it->second;
+	pthread_mutex_unlock(&app.module_lock);
+	return mod;
 }
 
+/**
+ * The module is read w/o the lock so loads can run in parallel.
+ * If two threads read the same module, the first one in wins.
+ */
 const Module * load_module(Application &app, const string &modname)
 {
 	const Module *mod = find_app_module(app, modname);
 	if (mod) {
 		return mod;
 	}
-	mod = read_module(modname);
-	app.module[modname] = mod;
+	Module *loaded = read_module(modname);
+	if (!loaded) {
+		return NULL;
+	}
+	pthread_mutex_lock(&app.module_lock);
+	const Module *&slot(app.module[modname]);
+	if (!slot) {
+		slot = loaded;
+		loaded = NULL;
+	}
+	mod = slot;
+	pthread_mutex_unlock(&app.module_lock);
+	delete loaded;
 	return mod;
 }
 
 void load_module(Application &app, const Module *mod)
 {
+	pthread_mutex_lock(&app.module_lock);
 	app.module[mod->name] = mod;
+	pthread_mutex_unlock(&app.module_lock);
 }
 
-const CFunction * find_c_override(Application &app, const std::string &protomod
-		, const std::string &protoname, const std::string &name
-		, const std::string &param_types)
+struct ModuleLoader
 {
-	const CFunction *cf;
-	ModuleMap::const_iterator it(app.module.begin());
-	for (; it != app.module.end(); ++it) {
-		cf = fetch_c_override(*it->second, protomod
-				, protoname, name, param_types);
-		if (cf) {
-			return cf;
+	Application &app;
+	list< string > queue;
+	set< string > seen;
+	// loaders w/ a module in hand, which might import more
+	int busy;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+
+	ModuleLoader(Application &app)
+	: app(app)
+	, busy(0)
+	{
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&ready, NULL);
+	}
+
+	~ModuleLoader()
+	{
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&ready);
+	}
+
+	/** Queue the imports that haven't been seen yet. Call w/ lock. */
+	void enqueue(const vector< string > &names)
+	{
+		vector< string >::const_iterator it(names.begin());
+		for (; it!=names.end(); ++it) {
+			if (seen.insert(*it).second) {
+				queue.push_back(*it);
+			}
+		}
+	}
+};
+
+static void * run_module_loader(void *void_loader)
+{
+	ModuleLoader &loader(*static_cast< ModuleLoader * >(void_loader));
+	pthread_mutex_lock(&loader.lock);
+	for (;;) {
+		while (loader.queue.empty() && loader.busy) {
+			pthread_cond_wait(&loader.ready, &loader.lock);
 		}
+		if (loader.queue.empty()) {
+			// nothing left and nobody loading anything that
+			// could add more
+			break;
+		}
+		string modname(loader.queue.front());
+		loader.queue.pop_front();
+		++loader.busy;
+		pthread_mutex_unlock(&loader.lock);
+
+		vector< string > imports;
+		const Module *mod(load_module(loader.app, modname));
+		if (mod) {
+			module_imports(*mod, imports);
+		}
+
+		pthread_mutex_lock(&loader.lock);
+		loader.enqueue(imports);
+		--loader.busy;
+		pthread_cond_broadcast(&loader.ready);
 	}
+	pthread_mutex_unlock(&loader.lock);
 	return NULL;
 }
 
+void preload_modules(Application &app, const Module &mod)
+{
+	ModuleLoader loader(app);
+	vector< string > imports;
+	module_imports(mod, imports);
+	loader.seen.insert(mod.name);
+	loader.enqueue(imports);
+	if (loader.queue.empty()) {
+		return;
+	}
+
+	// the calling thread is a loader too
+	vector< pthread_t > threads;
+	for (int i(1); i<LOADER_THREADS; ++i) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, run_module_loader, &loader)
+				!= 0) {
+			perror("module loader thread");
+			break;
+		}
+		threads.push_back(thread);
+	}
+	run_module_loader(&loader);
+	vector< pthread_t >::iterator it(threads.begin());
+	for (; it!=threads.end(); ++it) {
+		pthread_join(*it, NULL);
+	}
+}
+
+static string dispatch_key(const Function &f)
+{
+	const char *protomod(f.protocol_module());
+	if (strcmp(protomod, "./") == 0) {
+		protomod = f.mod->name.c_str();
+	}
+	string key(protomod);
+	key += '/';
+	key += f.protocol_name();
+	key += '/';
+	key += f.name();
+	return key;
+}
+
+/**
+ * Add a protocol function or an override to its dispatch table.
+ * qbrt overrides win over C overrides for the same types, and
+ * otherwise the first one loaded wins.
+ */
+static void add_dispatch(Application &app, const Function &f
+		, const string &param_types)
+{
+	ProtocolDispatch &d(app.dispatch[dispatch_key(f)]);
+	if (f.fcontext() != PFC_OVERRIDE) {
+		d.fallback = &f;
+	} else if (!f.cfunc() && param_types.find("*/") != string::npos) {
+		d.pattern.push_back(ProtocolDispatch::Pattern(param_types, &f));
+	} else {
+		const Function *&slot(d.exact[param_types]);
+		if (!slot || (slot->cfunc() && !f.cfunc())) {
+			slot = &f;
+		}
+	}
+}
+
+const Function * dispatch_function(Application &app, const Function &f
+		, const string &value_types)
+{
+	const Function *result(NULL);
+	pthread_rwlock_rdlock(&app.dispatch_lock);
+	DispatchMap::const_iterator d(app.dispatch.find(dispatch_key(f)));
+	if (d != app.dispatch.end()) {
+		const ProtocolDispatch &pd(d->second);
+		map< string, const Function * >::const_iterator exact;
+		exact = pd.exact.find(value_types);
+		if (exact != pd.exact.end() && !exact->second->cfunc()) {
+			result = exact->second;
+		}
+		list< ProtocolDispatch::Pattern >::const_iterator p;
+		p = pd.pattern.begin();
+		for (; !result && p!=pd.pattern.end(); ++p) {
+			if (match_param_types(value_types, p->first)) {
+				result = p->second;
+			}
+		}
+		if (!result && exact != pd.exact.end()) {
+			result = exact->second;
+		}
+		if (!result) {
+			result = pd.fallback;
+		}
+	}
+	pthread_rwlock_unlock(&app.dispatch_lock);
+	return result;
+}
+
+/**
+ * Point a ModSym at what it refers to. Returns false and says why
+ * if it can't be found.
+ */
+static bool link_modsym(Application &app, Module &mod, uint16_t idx
+		, uint8_t opcode, const char *caller)
+{
+	ModSymLink &link(mod.resource.link[idx]);
+	if (link.qbrt || link.cfunc || link.construct) {
+		// already linked in the image or by an earlier instruction
+		return true;
+	}
+	const ResourceTable &tbl(mod.resource);
+	const ModSym &modsym(fetch_modsym(tbl, idx));
+	const char *modname(fetch_string(tbl, modsym.mod_name()));
+	const char *symname(fetch_string(tbl, modsym.sym_name()));
+	const Module *target;
+	if (strcmp(modname, "./") == 0) {
+		target = &mod;
+	} else {
+		target = find_app_module(app, modname);
+	}
+	if (!target) {
+		cerr << "cannot link " << mod.name << '/' << caller
+			<< ": no module " << modname << endl;
+		return false;
+	}
+
+	link.module = target;
+	if (opcode == OP_LCONSTRUCT) {
+		link.construct = find_construct(*target, symname);
+		if (!link.construct) {
+			cerr << "cannot link " << mod.name << '/' << caller
+				<< ": no construct " << target->name << '/'
+				<< symname << endl;
+			return false;
+		}
+		link.type = indexed_datatype(*target
+				, link.construct->datatype_idx());
+		return true;
+	}
+	link.qbrt = target->fetch_function(symname);
+	if (!link.qbrt) {
+		link.cfunc = fetch_c_function(*target, symname);
+	}
+	if (!(link.qbrt || link.cfunc)) {
+		cerr << "cannot link " << mod.name << '/' << caller
+			<< ": no function " << target->name << '/'
+			<< symname << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Link every lfunc and lconstruct in the module's code
+ */
+static bool link_module(Application &app, Module &mod)
+{
+	const ResourceTable &tbl(mod.resource);
+	bool linked(true);
+	pthread_rwlock_wrlock(&app.dispatch_lock);
+	multimap< string, CFunction >::const_iterator cf;
+	for (cf=mod.cfunction.begin(); cf!=mod.cfunction.end(); ++cf) {
+		if (cf->second.fcontext() == PFC_OVERRIDE) {
+			add_dispatch(app, cf->second, cf->second.param_types);
+		}
+	}
+	for (uint16_t i(1); i<tbl.resource_count; ++i) {
+		if (tbl.type(i) != RESOURCE_FUNCTION) {
+			continue;
+		}
+		const FunctionHeader *f = tbl.ptr< FunctionHeader >(i);
+		if (PFC_TYPE(f->fcontext) != FCT_TRADITIONAL) {
+			add_dispatch(app, *mod.function_at(i)
+					, fetch_string(tbl, f->param_types_idx()));
+		}
+		if (f->fcontext == PFC_ABSTRACT) {
+			continue;
+		}
+		const char *fname(fetch_string(tbl, f->name_idx()));
+		uint32_t size(tbl.size(i) - FunctionHeader::SIZE
+				- f->argc * sizeof(ParamResource));
+		const uint8_t *code(f->code());
+		for (uint32_t pc(0); pc<size; pc+=isize(code[pc])) {
+			uint16_t modsym;
+			if (code[pc] == OP_LFUNC) {
+				modsym = ((const lfunc_instruction *)
+						(code + pc))->modsym;
+			} else if (code[pc] == OP_LCONSTRUCT) {
+				modsym = ((const lconstruct_instruction *)
+						(code + pc))->modsym;
+			} else {
+				continue;
+			}
+			if (!link_modsym(app, mod, modsym, code[pc], fname)) {
+				linked = false;
+			}
+		}
+	}
+	pthread_rwlock_unlock(&app.dispatch_lock);
+	mod.link_failed = !linked;
+	// workers can use the links once they see this
+	__atomic_store_n(&mod.resource.link_ready, true, __ATOMIC_RELEASE);
+	__atomic_store_n(&mod.linked, true, __ATOMIC_RELEASE);
+	return linked;
+}
+
+bool link_modules(Application &app)
+{
+	pthread_mutex_lock(&app.link_lock);
+	vector< Module * > unlinked;
+	pthread_mutex_lock(&app.module_lock);
+	ModuleMap::const_iterator it(app.module.begin());
+	for (; it!=app.module.end(); ++it) {
+		if (!it->second->linked) {
+			unlinked.push_back(const_cast< Module * >(it->second));
+		}
+	}
+	pthread_mutex_unlock(&app.module_lock);
+
+	bool linked(true);
+	vector< Module * >::iterator m(unlinked.begin());
+	for (; m!=unlinked.end(); ++m) {
+		if (!link_module(app, **m)) {
+			linked = false;
+		}
+	}
+	pthread_mutex_unlock(&app.link_lock);
+	return linked;
+}
+
 bool send_msg(Application &app, uint64_t pid, const qbrt_value &src)
 {
 	ProcessRoot::Map::iterator it(app.recv.find(pid));
 	if (it == app.recv.end()) {
 		return false;
 	}
-	it->second->recv.push(qbrt_value::dup(src));
+	ProcessRoot &proc(*it->second);
+	proc.recv.push(qbrt_value::dup(src));
+	if (proc.owner) {
+		// in case it's parked waiting for this
+		proc.owner->ioengine->wake();
+	}
 	return true;
 }
 
-ProcessRoot * new_process(Application &app, FunctionCall *call)
+ProcessRoot * new_process(Application &app, FunctionCall *call
+		, Priority pri)
 {
 	pthread_spin_lock(&app.application_lock);
-	ProcessRoot *proc = new ProcessRoot(++app.pid_count, call);
+	ProcessRoot *proc = new ProcessRoot(++app.pid_count, call, pri);
 	call->proc = proc;
+	__atomic_add_fetch(&app.live, 1, __ATOMIC_RELAXED);
 	app.newproc[proc->pid] = proc;
 	app.recv[proc->pid] = proc;
 	pthread_spin_unlock(&app.application_lock);
@@ -436,12 +1405,78 @@ void cycle_distributor(Application::WorkerMap::iterator &it, Application &app)
 
 void distribute_work(Application::WorkerMap::iterator &it, Application &app)
 {
+	// workers add to newproc while this runs
+	pthread_spin_lock(&app.application_lock);
 	while (!app.newproc.empty() && it != app.worker.end()) {
 		ProcessRoot::Map::iterator proc(app.newproc.begin());
 		assign_process(*it->second, proc->second);
 		app.newproc.erase(proc);
 		cycle_distributor(it, app);
 	}
+	pthread_spin_unlock(&app.application_lock);
+}
+
+/**
+ * Compare the workers' queues and ask the busiest one to give a
+ * process to the idlest one if they're far enough apart.
+ *
+ * Queue length is the primary measure. Reduction rate breaks ties
+ * and keeps processes from moving off of a worker that isn't
+ * actually running anything.
+ */
+void balance_workers(Application &app)
+{
+	++app.balance_rounds;
+	Worker *busiest(NULL);
+	Worker *idlest(NULL);
+	int32_t most(0);
+	int32_t least(0);
+	Application::WorkerMap::iterator it(app.worker.begin());
+	for (; it!=app.worker.end(); ++it) {
+		Worker &w(*it->second);
+		// the worker keeps writing these while they're read here
+		uint64_t total(__atomic_load_n(&w.stats.reductions
+					, __ATOMIC_RELAXED));
+		int32_t queued(__atomic_load_n(&w.stats.queued
+					, __ATOMIC_RELAXED));
+		w.stats.reduction_rate = total - w.stats.balanced_reductions;
+		w.stats.balanced_reductions = total;
+
+		if (!busiest || queued > most
+				|| (queued == most
+				&& w.stats.reduction_rate
+					> busiest->stats.reduction_rate))
+		{
+			busiest = &w;
+			most = queued;
+		}
+		if (!idlest || queued < least
+				|| (queued == least
+				&& w.stats.reduction_rate
+					< idlest->stats.reduction_rate))
+		{
+			idlest = &w;
+			least = queued;
+		}
+	}
+	if (!busiest || busiest == idlest) {
+		return;
+	}
+	if (most - least < BALANCE_THRESHOLD) {
+		return;
+	}
+	if (busiest->stats.reduction_rate == 0) {
+		// not running anything
+		return;
+	}
+	// the worker clears it when it's done w/ the last request
+	WorkerID none(0);
+	if (__atomic_compare_exchange_n(&busiest->migrate_to, &none
+				, idlest->id, false
+				, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+		++app.migrations;
+	}
 }
 
 void application_loop(Application &app)
@@ -451,21 +1486,35 @@ void application_loop(Application &app)
 	qtp.tv_nsec = 1000000;
 
 	Application::WorkerMap::iterator distributor(app.worker.begin());
-	Application::WorkerMap::iterator it;
-	for (;;) {
+	for (int pass(1);; ++pass) {
 		distribute_work(distributor, app);
-		bool all_empty(true);
-		for (it=app.worker.begin(); it!=app.worker.end(); ++it) {
-			if (!it->second->empty()) {
-				all_empty = false;
-				break;
-			}
+		if (pass % BALANCE_INTERVAL == 0) {
+			balance_workers(app);
 		}
-		if (all_empty) {
-			app.running = false;
+		// the workers keep their own state to themselves, so
+		// they count what's left to do in app.live
+		if (__atomic_load_n(&app.live, __ATOMIC_ACQUIRE) == 0) {
 			break;
-		} else {
-			nanosleep(&qtp, NULL);
 		}
+		nanosleep(&qtp, NULL);
+	}
+}
+
+void print_stats(std::ostream &out, const Application &app)
+{
+	out << "balance rounds: " << app.balance_rounds
+		<< ", migrations requested: " << app.migrations << endl;
+	Application::WorkerMap::const_iterator it(app.worker.begin());
+	for (; it!=app.worker.end(); ++it) {
+		const WorkerStats &stats(it->second->stats);
+		out << "worker " << it->first
+			<< " (" << it->second->ioengine->name() << ")"
+			<< ": reductions "
+			<< __atomic_load_n(&stats.reductions, __ATOMIC_RELAXED)
+			<< ", migrated in "
+			<< __atomic_load_n(&stats.migrated_in, __ATOMIC_RELAXED)
+			<< ", migrated out "
+			<< __atomic_load_n(&stats.migrated_out, __ATOMIC_RELAXED)
+			<< endl;
 	}
 }
@@ -0,0 +1,610 @@
+#include "qbrt/snapshot.h"
+#include "qbrt/module.h"
+#include "qbrt/schedule.h"
+#include "qbrt/function.h"
+#include "qbrt/type.h"
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+struct SnapshotWriter
+{
+	vector< const Module * > module;
+	map< const Module *, uint16_t > module_index;
+	// resource index by address, for each module as it's needed
+	map< const Module *, map< const uint8_t *, uint16_t > > resource;
+	// index of each construct, tuple and function already written
+	map< const void *, uint32_t > shared;
+	string heap;
+	bool failed;
+
+	SnapshotWriter()
+	: failed(false)
+	{}
+};
+
+struct SnapshotReader
+{
+	Application &app;
+	const Snapshot &snapshot;
+	const uint8_t *pos;
+	const uint8_t *end;
+	vector< qbrt_value > shared;
+
+	SnapshotReader(Application &a, const Snapshot &s)
+	: app(a)
+	, snapshot(s)
+	, pos(s.heap)
+	, end(s.heap + s.heap_size)
+	{}
+};
+
+
+/** The .qb bytes of a module, whether it came from a file or an image */
+static const uint8_t * module_bytes(const Module &mod, uint32_t &size)
+{
+	const ResourceTable &tbl(mod.resource);
+	size = tbl.index_offset() + tbl.resource_count * ResourceInfo::SIZE;
+	return tbl.data - ResourceTable::DATA_OFFSET;
+}
+
+static uint16_t resource_index(SnapshotWriter &w, const Module &mod
+		, const void *ptr)
+{
+	map< const uint8_t *, uint16_t > &index(w.resource[&mod]);
+	if (index.empty()) {
+		const ResourceTable &tbl(mod.resource);
+		for (uint16_t i(1); i<tbl.resource_count; ++i) {
+			index[tbl.ptr< uint8_t >(i)] = i;
+		}
+	}
+	map< const uint8_t *, uint16_t >::const_iterator it;
+	it = index.find((const uint8_t *) ptr);
+	return it == index.end() ? 0 : it->second;
+}
+
+static void write8(SnapshotWriter &w, uint8_t x)
+{
+	w.heap.push_back((char) x);
+}
+
+static void write16(SnapshotWriter &w, uint16_t x)
+{
+	x = htoqb16(x);
+	w.heap.append((const char *) &x, 2);
+}
+
+static void write32(SnapshotWriter &w, uint32_t x)
+{
+	x = htoqb32(x);
+	w.heap.append((const char *) &x, 4);
+}
+
+static void write64(SnapshotWriter &w, uint64_t x)
+{
+	x = htoqb64(x);
+	w.heap.append((const char *) &x, 8);
+}
+
+static void write_string(SnapshotWriter &w, const string &s)
+{
+	write32(w, s.size());
+	w.heap.append(s);
+}
+
+static void cannot_snapshot(SnapshotWriter &w, const string &what)
+{
+	cerr << "cannot snapshot " << what << endl;
+	w.failed = true;
+}
+
+/**
+ * Write a reference if the object has already been written. Otherwise
+ * give it the next index and return false so it's written out.
+ */
+static bool write_shared(SnapshotWriter &w, const void *obj)
+{
+	map< const void *, uint32_t >::const_iterator it(w.shared.find(obj));
+	if (it != w.shared.end()) {
+		write8(w, SNAPSHOT_SHARED);
+		write32(w, it->second);
+		return true;
+	}
+	uint32_t index(w.shared.size());
+	w.shared[obj] = index;
+	return false;
+}
+
+/**
+ * Bools and lists can be constructs from core and list, or primitives
+ * that qbrt makes itself
+ */
+static bool is_construct(const qbrt_value &v)
+{
+	switch (v.type->id) {
+		case VT_CONSTRUCT:
+			return true;
+		case VT_BOOL:
+			return v.type != &TYPE_BOOL;
+		case VT_LIST:
+			return v.type != &TYPE_LIST;
+	}
+	return false;
+}
+
+static void write_value(SnapshotWriter &, const qbrt_value &);
+
+static void write_construct(SnapshotWriter &w, const qbrt_value &v)
+{
+	const Construct &cons(*v.data.cons);
+	map< const Module *, uint16_t >::const_iterator mod;
+	mod = w.module_index.find(&cons.mod);
+	uint16_t idx(0);
+	if (mod != w.module_index.end()) {
+		idx = resource_index(w, cons.mod, &cons.resource);
+	}
+	if (!idx) {
+		cannot_snapshot(w, cons.mod.name +"/"+ cons.name());
+		return;
+	}
+	write8(w, VT_CONSTRUCT);
+	write16(w, mod->second);
+	write16(w, idx);
+	for (uint8_t i(0); i<cons.num_values(); ++i) {
+		write_value(w, cons.value(i));
+	}
+}
+
+static void write_function(SnapshotWriter &w, const function_value &f)
+{
+	const Function &func(*f.func);
+	write8(w, VT_FUNCTION);
+	if (func.cfunc()) {
+		if (func.fcontext() != PFC_NONE) {
+			cannot_snapshot(w, string("C override ") + func.name());
+			return;
+		}
+		write8(w, SNAPSHOT_C_FUNCTION);
+		write_string(w, func.mod->name);
+		write_string(w, func.name());
+	} else {
+		const QbrtFunction &qfunc(static_cast< const QbrtFunction & >(
+					func));
+		map< const Module *, uint16_t >::const_iterator mod;
+		mod = w.module_index.find(func.mod);
+		uint16_t idx(0);
+		if (mod != w.module_index.end()) {
+			idx = resource_index(w, *func.mod, qfunc.header);
+		}
+		if (!idx) {
+			cannot_snapshot(w, string("function ") + func.name());
+			return;
+		}
+		write8(w, SNAPSHOT_QBRT_FUNCTION);
+		write16(w, mod->second);
+		write16(w, idx);
+	}
+	write8(w, f.regc);
+	for (uint8_t i(0); i<f.regc; ++i) {
+		write_value(w, f.regv[i]);
+	}
+}
+
+static void write_value(SnapshotWriter &w, const qbrt_value &val)
+{
+	if (w.failed) {
+		return;
+	}
+	const qbrt_value &v(*follow_ref(const_cast< qbrt_value * >(&val)));
+	if (is_construct(v)) {
+		if (!write_shared(w, v.data.cons)) {
+			write_construct(w, v);
+		}
+		return;
+	}
+	switch (v.type->id) {
+		case VT_VOID:
+			write8(w, VT_VOID);
+			break;
+		case VT_BOOL:
+			write8(w, VT_BOOL);
+			write8(w, v.data.b);
+			break;
+		case VT_INT:
+			write8(w, VT_INT);
+			write64(w, v.data.i);
+			break;
+		case VT_FLOAT:
+		{
+			uint64_t bits;
+			memcpy(&bits, &v.data.fp, 8);
+			write8(w, VT_FLOAT);
+			write64(w, bits);
+			break;
+		}
+		case VT_STRING:
+			write8(w, VT_STRING);
+			write_string(w, *v.data.str);
+			break;
+		case VT_HASHTAG:
+			write8(w, VT_HASHTAG);
+			write_string(w, *v.data.hashtag);
+			break;
+		case VT_TUPLE:
+			if (write_shared(w, v.data.tuple)) {
+				break;
+			}
+			write8(w, VT_TUPLE);
+			write8(w, v.data.tuple->size);
+			for (uint8_t i(0); i<v.data.tuple->size; ++i) {
+				write_value(w, v.data.tuple->data[i]);
+			}
+			break;
+		case VT_FUNCTION:
+			if (!write_shared(w, v.data.f)) {
+				write_function(w, *v.data.f);
+			}
+			break;
+		default:
+			cannot_snapshot(w, "a " + v.type->module +"/"+ v.type->name);
+			break;
+	}
+}
+
+/**
+ * Each ModSym that's linked to a qbrt function gets an image link,
+ * the same as qbc writes them
+ */
+static void write_links(ofstream &out, SnapshotWriter &w, const Module &mod)
+{
+	const ResourceTable &tbl(mod.resource);
+	for (uint16_t i(0); i<tbl.resource_count; ++i) {
+		uint16_t link[2] = { htoqb16(IMAGE_NO_LINK), 0 };
+		const ModSymLink *ml(tbl.linked(i));
+		if (i && tbl.type(i) == RESOURCE_MODSYM && ml && ml->qbrt) {
+			const Module &target(*ml->qbrt->mod);
+			uint16_t fidx(resource_index(w, target
+						, ml->qbrt->header));
+			if (fidx) {
+				link[0] = htoqb16(w.module_index[&target]);
+				link[1] = htoqb16(fidx);
+			}
+		}
+		out.write((const char *) link, ImageLink::SIZE);
+	}
+}
+
+static uint32_t image_align(uint32_t offset)
+{
+	return (offset + IMAGE_ALIGN - 1) & ~(IMAGE_ALIGN - 1);
+}
+
+/**
+ * The image part is laid out the same as qbc --image does it, w/
+ * its offsets relative to the start of the image
+ */
+static void write_image(ofstream &out, SnapshotWriter &w)
+{
+	uint16_t count(w.module.size());
+	uint32_t links(ImageHeader::SIZE + count * ImageModule::SIZE);
+	uint32_t offset(links);
+	vector< const Module * >::const_iterator it;
+	for (it=w.module.begin(); it!=w.module.end(); ++it) {
+		offset += (*it)->resource.resource_count * ImageLink::SIZE;
+	}
+
+	ImageHeader hdr;
+	memcpy(hdr.magic, IMAGE_MAGIC, 4);
+	hdr._qbrt_version = htoqb32(QBRT_VERSION);
+	hdr._module_count = htoqb16(count);
+	hdr._main_module = htoqb16(0);
+	out.write((const char *) &hdr, ImageHeader::SIZE);
+
+	for (it=w.module.begin(); it!=w.module.end(); ++it) {
+		uint32_t size;
+		module_bytes(**it, size);
+		offset = image_align(offset);
+		ImageModule entry;
+		entry._offset = htoqb32(offset);
+		entry._size = htoqb32(size);
+		entry._links = htoqb32(links);
+		out.write((const char *) &entry, ImageModule::SIZE);
+		offset += size;
+		links += (*it)->resource.resource_count * ImageLink::SIZE;
+	}
+	for (it=w.module.begin(); it!=w.module.end(); ++it) {
+		write_links(out, w, **it);
+	}
+	static const char padding[IMAGE_ALIGN] = { 0 };
+	for (it=w.module.begin(); it!=w.module.end(); ++it) {
+		uint32_t pos(out.tellp());
+		pos -= SnapshotHeader::SIZE;
+		out.write(padding, image_align(pos) - pos);
+		uint32_t size;
+		const uint8_t *bytes(module_bytes(**it, size));
+		out.write((const char *) bytes, size);
+	}
+	uint32_t pos(out.tellp());
+	out.write(padding, image_align(pos) - pos);
+}
+
+bool write_snapshot(const string &path, Application &app, const Module &main
+		, const qbrt_value &warm)
+{
+	SnapshotWriter w;
+	// main goes first, like in an image
+	w.module_index[&main] = 0;
+	w.module.push_back(&main);
+	pthread_mutex_lock(&app.module_lock);
+	ModuleMap::const_iterator it(app.module.begin());
+	for (; it!=app.module.end(); ++it) {
+		const Module *mod(it->second);
+		// C modules have nothing to save
+		if (mod == &main || !mod->resource.data) {
+			continue;
+		}
+		w.module_index[mod] = w.module.size();
+		w.module.push_back(mod);
+	}
+	pthread_mutex_unlock(&app.module_lock);
+
+	write_value(w, warm);
+	if (w.failed) {
+		return false;
+	}
+
+	string tmp_path(path +".tmp");
+	ofstream out;
+	out.open(tmp_path.c_str(), ios::binary | ios::out);
+	if (!out) {
+		cerr << "error opening snapshot: " << tmp_path << endl;
+		return false;
+	}
+	SnapshotHeader hdr;
+	memset(&hdr, 0, SnapshotHeader::SIZE);
+	out.write((const char *) &hdr, SnapshotHeader::SIZE);
+	write_image(out, w);
+	uint32_t heap_offset(out.tellp());
+	out.write(w.heap.data(), w.heap.size());
+
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, 4);
+	hdr._qbrt_version = htoqb32(QBRT_VERSION);
+	hdr._heap_offset = htoqb32(heap_offset);
+	hdr._heap_size = htoqb32(w.heap.size());
+	out.seekp(0);
+	out.write((const char *) &hdr, SnapshotHeader::SIZE);
+	out.close();
+	if (!out || rename(tmp_path.c_str(), path.c_str()) < 0) {
+		cerr << "error writing snapshot: " << path << ": "
+			<< strerror(errno) << endl;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Like an image, the snapshot is mapped once and stays mapped for
+ * the life of the process
+ */
+bool read_snapshot(const string &path, Snapshot &snapshot)
+{
+	int fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+	if (fd < 0) {
+		cerr << "cannot open snapshot " << path << ": "
+			<< strerror(errno) << endl;
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		cerr << "cannot stat snapshot " << path << ": "
+			<< strerror(errno) & DIE;
+	}
+	size_t size(st.st_size);
+	if (size < SnapshotHeader::SIZE) {
+		cerr << "snapshot file is truncated: " << path & DIE;
+	}
+	void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		cerr << "cannot map snapshot " << path << ": "
+			<< strerror(errno) & DIE;
+	}
+
+	const uint8_t *input((const uint8_t *) mapping);
+	const SnapshotHeader *hdr((const SnapshotHeader *) input);
+	if (memcmp(hdr->magic, SNAPSHOT_MAGIC, 4) != 0) {
+		cerr << "not a snapshot: " << path & DIE;
+	}
+	if (hdr->qbrt_version() != QBRT_VERSION) {
+		cerr << "snapshot " << path << " is for qbrt version "
+			<< hdr->qbrt_version() << ", not " << QBRT_VERSION
+			<< ". take it again w/ qbrt --snapshot" & DIE;
+	}
+	size_t heap_offset(hdr->heap_offset());
+	if (heap_offset < SnapshotHeader::SIZE
+			|| heap_offset + hdr->heap_size() > size) {
+		cerr << "snapshot file is truncated: " << path & DIE;
+	}
+	snapshot.path = path;
+	snapshot.main = parse_image(path, input + SnapshotHeader::SIZE
+			, heap_offset - SnapshotHeader::SIZE, snapshot.module);
+	snapshot.heap = input + heap_offset;
+	snapshot.heap_size = hdr->heap_size();
+	return true;
+}
+
+static const uint8_t * read_bytes(SnapshotReader &r, uint32_t size)
+{
+	if (size > (uint32_t) (r.end - r.pos)) {
+		cerr << "snapshot heap is truncated: " << r.snapshot.path & DIE;
+	}
+	const uint8_t *bytes(r.pos);
+	r.pos += size;
+	return bytes;
+}
+
+static uint8_t read8(SnapshotReader &r)
+{
+	return *read_bytes(r, 1);
+}
+
+static uint16_t read16(SnapshotReader &r)
+{
+	return read16(read_bytes(r, 2));
+}
+
+static uint32_t read32(SnapshotReader &r)
+{
+	return read32(read_bytes(r, 4));
+}
+
+static uint64_t read64(SnapshotReader &r)
+{
+	uint64_t x;
+	memcpy(&x, read_bytes(r, 8), 8);
+	return qb64toh(x);
+}
+
+static string read_string(SnapshotReader &r)
+{
+	uint32_t size(read32(r));
+	return string((const char *) read_bytes(r, size), size);
+}
+
+/** Check that a heap index refers to the right kind of resource */
+static const Module & read_resource(SnapshotReader &r, uint16_t &idx
+		, uint16_t rtype)
+{
+	uint16_t modidx(read16(r));
+	idx = read16(r);
+	if (modidx >= r.snapshot.module.size()) {
+		cerr << "bad module in snapshot heap: " << modidx & DIE;
+	}
+	const Module &mod(*r.snapshot.module[modidx]);
+	if (idx == 0 || idx >= mod.resource.resource_count
+			|| mod.resource.type(idx) != rtype) {
+		cerr << "bad resource in snapshot heap: " << mod.name << '/'
+			<< idx & DIE;
+	}
+	return mod;
+}
+
+static void read_value(SnapshotReader &, qbrt_value &);
+
+static const Function * read_function(SnapshotReader &r)
+{
+	uint8_t kind(read8(r));
+	if (kind == SNAPSHOT_QBRT_FUNCTION) {
+		uint16_t idx;
+		const Module &mod(read_resource(r, idx, RESOURCE_FUNCTION));
+		return mod.function_at(idx);
+	}
+	string modname(read_string(r));
+	string fname(read_string(r));
+	const Module *mod(find_app_module(r.app, modname));
+	const CFunction *cfunc(mod ? fetch_c_function(*mod, fname) : NULL);
+	if (!cfunc) {
+		cerr << "cannot restore function " << modname << '/' << fname
+			<< " from snapshot" & DIE;
+	}
+	return cfunc;
+}
+
+static void read_value(SnapshotReader &r, qbrt_value &v)
+{
+	uint8_t tag(read8(r));
+	switch (tag) {
+		case VT_VOID:
+			qbrt_value::set_void(v);
+			break;
+		case VT_BOOL:
+			qbrt_value::b(v, read8(r));
+			break;
+		case VT_INT:
+			qbrt_value::i(v, (int64_t) read64(r));
+			break;
+		case VT_FLOAT:
+		{
+			uint64_t bits(read64(r));
+			double fp;
+			memcpy(&fp, &bits, 8);
+			qbrt_value::fp(v, fp);
+			break;
+		}
+		case VT_STRING:
+			qbrt_value::str(v, read_string(r));
+			break;
+		case VT_HASHTAG:
+			qbrt_value::hashtag(v, read_string(r));
+			break;
+		case VT_TUPLE:
+		{
+			Tuple *tup = new Tuple(read8(r));
+			qbrt_value::tuple(v, tup);
+			r.shared.push_back(v);
+			for (uint8_t i(0); i<tup->size; ++i) {
+				read_value(r, tup->data[i]);
+			}
+			break;
+		}
+		case VT_CONSTRUCT:
+		{
+			uint16_t idx;
+			const Module &mod(read_resource(r, idx
+						, RESOURCE_CONSTRUCT));
+			const ConstructResource &cr(
+					mod.resource.obj< ConstructResource >(idx));
+			Construct *cons = new Construct(mod, cr);
+			qbrt_value::construct(v
+					, indexed_datatype(mod, cr.datatype_idx())
+					, cons);
+			r.shared.push_back(v);
+			for (uint8_t i(0); i<cons->num_values(); ++i) {
+				read_value(r, cons->value(i));
+			}
+			break;
+		}
+		case VT_FUNCTION:
+		{
+			function_value *f = new function_value(read_function(r));
+			qbrt_value::f(v, f);
+			r.shared.push_back(v);
+			uint8_t regc(read8(r));
+			if (regc != f->regc) {
+				f->realloc(regc);
+			}
+			for (uint8_t i(0); i<regc; ++i) {
+				read_value(r, f->regv[i]);
+			}
+			break;
+		}
+		case SNAPSHOT_SHARED:
+		{
+			uint32_t index(read32(r));
+			if (index >= r.shared.size()) {
+				cerr << "bad shared value in snapshot heap: "
+					<< index & DIE;
+			}
+			v = r.shared[index];
+			break;
+		}
+		default:
+			cerr << "unknown value in snapshot heap: " << (int) tag
+				& DIE;
+	}
+}
+
+void restore_warm_value(Application &app, const Snapshot &snapshot
+		, qbrt_value &warm)
+{
+	SnapshotReader r(app, snapshot);
+	read_value(r, warm);
+}
@@ -0,0 +1,252 @@
+#include "io.h"
+#include "qbrt/function.h"
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+
+#define LISTEN_BACKLOG	128
+
+#define UNIX_PREFIX	"unix:"
+#define UNIX_PREFIX_LEN	5
+
+
+static bool is_unix_address(const string &address)
+{
+	return address.compare(0, UNIX_PREFIX_LEN, UNIX_PREFIX) == 0;
+}
+
+/**
+ * Fill in a Unix domain address. Returns false if the path
+ * doesn't fit.
+ */
+static bool unix_address(const string &address, sockaddr_un &addr)
+{
+	string path(address.substr(UNIX_PREFIX_LEN));
+	if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+	return true;
+}
+
+/**
+ * Parse a "<host>:<port>" address. Free the result w/ freeaddrinfo.
+ * This runs on the worker, so only numeric hosts and ports are taken,
+ * a name would mean a DNS lookup that could block it.
+ */
+static addrinfo * tcp_address(const string &address, bool passive)
+{
+	string::size_type colon(address.rfind(':'));
+	if (colon == string::npos) {
+		errno = EINVAL;
+		return NULL;
+	}
+	string host(address.substr(0, colon));
+	string port(address.substr(colon + 1));
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	if (passive) {
+		hints.ai_flags |= AI_PASSIVE;
+	}
+	addrinfo *result = NULL;
+	int err(getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str()
+				, &hints, &result));
+	if (err != 0) {
+		errno = (err == EAI_SYSTEM) ? errno : EADDRNOTAVAIL;
+		return NULL;
+	}
+	return result;
+}
+
+static int new_socket(int family)
+{
+	return socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+}
+
+ListenStream * listen_socket(const string &address)
+{
+	if (is_unix_address(address)) {
+		sockaddr_un addr;
+		if (!unix_address(address, addr)) {
+			return NULL;
+		}
+		// a socket file left behind by an earlier run can go,
+		// but don't remove anything else that's in the way
+		struct stat st;
+		if (lstat(addr.sun_path, &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) {
+				errno = EADDRINUSE;
+				return NULL;
+			}
+			unlink(addr.sun_path);
+		}
+		int fd(new_socket(AF_UNIX));
+		if (fd < 0) {
+			return NULL;
+		}
+		if (bind(fd, (sockaddr *) &addr, sizeof(addr)) < 0
+				|| listen(fd, LISTEN_BACKLOG) < 0) {
+			int err(errno);
+			::close(fd);
+			errno = err;
+			return NULL;
+		}
+		return new ListenStream(fd, addr.sun_path);
+	}
+
+	addrinfo *info(tcp_address(address, true));
+	if (!info) {
+		return NULL;
+	}
+	int fd(-1);
+	int err(0);
+	for (addrinfo *ai(info); ai; ai=ai->ai_next) {
+		fd = new_socket(ai->ai_family);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+		int one(1);
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0
+				&& listen(fd, LISTEN_BACKLOG) == 0) {
+			break;
+		}
+		err = errno;
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(info);
+	if (fd < 0) {
+		errno = err;
+		return NULL;
+	}
+	return new ListenStream(fd, "");
+}
+
+SocketStream * connect_socket(const string &address, bool &inprogress)
+{
+	inprogress = false;
+	if (is_unix_address(address)) {
+		sockaddr_un addr;
+		if (!unix_address(address, addr)) {
+			return NULL;
+		}
+		int fd(new_socket(AF_UNIX));
+		if (fd < 0) {
+			return NULL;
+		}
+		if (connect(fd, (sockaddr *) &addr, sizeof(addr)) < 0) {
+			int err(errno);
+			::close(fd);
+			errno = err;
+			return NULL;
+		}
+		return new SocketStream(fd);
+	}
+
+	addrinfo *info(tcp_address(address, false));
+	if (!info) {
+		return NULL;
+	}
+	int fd(-1);
+	int err(0);
+	for (addrinfo *ai(info); ai; ai=ai->ai_next) {
+		fd = new_socket(ai->ai_family);
+		if (fd < 0) {
+			err = errno;
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		if (errno == EINPROGRESS) {
+			// only the first address gets tried this way
+			inprogress = true;
+			break;
+		}
+		err = errno;
+		::close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(info);
+	if (fd < 0) {
+		errno = err;
+		return NULL;
+	}
+	return new SocketStream(fd);
+}
+
+
+void ListenStream::close()
+{
+	Stream::close();
+	if (!path.empty()) {
+		unlink(path.c_str());
+		path.clear();
+	}
+}
+
+void StreamAccept::handle()
+{
+	int fd;
+	do {
+		fd = accept4(stream->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	} while (fd < 0 && errno == EINTR);
+	complete(fd < 0 ? -errno : fd);
+}
+
+bool StreamAccept::request(IoRequest &req)
+{
+	req.op = IOREQ_ACCEPT;
+	req.fd = stream->fd;
+	req.buf = NULL;
+	req.len = 0;
+	return true;
+}
+
+bool StreamAccept::complete(int32_t result)
+{
+	if (result < 0) {
+		Failure *f = NEW_FAILURE("socketfailure", "io", "accept", 0);
+		f->debug << "accept failed: " << strerror(-result);
+		qbrt_value::fail(dst, f);
+		return true;
+	}
+	qbrt_value::stream(dst, new SocketStream(result));
+	return true;
+}
+
+/**
+ * The socket is writable once the connect is done, one way or the other
+ */
+void StreamConnect::handle()
+{
+	int err(0);
+	socklen_t len(sizeof(err));
+	if (getsockopt(stream->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+		err = errno;
+	}
+	if (err == 0) {
+		qbrt_value::stream(dst, stream);
+		return;
+	}
+	Failure *f = NEW_FAILURE("socketfailure", "io", "connect", 0);
+	f->debug << "connect failed: " << strerror(err);
+	qbrt_value::fail(dst, f);
+	stream->close();
+}
@@ -0,0 +1,132 @@
+#include "io.h"
+#include <iostream>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+extern char **environ;
+
+#define PIPE_READ	0
+#define PIPE_WRITE	1
+
+
+static int pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void close_pipes(int pipes[3][2])
+{
+	for (int i(0); i<3; ++i) {
+		for (int j(0); j<2; ++j) {
+			if (pipes[i][j] >= 0) {
+				::close(pipes[i][j]);
+			}
+		}
+	}
+}
+
+ChildStream * spawn_child(const vector< string > &argv
+		, Stream *&in, Stream *&out, Stream *&err)
+{
+	if (argv.empty()) {
+		errno = EINVAL;
+		return NULL;
+	}
+	int pipes[3][2] = { { -1, -1 }, { -1, -1 }, { -1, -1 } };
+	for (int i(0); i<3; ++i) {
+		if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+			int e(errno);
+			close_pipes(pipes);
+			errno = e;
+			return NULL;
+		}
+	}
+
+	// the dup2s clear close-on-exec for the child's ends
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipes[0][PIPE_READ], 0);
+	posix_spawn_file_actions_adddup2(&actions, pipes[1][PIPE_WRITE], 1);
+	posix_spawn_file_actions_adddup2(&actions, pipes[2][PIPE_WRITE], 2);
+
+	// qbrt ignores SIGPIPE, but the child shouldn't
+	posix_spawnattr_t attr;
+	posix_spawnattr_init(&attr);
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	posix_spawnattr_setsigmask(&attr, &sigs);
+	sigaddset(&sigs, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigs);
+	posix_spawnattr_setflags(&attr
+			, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	vector< char * > args;
+	vector< string >::const_iterator it(argv.begin());
+	for (; it!=argv.end(); ++it) {
+		args.push_back(const_cast< char * >(it->c_str()));
+	}
+	args.push_back(NULL);
+
+	pid_t pid;
+	int result(posix_spawnp(&pid, args[0], &actions, &attr, &args[0]
+				, environ));
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	if (result != 0) {
+		close_pipes(pipes);
+		errno = result;
+		return NULL;
+	}
+
+	::close(pipes[0][PIPE_READ]);
+	::close(pipes[1][PIPE_WRITE]);
+	::close(pipes[2][PIPE_WRITE]);
+	in = new ByteStream(pipes[0][PIPE_WRITE], NULL);
+	out = new ByteStream(pipes[1][PIPE_READ], NULL);
+	err = new ByteStream(pipes[2][PIPE_READ], NULL);
+	// w/o a pidfd, waiting falls back to a blocking waitpid
+	return new ChildStream(pidfd_open(pid), pid);
+}
+
+/**
+ * With a pidfd this is only called once the child has exited so the
+ * waitpid doesn't block
+ */
+void StreamWaitChild::handle()
+{
+	ChildStream &child(*static_cast< ChildStream * >(stream));
+	// in case another frame is waiting for the same child
+	pthread_mutex_lock(&child.read_mutex);
+	if (!child.exited) {
+		int status(0);
+		pid_t result;
+		do {
+			result = waitpid(child.pid, &status, 0);
+		} while (result < 0 && errno == EINTR);
+		if (result < 0) {
+			cerr << "wait failure: " << strerror(errno) << endl;
+			child.exit_code = -1;
+		} else if (WIFEXITED(status)) {
+			child.exit_code = WEXITSTATUS(status);
+		} else {
+			// same as the shell does for a signal
+			child.exit_code = 128 + WTERMSIG(status);
+		}
+		child.exited = true;
+	}
+	pthread_mutex_unlock(&child.read_mutex);
+	qbrt_value::i(dst, child.exit_code);
+}
@@ -198,6 +198,22 @@ void call_stmt::pretty(std::ostream &out) const
 	}
 }
 
+void calllazy_stmt::allocate_registers(RegAlloc *r)
+{
+	r->assign_src(*function);
+	r->alloc_dst(*result);
+}
+
+void calllazy_stmt::generate_code(AsmFunc &f)
+{
+	asm_instruction(f, new call_lazy_instruction(*result, *function));
+}
+
+void calllazy_stmt::pretty(std::ostream &out) const
+{
+	out << "calllazy " << *result << " " << *function;
+}
+
 void cfailure_stmt::allocate_registers(RegAlloc *r)
 {
 	r->alloc_dst(*dst, "core/Failure");
@@ -484,6 +500,7 @@ void dfunc_stmt::allocate_registers(RegAlloc *)
 					, (*pit)->type->fullname.value);
 		}
 	}
+	assign_slots(*code, regs);
 
 	Stmt::List::iterator it(code->begin());
 	for (; it!=code->end(); ++it) {
@@ -821,17 +838,18 @@ void patternvar_stmt::pretty(ostream &out) const
 
 void recv_stmt::allocate_registers(RegAlloc *r)
 {
+	r->assign_src(*timeout);
 	r->alloc_dst(*dst);
 }
 
 void recv_stmt::generate_code(AsmFunc &f)
 {
-	asm_instruction(f, new recv_instruction(*dst));
+	asm_instruction(f, new recv_instruction(*dst, *timeout));
 }
 
 void recv_stmt::pretty(std::ostream &out) const
 {
-	out << "recv " << *dst;
+	out << "recv " << *dst << ' ' << *timeout;
 }
 
 void ref_stmt::allocate_registers(RegAlloc *rc)
@@ -127,30 +127,78 @@ void List::reverse(qbrt_value &result, const qbrt_value &head)
 
 Promise::Promise(TaskID tid)
 : promiser(tid)
+, value()
+, refs(1)
+, fulfilled(false)
 {
 	pthread_spin_init(&lock, PTHREAD_PROCESS_PRIVATE);
 }
 Promise::~Promise()
 {
-	notify();
 	pthread_spin_destroy(&lock);
 }
 
 void Promise::mark_to_notify(bool &w)
 {
-	w = true;
 	pthread_spin_lock(&lock);
-	waiters.push_back(&w);
+	// already notified if it's been fulfilled
+	w = !fulfilled;
+	if (w) {
+		waiters.push_back(&w);
+	}
 	pthread_spin_unlock(&lock);
 }
 
 void Promise::notify()
 {
 	pthread_spin_lock(&lock);
+	notify_locked();
+	pthread_spin_unlock(&lock);
+}
+
+void Promise::notify_locked()
+{
 	list< bool * >::iterator it(waiters.begin());
 	for (; it!=waiters.end(); ++it) {
 		**it = false;
 	}
-	waiters.end();
+	waiters.clear();
+}
+
+void Promise::fulfill(const qbrt_value &result)
+{
+	pthread_spin_lock(&lock);
+	value = result;
+	fulfilled = true;
+	// notify before a waiter can redeem it and move on
+	notify_locked();
+	pthread_spin_unlock(&lock);
+}
+
+bool Promise::redeem(qbrt_value &dst)
+{
+	pthread_spin_lock(&lock);
+	bool ready(fulfilled);
+	if (ready) {
+		dst = value;
+	}
+	pthread_spin_unlock(&lock);
+	return ready;
+}
+
+void Promise::retain()
+{
+	pthread_spin_lock(&lock);
+	++refs;
 	pthread_spin_unlock(&lock);
 }
+
+void Promise::release()
+{
+	pthread_spin_lock(&lock);
+	bool last(--refs == 0);
+	pthread_spin_unlock(&lock);
+	if (last) {
+		delete this;
+	}
+}
@@ -9,6 +9,7 @@
 CCTEST(check_function_instruction_sizes)
 {
 	accert(sizeof(call_instruction)) == call_instruction::SIZE;
+	accert(sizeof(call_lazy_instruction)) == call_lazy_instruction::SIZE;
 	accert(sizeof(return_instruction)) == return_instruction::SIZE;
 	accert(sizeof(cfailure_instruction)) == cfailure_instruction::SIZE;
 	accert(sizeof(lcontext_instruction)) == lcontext_instruction::SIZE;